@@ -0,0 +1,58 @@
+#include "chunk.h"
+#include "common.h"
+#include "compiler.h"
+#include "optimizer.h"
+#include "scanner.h"
+#include "utility.h"
+#include "vm.h"
+#include <chrono>
+#include <format>
+#include <memory>
+#include <string>
+
+using namespace chunk;
+using namespace compiler;
+using namespace scanner;
+
+/*
+ * Runs the naive recursive fib(n), 30 unless given as first argument, which
+ * does little but call and return, and reports the calls per second. Build
+ * in release mode, debug builds trace every instruction.
+ */
+namespace {
+// fib(n) calls itself this often, counting the outermost call
+usize call_count(usize n) {
+    usize previous = 1;
+    usize current = 1;
+    for (usize i = 1; i < n; i++) {
+        usize next = previous + current + 1;
+        previous = current;
+        current = next;
+    }
+    return current;
+}
+} // namespace
+
+int main(int argc, const char* argv[]) {
+    usize n = argc > 1 ? std::stoul(argv[1]) : 30;
+    std::string source = std::format("fun fib(n) {{ if (n < 2) return n; return fib(n - 1) + fib(n - 2); }} var result = fib({});", n);
+
+    auto chunk = std::make_shared<Chunk>();
+    Compiler compiler{std::make_shared<Scanner>(std::move(source)), chunk};
+    if (!compiler.compile()) {
+        return 65;
+    }
+    optimizer::optimize(*chunk);
+
+    vm::VirtualMachine vm;
+    vm.load_new_chunk(chunk);
+    auto start = std::chrono::steady_clock::now();
+    if (vm.run() != vm::InterpretResult::INTERPRET_OK) {
+        return 70;
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    usize calls = call_count(n);
+    println("fib({}): {:.3f} s, {} calls, {:.1f} M calls/s", n, elapsed.count(), calls, static_cast<double>(calls) / elapsed.count() / 1e6);
+    return 0;
+}
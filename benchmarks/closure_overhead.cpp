@@ -0,0 +1,67 @@
+#include "chunk.h"
+#include "common.h"
+#include "compiler.h"
+#include "optimizer.h"
+#include "scanner.h"
+#include "utility.h"
+#include "vm.h"
+#include <chrono>
+#include <format>
+#include <memory>
+#include <string>
+
+using namespace chunk;
+using namespace compiler;
+using namespace scanner;
+
+/*
+ * Makes n counters, 1M unless given as first argument, each a closure over a
+ * local of the call that made it, and calls every one twice. Next to it the
+ * same loop calls a function that captures nothing and so never gets a
+ * closure. Reports both per iteration. Build in release mode, debug builds
+ * trace every instruction.
+ */
+namespace {
+double run(const std::string& source) {
+    auto chunk = std::make_shared<Chunk>();
+    Compiler compiler{std::make_shared<Scanner>(source), chunk};
+    if (!compiler.compile()) {
+        return -1;
+    }
+    optimizer::optimize(*chunk);
+
+    vm::VirtualMachine vm;
+    vm.load_new_chunk(chunk);
+    auto start = std::chrono::steady_clock::now();
+    if (vm.run() != vm::InterpretResult::INTERPRET_OK) {
+        return -1;
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+}
+} // namespace
+
+int main(int argc, const char* argv[]) {
+    usize n = argc > 1 ? std::stoul(argv[1]) : 1000000;
+
+    std::string closures = std::format(
+        "fun counter() {{ var count = 0; fun increment() {{ count = count + 1; return count; }} return increment; }}"
+        "var total = 0;"
+        "{{ var i = 0; while (i < {}) {{ var next = counter(); next(); total = total + next(); i = i + 1; }} }}",
+        n);
+    std::string plain = std::format(
+        "fun counter() {{ fun increment(count) {{ return count + 1; }} return increment; }}"
+        "var total = 0;"
+        "{{ var i = 0; while (i < {}) {{ var next = counter(); next(0); total = total + next(1); i = i + 1; }} }}",
+        n);
+
+    double closure_seconds = run(closures);
+    double plain_seconds = run(plain);
+    if (closure_seconds < 0 || plain_seconds < 0) {
+        return 70;
+    }
+
+    println("closures: {:.3f} s, {:.1f} ns per counter", closure_seconds, closure_seconds * 1e9 / static_cast<double>(n));
+    println("plain functions: {:.3f} s, {:.1f} ns per counter", plain_seconds, plain_seconds * 1e9 / static_cast<double>(n));
+    return 0;
+}
@@ -0,0 +1,56 @@
+#include "chunk.h"
+#include "common.h"
+#include "compiler.h"
+#include "scanner.h"
+#include "utility.h"
+#include <array>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <string_view>
+
+using namespace chunk;
+using namespace compiler;
+using namespace scanner;
+
+/*
+ * Compiles the kind of one line snippets typed into the REPL over and over,
+ * each with a fresh scanner, chunk and compiler, and reports how many
+ * snippets are compiled per second. Build in release mode, debug builds
+ * disassemble every chunk.
+ */
+namespace {
+constexpr std::array<std::string_view, 8> k_snippets{
+    "print 1 + 2 * 3;",
+    "var greeting = \"hello\";",
+    "greeting = greeting + \" world\";",
+    "print !(1 < 2) == false;",
+    "{ var a = 1; var b = a * 2; print a + b; }",
+    "if (1 > 2) print \"yes\"; else print \"no\";",
+    "for (var i = 0; i < 10; i = i + 1) print i;",
+    "{ var n = 10; while (n > 0) { n = n - 1; } }",
+};
+} // namespace
+
+int main(int argc, const char* argv[]) {
+    usize rounds = argc > 1 ? std::stoul(argv[1]) : 100000;
+
+    usize compiled = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (usize round = 0; round < rounds; round++) {
+        for (std::string_view snippet : k_snippets) {
+            auto scanner = std::make_shared<Scanner>(std::string{snippet});
+            auto chunk = std::make_shared<Chunk>();
+            Compiler compiler{scanner, chunk};
+            if (!compiler.compile()) {
+                println_err("Failed to compile '{}'", snippet);
+                return 1;
+            }
+            compiled++;
+        }
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    println("compiled {} snippets in {:.3f}s: {:.0f} snippets/s", compiled, elapsed.count(), compiled / elapsed.count());
+    return 0;
+}
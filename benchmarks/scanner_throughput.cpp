@@ -0,0 +1,65 @@
+#include "common.h"
+#include "scanner.h"
+#include "token.h"
+#include "utility.h"
+#include <array>
+#include <chrono>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <string_view>
+
+using namespace scanner;
+using namespace token;
+
+/*
+ * Scans a large identifier heavy source and reports throughput in MB/s.
+ * The source is read from the file given as first argument, or generated
+ * from a mix of keywords, keyword prefixes and plain identifiers.
+ */
+namespace {
+std::string generate_source(usize target_size) {
+    constexpr std::array<std::string_view, 16> k_words{
+        "var", "variable", "fun", "function", "for", "format", "while", "whiles",
+        "print", "printer", "this", "thistle", "true", "truth", "or", "order_id"};
+
+    std::string source;
+    source.reserve(target_size + 64);
+    usize i = 0;
+    while (source.size() < target_size) {
+        source += k_words[i % k_words.size()];
+        source += (i % 8 == 7) ? " = count_" + std::to_string(i % 1000) + ";\n" : " ";
+        i++;
+    }
+    return source;
+}
+} // namespace
+
+int main(int argc, const char* argv[]) {
+    std::string source;
+    if (argc > 1) {
+        std::ifstream input_file{argv[1], std::ios::binary};
+        if (!input_file.is_open()) {
+            println_err("Failed to open '{}'", argv[1]);
+            return 74;
+        }
+        source = std::string{std::istreambuf_iterator<char>(input_file), std::istreambuf_iterator<char>()};
+    } else {
+        source = generate_source(16 * 1024 * 1024);
+    }
+
+    constexpr usize k_rounds = 5;
+    usize tokens = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (usize round = 0; round < k_rounds; round++) {
+        Scanner scanner{source};
+        while (scanner.scan_token().get_type() != TokenType::TOKEN_EOF) {
+            tokens++;
+        }
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+    double megabytes = static_cast<double>(source.size() * k_rounds) / (1024 * 1024);
+    println("scanned {} tokens ({:.1f} MB) in {:.3f}s: {:.1f} MB/s", tokens, megabytes, elapsed.count(), megabytes / elapsed.count());
+    return 0;
+}
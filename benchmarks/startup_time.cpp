@@ -0,0 +1,117 @@
+#include "cache.h"
+#include "chunk.h"
+#include "common.h"
+#include "compiler.h"
+#include "image.h"
+#include "optimizer.h"
+#include "scanner.h"
+#include "source_buffer.h"
+#include "utility.h"
+#include "vm.h"
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unistd.h>
+
+using namespace chunk;
+using namespace scanner;
+
+/*
+ * Measures what a short-lived interpreter process pays before and while
+ * running a script: compiling it from source, loading it from a cache file
+ * and mapping it as a bytecode image. Every start uses a fresh virtual
+ * machine and reopens the files, the files themselves stay in the page
+ * cache. The script is the file given as first argument, or a generated one
+ * that runs quickly so loading dominates, it should not print.
+ */
+namespace {
+// Chunks hold at most 256 constants, the generated blocks only use literals without one.
+std::string generate_source(usize blocks) {
+    std::string source = "var greeting = \"hello\"; var ratio = 1.5;\n";
+    for (usize i = 0; i < blocks; i++) {
+        source += "{ var a = true; var b = !a; var c = a == b; if (c) { a = b; } else { b = !c; } while (false) { a = !a; } }\n";
+    }
+    return source;
+}
+
+bool write_file(const std::string& path, const std::string& data) {
+    std::ofstream output_file{path, std::ios::binary | std::ios::trunc};
+    output_file.write(data.data(), static_cast<std::streamsize>(data.size()));
+    return static_cast<bool>(output_file);
+}
+
+std::shared_ptr<Chunk> compile(SourceBuffer source) {
+    auto chunk = std::make_shared<Chunk>();
+    compiler::Compiler compiler{std::make_shared<Scanner>(std::move(source)), chunk};
+    if (!compiler.compile()) {
+        return nullptr;
+    }
+    optimizer::optimize(*chunk);
+    return chunk;
+}
+
+// Returns the time per start, or a negative time when a start failed.
+double measure(usize rounds, const std::function<std::shared_ptr<Chunk>()>& load) {
+    auto start = std::chrono::steady_clock::now();
+    for (usize round = 0; round < rounds; round++) {
+        std::shared_ptr<Chunk> chunk = load();
+        if (chunk == nullptr) {
+            return -1;
+        }
+        vm::VirtualMachine vm;
+        vm.load_new_chunk(std::move(chunk));
+        if (vm.run() != vm::InterpretResult::INTERPRET_OK) {
+            return -1;
+        }
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / static_cast<double>(rounds);
+}
+} // namespace
+
+int main(int argc, const char* argv[]) {
+    std::filesystem::path directory = std::filesystem::temp_directory_path() / ("lox_startup_" + std::to_string(getpid()));
+    std::filesystem::create_directories(directory);
+    std::string source_path = argc > 1 ? std::string{argv[1]} : (directory / "script.lox").string();
+    std::string cache_path = (directory / "script.loxc").string();
+    std::string image_path = (directory / "script.loxi").string();
+
+    if (argc <= 1 && !write_file(source_path, generate_source(20000))) {
+        println_err("Failed to write '{}'", source_path);
+        return 74;
+    }
+
+    std::optional<SourceBuffer> source = SourceBuffer::open(source_path);
+    if (!source) {
+        println_err("Failed to open '{}'", source_path);
+        return 74;
+    }
+    cache::Key key = cache::make_key(source->view(), true);
+    std::shared_ptr<Chunk> chunk = compile(std::move(source.value()));
+    if (chunk == nullptr || !cache::store(cache_path, *chunk, key) || !write_file(image_path, image::serialize(*chunk))) {
+        println_err("Failed to prepare '{}'", source_path);
+        return 65;
+    }
+
+    constexpr usize k_rounds = 20;
+    double from_source = measure(k_rounds, [&] {
+        return compile(SourceBuffer::open(source_path).value());
+    });
+    double from_cache = measure(k_rounds, [&] {
+        std::optional<SourceBuffer> script = SourceBuffer::open(source_path);
+        return cache::load(cache_path, cache::make_key(script->view(), true));
+    });
+    double from_image = measure(k_rounds, [&] {
+        return image::load(image_path);
+    });
+
+    std::filesystem::remove_all(directory);
+    println("source: {:8.3f} ms per start", from_source * 1000);
+    println("cache:  {:8.3f} ms per start", from_cache * 1000);
+    println("image:  {:8.3f} ms per start", from_image * 1000);
+    return from_source < 0 || from_cache < 0 || from_image < 0 ? 1 : 0;
+}
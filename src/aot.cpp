@@ -0,0 +1,306 @@
+#include "aot.h"
+#include "chunk.h"
+#include "common.h"
+#include "object.h"
+#include "utility.h"
+#include <charconv>
+#include <format>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <utility>
+
+using namespace chunk;
+using namespace object;
+
+namespace aot {
+namespace {
+std::string number_literal(double value) {
+    // shortest representation that round trips, so the generated
+    // constant is bit-identical to the one the compiler produced
+    char buffer[64];
+    auto [end, ec] = std::to_chars(buffer, buffer + sizeof(buffer), value);
+    return std::string{buffer, end};
+}
+
+std::string string_literal(const std::string& value) {
+    std::string literal{"\""};
+    for (char c : value) {
+        auto byte = static_cast<unsigned char>(c);
+        if (c == '"' || c == '\\') {
+            literal += '\\';
+            literal += c;
+        } else if (byte < 0x20 || byte >= 0x7f) {
+            // always three octal digits so a following digit is never
+            // swallowed into the escape sequence
+            literal += std::format("\\{:03o}", byte);
+        } else {
+            literal += c;
+        }
+    }
+    literal += '"';
+    return literal;
+}
+
+std::string label(usize offset) {
+    return std::format("L{:04d}", offset);
+}
+} // namespace
+
+Emitter::Emitter(const Chunk& chunk, std::string script_name)
+    : m_chunk{chunk},
+      m_script_name{std::move(script_name)},
+      m_jump_targets(chunk.size() + 1, false),
+      m_uses_runtime{false},
+      m_error{std::nullopt} {}
+
+bool Emitter::emit(std::ostream& out) {
+    if (!collect_jump_targets()) {
+        println_err("Cannot compile '{}' ahead of time: {}", m_script_name, m_error.value());
+        return false;
+    }
+
+    out << std::format("// Generated by cpplox_bytecode --emit-cpp from '{}'. Do not edit.\n", m_script_name);
+    out << "#include \"aot_runtime.h\"\n\n";
+    out << "namespace {\n";
+    emit_constants(out);
+    out << "\n";
+    emit_function(out, "lox_script");
+    out << "} // namespace\n\n";
+    out << "int main() {\n";
+    out << "    aot::Runtime rt;\n";
+    out << "    load_constants(rt);\n";
+    out << "    return lox_script(rt) ? 0 : 70;\n";
+    out << "}\n";
+    return true;
+}
+
+/*
+ * Walks the chunk once to validate every opcode and to record which
+ * offsets are the destination of a jump, so that only those offsets get
+ * a label in the generated code. Scripts declaring functions are rejected,
+ * the generated code has no calls.
+ */
+bool Emitter::collect_jump_targets() {
+    for (const auto& constant : m_chunk.get_constants().get_values()) {
+        if (constant->type == ObjectType::OBJ_FUNCTION) {
+            m_error = "functions are not supported";
+            return false;
+        }
+    }
+
+    const auto& code = m_chunk.get_code();
+    usize offset = 0;
+    while (offset < code.size()) {
+        m_uses_runtime = m_uses_runtime || code[offset] != OpCode::OP_RETURN;
+        switch (code[offset]) {
+        case OpCode::OP_NIL:
+        case OpCode::OP_TRUE:
+        case OpCode::OP_FALSE:
+        case OpCode::OP_POP:
+        case OpCode::OP_EQUAL:
+        case OpCode::OP_GREATER:
+        case OpCode::OP_LESS:
+        case OpCode::OP_ADD:
+        case OpCode::OP_SUBTRACT:
+        case OpCode::OP_MULTIPLY:
+        case OpCode::OP_DIVIDE:
+        case OpCode::OP_NOT:
+        case OpCode::OP_NEGATE:
+        case OpCode::OP_PRINT:
+        case OpCode::OP_RETURN:
+            offset += 1;
+            break;
+        case OpCode::OP_CONSTANT:
+        case OpCode::OP_GET_LOCAL:
+        case OpCode::OP_SET_LOCAL:
+        case OpCode::OP_GET_GLOBAL:
+        case OpCode::OP_DEFINE_GLOBAL:
+        case OpCode::OP_SET_GLOBAL:
+            offset += 2;
+            break;
+        case OpCode::OP_JUMP:
+        case OpCode::OP_JUMP_IF_FALSE:
+            m_jump_targets[offset + 3 + read_short(offset)] = true;
+            offset += 3;
+            break;
+        case OpCode::OP_LOOP:
+            m_jump_targets[offset + 3 - read_short(offset)] = true;
+            offset += 3;
+            break;
+        case OpCode::OP_FOR_PREP:
+            m_jump_targets[offset + 6 + read_short(offset + 3)] = true;
+            offset += 6;
+            break;
+        case OpCode::OP_FOR_LOOP:
+            m_jump_targets[offset + 7 - read_short(offset + 4)] = true;
+            offset += 7;
+            break;
+        default:
+            m_error = std::format("unsupported opcode {} on line {}", code[offset], m_chunk.line_at(offset));
+            return false;
+        }
+    }
+    return true;
+}
+
+void Emitter::emit_constants(std::ostream& out) {
+    const auto& constants = m_chunk.get_constants().get_values();
+    // parameters the generated code doesn't use are left unnamed, it compiles without warnings
+    out << std::format("void load_constants(aot::Runtime&{}) {{\n", constants.empty() ? "" : " rt");
+    for (const auto& constant : constants) {
+        if (constant->type == ObjectType::OBJ_NUMBER) {
+            double value = std::static_pointer_cast<NumberObject>(constant)->value;
+            out << std::format("    rt.add_number_constant({});\n", number_literal(value));
+        } else {
+            out << std::format("    rt.add_string_constant({});\n", string_literal(constant->to_string()));
+        }
+    }
+    out << "}\n";
+}
+
+void Emitter::emit_function(std::ostream& out, const std::string& name) {
+    out << std::format("bool {}(aot::Runtime&{}) {{\n", name, m_uses_runtime ? " rt" : "");
+    usize offset = 0;
+    while (offset < m_chunk.size()) {
+        if (m_jump_targets[offset]) {
+            out << label(offset) << ":\n";
+        }
+        offset = emit_instruction(out, offset);
+    }
+    if (m_jump_targets[offset]) {
+        out << label(offset) << ":\n";
+    }
+    out << "    return true;\n";
+    out << "}\n";
+}
+
+usize Emitter::emit_instruction(std::ostream& out, usize offset) {
+    const auto& code = m_chunk.get_code();
+    usize line = m_chunk.line_at(offset);
+    u8 instruction = code[offset];
+
+    // operations that can raise a runtime error leave the script early
+    auto fallible = [&](const char* op) {
+        out << std::format("    if (!rt.{}({})) {{\n        return false;\n    }}\n", op, line);
+    };
+    auto with_operand = [&](const char* op) {
+        out << std::format("    rt.{}({});\n", op, code[offset + 1]);
+    };
+    auto fallible_with_operand = [&](const char* op) {
+        out << std::format("    if (!rt.{}({}, {})) {{\n        return false;\n    }}\n", op, code[offset + 1], line);
+    };
+
+    switch (instruction) {
+    case OpCode::OP_CONSTANT:
+        with_operand("op_constant");
+        return offset + 2;
+    case OpCode::OP_NIL:
+        out << "    rt.op_nil();\n";
+        return offset + 1;
+    case OpCode::OP_TRUE:
+        out << "    rt.op_true();\n";
+        return offset + 1;
+    case OpCode::OP_FALSE:
+        out << "    rt.op_false();\n";
+        return offset + 1;
+    case OpCode::OP_POP:
+        out << "    rt.op_pop();\n";
+        return offset + 1;
+    case OpCode::OP_GET_LOCAL:
+        with_operand("op_get_local");
+        return offset + 2;
+    case OpCode::OP_SET_LOCAL:
+        with_operand("op_set_local");
+        return offset + 2;
+    case OpCode::OP_GET_GLOBAL:
+        fallible_with_operand("op_get_global");
+        return offset + 2;
+    case OpCode::OP_DEFINE_GLOBAL:
+        with_operand("op_define_global");
+        return offset + 2;
+    case OpCode::OP_SET_GLOBAL:
+        fallible_with_operand("op_set_global");
+        return offset + 2;
+    case OpCode::OP_EQUAL:
+        out << "    rt.op_equal();\n";
+        return offset + 1;
+    case OpCode::OP_GREATER:
+        fallible("op_greater");
+        return offset + 1;
+    case OpCode::OP_LESS:
+        fallible("op_less");
+        return offset + 1;
+    case OpCode::OP_ADD:
+        fallible("op_add");
+        return offset + 1;
+    case OpCode::OP_SUBTRACT:
+        fallible("op_subtract");
+        return offset + 1;
+    case OpCode::OP_MULTIPLY:
+        fallible("op_multiply");
+        return offset + 1;
+    case OpCode::OP_DIVIDE:
+        fallible("op_divide");
+        return offset + 1;
+    case OpCode::OP_NOT:
+        out << "    rt.op_not();\n";
+        return offset + 1;
+    case OpCode::OP_NEGATE:
+        fallible("op_negate");
+        return offset + 1;
+    case OpCode::OP_PRINT:
+        out << "    rt.op_print();\n";
+        return offset + 1;
+    case OpCode::OP_JUMP:
+        out << std::format("    goto {};\n", label(offset + 3 + read_short(offset)));
+        return offset + 3;
+    case OpCode::OP_JUMP_IF_FALSE:
+        out << std::format("    if (rt.is_top_falsey()) {{\n        goto {};\n    }}\n", label(offset + 3 + read_short(offset)));
+        return offset + 3;
+    case OpCode::OP_LOOP:
+        out << std::format("    goto {};\n", label(offset + 3 - read_short(offset)));
+        return offset + 3;
+    // counting loops run the instructions they were compiled from
+    case OpCode::OP_FOR_PREP:
+        emit_for_condition(out, offset, line);
+        out << std::format("    if (rt.is_top_falsey()) {{\n        rt.op_pop();\n        goto {};\n    }}\n    rt.op_pop();\n", label(offset + 6 + read_short(offset + 3)));
+        return offset + 6;
+    case OpCode::OP_FOR_LOOP: {
+        u8 flags = code[offset + 2];
+        out << std::format("    rt.op_get_local({});\n    rt.op_constant({});\n", code[offset + 1], code[offset + 4]);
+        fallible((flags & ForLoopFlags::FOR_SUBTRACT) != 0 ? "op_subtract" : "op_add");
+        out << std::format("    rt.op_set_local({});\n    rt.op_pop();\n", code[offset + 1]);
+        emit_for_condition(out, offset, line);
+        out << std::format("    if (!rt.is_top_falsey()) {{\n        rt.op_pop();\n        goto {};\n    }}\n    rt.op_pop();\n", label(offset + 7 - read_short(offset + 4)));
+        return offset + 7;
+    }
+    case OpCode::OP_RETURN:
+        out << "    return true;\n";
+        return offset + 1;
+    default:
+        // rejected by collect_jump_targets
+        return offset + 1;
+    }
+}
+
+// Leaves the condition of the counting loop at the offset on the stack.
+void Emitter::emit_for_condition(std::ostream& out, usize offset, usize line) {
+    const auto& code = m_chunk.get_code();
+    u8 flags = code[offset + 2];
+    u8 comparison = flags & ForLoopFlags::FOR_COMPARISON;
+    bool less = comparison == ForLoopFlags::FOR_LESS || comparison == ForLoopFlags::FOR_GREATER_EQUAL;
+    out << std::format("    rt.op_get_local({});\n", code[offset + 1]);
+    out << std::format("    rt.{}({});\n", (flags & ForLoopFlags::FOR_BOUND_CONSTANT) != 0 ? "op_constant" : "op_get_local", code[offset + 3]);
+    out << std::format("    if (!rt.{}({})) {{\n        return false;\n    }}\n", less ? "op_less" : "op_greater", line);
+    if (comparison == ForLoopFlags::FOR_LESS_EQUAL || comparison == ForLoopFlags::FOR_GREATER_EQUAL) {
+        out << "    rt.op_not();\n";
+    }
+}
+
+u16 Emitter::read_short(usize offset) const {
+    const auto& code = m_chunk.get_code();
+    return static_cast<u16>((code[offset + 1] << 8) | code[offset + 2]);
+}
+
+} // namespace aot
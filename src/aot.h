@@ -0,0 +1,41 @@
+#pragma once
+
+#include "chunk.h"
+#include "common.h"
+#include <optional>
+#include <ostream>
+#include <string>
+#include <vector>
+
+namespace aot {
+
+/*
+ * Translates a compiled chunk into a C++ translation unit that links
+ * against the interpreter library (see aot_runtime.h). Each bytecode
+ * instruction becomes a direct call into `aot::Runtime`, and jumps become
+ * `goto`s, so the system compiler sees the whole program without a
+ * dispatch loop in between.
+ */
+class Emitter {
+public:
+    Emitter(const chunk::Chunk& chunk, std::string script_name);
+
+    bool emit(std::ostream& out);
+
+private:
+    bool collect_jump_targets();
+    void emit_constants(std::ostream& out);
+    void emit_function(std::ostream& out, const std::string& name);
+    usize emit_instruction(std::ostream& out, usize offset);
+    void emit_for_condition(std::ostream& out, usize offset, usize line);
+    u16 read_short(usize offset) const;
+
+    const chunk::Chunk& m_chunk;
+    std::string m_script_name;
+    std::vector<bool> m_jump_targets;
+    // the script does more than return, so its function uses the runtime
+    bool m_uses_runtime;
+    std::optional<std::string> m_error;
+};
+
+} // namespace aot
@@ -0,0 +1,217 @@
+#include "aot_runtime.h"
+#include "common.h"
+#include "object.h"
+#include "table.h"
+#include "utility.h"
+#include "value.h"
+#include <memory>
+#include <string>
+#include <utility>
+
+using namespace object;
+using namespace value;
+
+namespace aot {
+
+void Runtime::add_number_constant(double value) {
+    m_constants.emplace_back(std::make_shared<NumberObject>(value));
+}
+
+void Runtime::add_string_constant(std::string value) {
+    m_constants.emplace_back(std::make_shared<StringObject>(std::move(value)));
+}
+
+void Runtime::op_constant(u8 index) {
+    push(m_constants[index]);
+}
+
+void Runtime::op_nil() {
+    push(std::make_shared<NullObject>());
+}
+
+void Runtime::op_true() {
+    push(std::make_shared<BooleanObject>(true));
+}
+
+void Runtime::op_false() {
+    push(std::make_shared<BooleanObject>(false));
+}
+
+void Runtime::op_pop() {
+    m_stack.pop_back();
+}
+
+void Runtime::op_get_local(u8 slot) {
+    push(m_stack[slot]);
+}
+
+void Runtime::op_set_local(u8 slot) {
+    m_stack[slot] = m_stack.back();
+}
+
+bool Runtime::op_get_global(u8 name, usize line) {
+    auto key = std::static_pointer_cast<StringObject>(m_constants[name]);
+    std::shared_ptr<Object> value;
+    if (!m_globals.get(key, value)) {
+        runtime_error("Undefined variable '" + key->to_string() + "'.", line);
+        return false;
+    }
+    push(std::move(value));
+    return true;
+}
+
+void Runtime::op_define_global(u8 name) {
+    auto key = std::static_pointer_cast<StringObject>(m_constants[name]);
+    m_globals.set(key, m_stack.back());
+    pop();
+}
+
+bool Runtime::op_set_global(u8 name, usize line) {
+    auto key = std::static_pointer_cast<StringObject>(m_constants[name]);
+    if (m_globals.set(key, m_stack.back())) {
+        m_globals.del(key);
+        runtime_error("Undefined variable '" + key->to_string() + "'.", line);
+        return false;
+    }
+    return true;
+}
+
+void Runtime::op_equal() {
+    auto rhs = pop();
+    auto lhs = pop();
+    push(std::make_shared<BooleanObject>(lhs->is_equal(*rhs)));
+}
+
+bool Runtime::op_greater(usize line) {
+    double lhs = 0;
+    double rhs = 0;
+    if (!pop_numbers(lhs, rhs, line)) {
+        return false;
+    }
+    push(std::make_shared<BooleanObject>(lhs > rhs));
+    return true;
+}
+
+bool Runtime::op_less(usize line) {
+    double lhs = 0;
+    double rhs = 0;
+    if (!pop_numbers(lhs, rhs, line)) {
+        return false;
+    }
+    push(std::make_shared<BooleanObject>(lhs < rhs));
+    return true;
+}
+
+bool Runtime::op_add(usize line) {
+    const auto& rhs = m_stack[m_stack.size() - 1];
+    const auto& lhs = m_stack[m_stack.size() - 2];
+    if (lhs->type == ObjectType::OBJ_STRING && rhs->type == ObjectType::OBJ_STRING) {
+        std::string new_string = lhs->to_string() + rhs->to_string();
+        pop();
+        pop();
+        push(make_obj_string_interned(m_strings, std::move(new_string)));
+        return true;
+    }
+
+    if (lhs->type == ObjectType::OBJ_NUMBER && rhs->type == ObjectType::OBJ_NUMBER) {
+        double lhs_value = 0;
+        double rhs_value = 0;
+        pop_numbers(lhs_value, rhs_value, line);
+        push(std::make_shared<NumberObject>(lhs_value + rhs_value));
+        return true;
+    }
+
+    runtime_error("Operands must be two numbers or two strings.", line);
+    return false;
+}
+
+bool Runtime::op_subtract(usize line) {
+    double lhs = 0;
+    double rhs = 0;
+    if (!pop_numbers(lhs, rhs, line)) {
+        return false;
+    }
+    push(std::make_shared<NumberObject>(lhs - rhs));
+    return true;
+}
+
+bool Runtime::op_multiply(usize line) {
+    double lhs = 0;
+    double rhs = 0;
+    if (!pop_numbers(lhs, rhs, line)) {
+        return false;
+    }
+    push(std::make_shared<NumberObject>(lhs * rhs));
+    return true;
+}
+
+bool Runtime::op_divide(usize line) {
+    double lhs = 0;
+    double rhs = 0;
+    if (!pop_numbers(lhs, rhs, line)) {
+        return false;
+    }
+    push(std::make_shared<NumberObject>(lhs / rhs));
+    return true;
+}
+
+void Runtime::op_not() {
+    push(std::make_shared<BooleanObject>(pop()->is_falsey()));
+}
+
+bool Runtime::op_negate(usize line) {
+    if (m_stack.back()->type != ObjectType::OBJ_NUMBER) {
+        runtime_error("Operand must be a number.", line);
+        return false;
+    }
+    auto value = std::static_pointer_cast<NumberObject>(pop());
+    push(std::make_shared<NumberObject>(-value->value));
+    return true;
+}
+
+void Runtime::op_print() {
+    std::shared_ptr<Object> value = pop();
+    if (value->type == ObjectType::OBJ_NUMBER) {
+        m_output.write_number(static_cast<const NumberObject&>(*value).value);
+    } else if (value->type == ObjectType::OBJ_STRING) {
+        m_output.write(static_cast<const StringObject&>(*value).value);
+    } else {
+        m_output.write(value->to_string());
+    }
+    m_output.write("\n\n");
+}
+
+bool Runtime::is_top_falsey() const {
+    return m_stack.back()->is_falsey();
+}
+
+void Runtime::push(std::shared_ptr<Object> value) {
+    m_stack.emplace_back(std::move(value));
+}
+
+std::shared_ptr<Object> Runtime::pop() {
+    std::shared_ptr<Object> value = std::move(m_stack.back());
+    m_stack.pop_back();
+    return value;
+}
+
+bool Runtime::pop_numbers(double& out_lhs, double& out_rhs, usize line) {
+    const auto rhs = pop();
+    const auto lhs = pop();
+    if (lhs->type != ObjectType::OBJ_NUMBER || rhs->type != ObjectType::OBJ_NUMBER) {
+        runtime_error("Operands must be numbers.", line);
+        return false;
+    }
+
+    out_lhs = std::static_pointer_cast<NumberObject>(lhs)->value;
+    out_rhs = std::static_pointer_cast<NumberObject>(rhs)->value;
+    return true;
+}
+
+void Runtime::runtime_error(const std::string& message, usize line) {
+    m_output.flush();
+    print_err("{}", message);
+    println_err("[line {}] in script", line);
+}
+
+} // namespace aot
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "common.h"
+#include "output.h"
+#include "table.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace object {
+class Object;
+} // namespace object
+
+namespace aot {
+
+/*
+ * Runtime support for programs produced by `cpplox_bytecode --emit-cpp`.
+ * The generated code replaces the dispatch loop with straight-line calls
+ * into this class, one call per bytecode instruction, while values keep
+ * using the interpreter's object model and string intern table.
+ * Operations that can fail take the source line of the instruction and
+ * return false after reporting the runtime error.
+ */
+class Runtime {
+public:
+    void add_number_constant(double value);
+    void add_string_constant(std::string value);
+
+    void op_constant(u8 index);
+    void op_nil();
+    void op_true();
+    void op_false();
+    void op_pop();
+    void op_get_local(u8 slot);
+    void op_set_local(u8 slot);
+    bool op_get_global(u8 name, usize line);
+    void op_define_global(u8 name);
+    bool op_set_global(u8 name, usize line);
+    void op_equal();
+    bool op_greater(usize line);
+    bool op_less(usize line);
+    bool op_add(usize line);
+    bool op_subtract(usize line);
+    bool op_multiply(usize line);
+    bool op_divide(usize line);
+    void op_not();
+    bool op_negate(usize line);
+    void op_print();
+
+    [[nodiscard]] bool is_top_falsey() const;
+
+private:
+    void push(std::shared_ptr<object::Object> value);
+    std::shared_ptr<object::Object> pop();
+    bool pop_numbers(double& lhs, double& rhs, usize line);
+    void runtime_error(const std::string& message, usize line);
+
+    std::vector<std::shared_ptr<object::Object>> m_constants;
+    std::vector<std::shared_ptr<object::Object>> m_stack;
+    table::Table m_strings;
+    table::Table m_globals;
+    output::Sink m_output;
+};
+
+} // namespace aot
@@ -0,0 +1,130 @@
+#pragma once
+
+#include "common.h"
+#include "object.h"
+#include <concepts>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+namespace binding {
+
+/*
+ * How a C++ type crosses into scripts and back: `is` checks that a value
+ * has the type, `from` unpacks it and `to` boxes a C++ value. Everything
+ * is resolved at compile time, a type without a converter does not compile.
+ */
+template<typename T>
+struct Converter;
+
+// Any arithmetic type but bool, scripts only have doubles.
+template<typename T>
+    requires std::is_arithmetic_v<T> && (!std::same_as<T, bool>)
+struct Converter<T> {
+    static bool is(const std::shared_ptr<object::Object>& value) {
+        return value->type == object::ObjectType::OBJ_NUMBER;
+    }
+    static T from(const std::shared_ptr<object::Object>& value) {
+        return static_cast<T>(static_cast<const object::NumberObject&>(*value).value);
+    }
+    static std::shared_ptr<object::Object> to(T value) {
+        return std::make_shared<object::NumberObject>(static_cast<double>(value));
+    }
+};
+
+template<>
+struct Converter<bool> {
+    static bool is(const std::shared_ptr<object::Object>& value) {
+        return value->type == object::ObjectType::OBJ_BOOLEAN;
+    }
+    static bool from(const std::shared_ptr<object::Object>& value) {
+        return static_cast<const object::BooleanObject&>(*value).value;
+    }
+    static std::shared_ptr<object::Object> to(bool value) {
+        return std::make_shared<object::BooleanObject>(value);
+    }
+};
+
+template<>
+struct Converter<std::string> {
+    static bool is(const std::shared_ptr<object::Object>& value) {
+        return value->type == object::ObjectType::OBJ_STRING;
+    }
+    static std::string from(const std::shared_ptr<object::Object>& value) {
+        return static_cast<const object::StringObject&>(*value).value;
+    }
+    static std::shared_ptr<object::Object> to(const std::string& value) {
+        return std::make_shared<object::StringObject>(value);
+    }
+};
+
+// Views into the string argument, valid until the host function returns.
+template<>
+struct Converter<std::string_view> {
+    static bool is(const std::shared_ptr<object::Object>& value) {
+        return value->type == object::ObjectType::OBJ_STRING;
+    }
+    static std::string_view from(const std::shared_ptr<object::Object>& value) {
+        return static_cast<const object::StringObject&>(*value).value;
+    }
+    static std::shared_ptr<object::Object> to(std::string_view value) {
+        return std::make_shared<object::StringObject>(std::string{value});
+    }
+};
+
+// For string literals passed to scripts.
+template<>
+struct Converter<const char*> {
+    static std::shared_ptr<object::Object> to(const char* value) {
+        return std::make_shared<object::StringObject>(value);
+    }
+};
+
+// Any value, passed as it is.
+template<>
+struct Converter<std::shared_ptr<object::Object>> {
+    static bool is(const std::shared_ptr<object::Object>&) {
+        return true;
+    }
+    static std::shared_ptr<object::Object> from(const std::shared_ptr<object::Object>& value) {
+        return value;
+    }
+    static std::shared_ptr<object::Object> to(std::shared_ptr<object::Object> value) {
+        return value;
+    }
+};
+
+template<typename T>
+using ConverterFor = Converter<std::decay_t<T>>;
+
+template<typename R, typename... Args>
+constexpr usize arity(R (*)(Args...)) {
+    return sizeof...(Args);
+}
+
+template<auto k_function, typename R, typename... Args, usize... k_indices>
+std::shared_ptr<object::Object> call_host(const std::shared_ptr<object::Object>* args, R (*)(Args...), std::index_sequence<k_indices...>) {
+    if (!(ConverterFor<Args>::is(args[k_indices]) && ...)) {
+        return nullptr;
+    }
+    if constexpr (std::is_void_v<R>) {
+        k_function(ConverterFor<Args>::from(args[k_indices])...);
+        return std::make_shared<object::NullObject>();
+    } else {
+        return ConverterFor<R>::to(k_function(ConverterFor<Args>::from(args[k_indices])...));
+    }
+}
+
+/*
+ * The native calling a host function, generated for every bound function.
+ * It unpacks the arguments, calls the function directly and boxes what it
+ * returns, nil for void. Arguments of the wrong type are a runtime error.
+ */
+template<auto k_function>
+std::shared_ptr<object::Object> native(const std::shared_ptr<object::Object>* args, u8) {
+    return call_host<k_function>(args, k_function, std::make_index_sequence<arity(k_function)>{});
+}
+
+} // namespace binding
@@ -0,0 +1,372 @@
+#include "cache.h"
+#include "chunk.h"
+#include "common.h"
+#include "object.h"
+#include "source_buffer.h"
+#include "value.h"
+#include <bit>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <format>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+using namespace chunk;
+using namespace object;
+
+namespace cache {
+
+namespace {
+constexpr std::string_view k_magic = "LOXC";
+
+class Writer {
+public:
+    void put_varint(u64 value) {
+        while (value >= 0x80) {
+            m_data.push_back(static_cast<char>((value & 0x7f) | 0x80));
+            value >>= 7;
+        }
+        m_data.push_back(static_cast<char>(value));
+    }
+
+    void put_u64(u64 value) {
+        for (int i = 0; i < 8; i++) {
+            m_data.push_back(static_cast<char>((value >> (8 * i)) & 0xff));
+        }
+    }
+
+    void put_bytes(std::string_view bytes) {
+        m_data.append(bytes);
+    }
+
+    std::string take() {
+        return std::move(m_data);
+    }
+
+private:
+    std::string m_data;
+};
+
+/*
+ * Reads never go past the end of the data, a read that would fails the
+ * reader and returns zeroes, callers check `failed` once they are done.
+ */
+class Reader {
+public:
+    explicit Reader(std::string_view data)
+        : m_data{data} {}
+
+    u64 get_varint() {
+        u64 value = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            if (m_position >= m_data.size()) {
+                break;
+            }
+            u8 byte = static_cast<u8>(m_data[m_position++]);
+            value |= static_cast<u64>(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0) {
+                return value;
+            }
+        }
+        m_failed = true;
+        return 0;
+    }
+
+    u64 get_u64() {
+        std::string_view bytes = get_bytes(8);
+        u64 value = 0;
+        for (int i = 0; i < static_cast<int>(bytes.size()); i++) {
+            value |= static_cast<u64>(static_cast<u8>(bytes[i])) << (8 * i);
+        }
+        return value;
+    }
+
+    std::string_view get_bytes(u64 count) {
+        if (count > m_data.size() - m_position) {
+            m_failed = true;
+            m_position = m_data.size();
+            return {};
+        }
+        std::string_view bytes = m_data.substr(m_position, count);
+        m_position += count;
+        return bytes;
+    }
+
+    // Every element of a sequence takes at least a byte, longer sequences are corrupt.
+    bool fits(u64 count) {
+        if (count > m_data.size() - m_position) {
+            m_failed = true;
+        }
+        return !m_failed;
+    }
+
+    [[nodiscard]] bool failed() const {
+        return m_failed;
+    }
+
+    [[nodiscard]] bool at_end() const {
+        return m_position == m_data.size();
+    }
+
+private:
+    std::string_view m_data;
+    usize m_position{0};
+    bool m_failed{false};
+};
+
+void write_key(Writer& writer, const Key& key) {
+    writer.put_bytes(k_magic);
+    writer.put_varint(k_format_version);
+    writer.put_varint(key.optimized ? 1 : 0);
+    writer.put_u64(key.source_hash);
+    writer.put_varint(key.source_size);
+}
+
+void write_chunk(Writer& writer, const Chunk& chunk);
+
+void write_function(Writer& writer, const FunctionObject& function) {
+    writer.put_varint(function.name.size());
+    writer.put_bytes(function.name);
+    writer.put_varint(function.arity);
+    write_chunk(writer, *function.chunk);
+}
+
+void write_chunk(Writer& writer, const Chunk& chunk) {
+    const std::vector<u8>& code = chunk.get_code();
+    writer.put_varint(code.size());
+    writer.put_bytes({reinterpret_cast<const char*>(code.data()), code.size()});
+
+    std::span<const LineRun> runs = chunk.get_line_runs();
+    writer.put_varint(runs.size());
+    for (usize i = 0; i < runs.size(); i++) {
+        usize end = i + 1 < runs.size() ? runs[i + 1].offset : code.size();
+        writer.put_varint(runs[i].line);
+        writer.put_varint(end - runs[i].offset);
+    }
+
+    const auto& constants = chunk.get_constants().get_values();
+    writer.put_varint(constants.size());
+    for (const auto& constant : constants) {
+        writer.put_varint(static_cast<u64>(constant->type));
+        switch (constant->type) {
+        case ObjectType::OBJ_NUMBER:
+            writer.put_u64(std::bit_cast<u64>(static_cast<const NumberObject&>(*constant).value));
+            break;
+        case ObjectType::OBJ_BOOLEAN:
+            writer.put_varint(static_cast<const BooleanObject&>(*constant).value ? 1 : 0);
+            break;
+        case ObjectType::OBJ_STRING: {
+            const std::string& value = static_cast<const StringObject&>(*constant).value;
+            writer.put_varint(value.size());
+            writer.put_bytes(value);
+        } break;
+        case ObjectType::OBJ_FUNCTION:
+            write_function(writer, static_cast<const FunctionObject&>(*constant));
+            break;
+        default:
+            break;
+        }
+    }
+
+    writer.put_varint(chunk.inline_cache_count());
+}
+
+// Functions nest no deeper than this, deeper nesting is taken as corrupt.
+constexpr usize k_max_nesting = 256;
+
+std::shared_ptr<Chunk> read_chunk(Reader& reader, usize nesting);
+
+std::shared_ptr<FunctionObject> read_function(Reader& reader, usize nesting) {
+    u64 name_length = reader.get_varint();
+    std::string name{reader.get_bytes(name_length)};
+    u64 arity = reader.get_varint();
+    if (arity > UINT8_MAX || nesting == k_max_nesting) {
+        return nullptr;
+    }
+    std::shared_ptr<Chunk> chunk = read_chunk(reader, nesting + 1);
+    if (chunk == nullptr) {
+        return nullptr;
+    }
+    return std::make_shared<FunctionObject>(std::move(name), static_cast<u8>(arity), std::move(chunk));
+}
+
+std::shared_ptr<Chunk> read_chunk(Reader& reader, usize nesting) {
+    auto chunk = std::make_shared<Chunk>();
+
+    u64 code_size = reader.get_varint();
+    std::string_view code = reader.get_bytes(code_size);
+
+    u64 run_count = reader.get_varint();
+    usize offset = 0;
+    for (u64 run = 0; run < run_count && reader.fits(run_count - run); run++) {
+        u64 line = reader.get_varint();
+        u64 length = reader.get_varint();
+        if (length > code.size() - offset) {
+            return nullptr;
+        }
+        for (u64 i = 0; i < length; i++) {
+            chunk->write_byte(static_cast<u8>(code[offset++]), line);
+        }
+    }
+    if (offset != code.size()) {
+        return nullptr;
+    }
+
+    u64 constant_count = reader.get_varint();
+    for (u64 i = 0; i < constant_count && reader.fits(constant_count - i); i++) {
+        std::shared_ptr<Object> constant;
+        switch (static_cast<ObjectType>(reader.get_varint())) {
+        case ObjectType::OBJ_NULL:
+            constant = std::make_shared<NullObject>();
+            break;
+        case ObjectType::OBJ_NUMBER:
+            constant = std::make_shared<NumberObject>(std::bit_cast<double>(reader.get_u64()));
+            break;
+        case ObjectType::OBJ_BOOLEAN:
+            constant = std::make_shared<BooleanObject>(reader.get_varint() != 0);
+            break;
+        case ObjectType::OBJ_STRING: {
+            u64 length = reader.get_varint();
+            constant = std::make_shared<StringObject>(std::string{reader.get_bytes(length)});
+        } break;
+        case ObjectType::OBJ_FUNCTION:
+            constant = read_function(reader, nesting);
+            if (constant == nullptr) {
+                return nullptr;
+            }
+            break;
+        default:
+            return nullptr;
+        }
+        (void)chunk->write_constant(std::move(constant));
+    }
+
+    // every cache belongs to an instruction of at least four bytes
+    u64 inline_cache_count = reader.get_varint();
+    if (inline_cache_count > code.size() / 4) {
+        return nullptr;
+    }
+    for (u64 i = 0; i < inline_cache_count; i++) {
+        chunk->add_inline_cache();
+    }
+
+    if (reader.failed()) {
+        return nullptr;
+    }
+    return chunk;
+}
+} // namespace
+
+Key make_key(std::string_view source, bool optimized) {
+    return Key{hash_source(source), source.size(), optimized};
+}
+
+/*
+ * FNV-1a over 8 byte words instead of single bytes, with a shift folding the
+ * high bits back in after every multiplication. Checking the cache has to
+ * hash the whole script, this keeps that well below the cost of scanning it.
+ */
+u64 hash_source(std::string_view source) {
+    constexpr u64 k_prime = 1099511628211ull;
+    u64 hash = 14695981039346656037ull;
+
+    usize i = 0;
+    for (; i + 8 <= source.size(); i += 8) {
+        u64 word;
+        std::memcpy(&word, source.data() + i, sizeof(word));
+        hash = (hash ^ word) * k_prime;
+        hash ^= hash >> 29;
+    }
+    for (; i < source.size(); i++) {
+        hash = (hash ^ static_cast<u8>(source[i])) * k_prime;
+    }
+    return hash;
+}
+
+std::string cache_path(const std::string& script_path, const std::string& cache_dir) {
+    if (cache_dir.empty()) {
+        return std::filesystem::path{script_path}.replace_extension(".loxc").string();
+    }
+
+    std::string absolute_path = std::filesystem::absolute(script_path).lexically_normal().string();
+    return (std::filesystem::path{cache_dir} / std::format("{:016x}.loxc", hash_source(absolute_path))).string();
+}
+
+std::string serialize(const Chunk& chunk, const Key& key) {
+    Writer writer;
+    write_key(writer, key);
+    write_chunk(writer, chunk);
+    return writer.take();
+}
+
+std::shared_ptr<Chunk> deserialize(std::string_view data, const Key& key) {
+    Reader reader{data};
+    if (reader.get_bytes(k_magic.size()) != k_magic || reader.get_varint() != k_format_version) {
+        return nullptr;
+    }
+
+    Key stored{};
+    stored.optimized = reader.get_varint() != 0;
+    stored.source_hash = reader.get_u64();
+    stored.source_size = reader.get_varint();
+    if (reader.failed() || stored != key) {
+        return nullptr;
+    }
+
+    std::shared_ptr<Chunk> chunk = read_chunk(reader, 0);
+    if (chunk == nullptr || !reader.at_end()) {
+        return nullptr;
+    }
+    return chunk;
+}
+
+std::shared_ptr<Chunk> load(const std::string& path, const Key& key) {
+    std::optional<scanner::SourceBuffer> data = scanner::SourceBuffer::open(path);
+    if (!data || !data->is_mapped()) {
+        return nullptr;
+    }
+    return deserialize(data->view(), key);
+}
+
+/*
+ * Written to a temporary file first and renamed over the cache file, so a
+ * concurrent run sees either the old or the new file and never a partial one.
+ */
+bool store(const std::string& path, const Chunk& chunk, const Key& key) {
+    std::error_code error;
+    std::filesystem::path parent = std::filesystem::path{path}.parent_path();
+    if (!parent.empty()) {
+        std::filesystem::create_directories(parent, error);
+    }
+
+    std::string temporary_path = std::format("{}.{}.tmp", path, getpid());
+    {
+        std::ofstream output_file{temporary_path, std::ios::binary | std::ios::trunc};
+        if (!output_file.is_open()) {
+            return false;
+        }
+        std::string data = serialize(chunk, key);
+        output_file.write(data.data(), static_cast<std::streamsize>(data.size()));
+        if (!output_file) {
+            output_file.close();
+            std::remove(temporary_path.c_str());
+            return false;
+        }
+    }
+
+    if (std::rename(temporary_path.c_str(), path.c_str()) != 0) {
+        std::remove(temporary_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+} // namespace cache
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "chunk.h"
+#include "common.h"
+#include <memory>
+#include <string>
+#include <string_view>
+
+namespace cache {
+
+/*
+ * On-disk bytecode cache. A cache file holds a compiled chunk together with
+ * the key of the source it was compiled from and is only used when the key
+ * matches, so editing a script or changing the optimization level simply
+ * recompiles it. Layout, integers are unsigned LEB128 varints:
+ *
+ *   "LOXC" version optimized source_hash(8 bytes) source_size
+ *   code_size code...
+ *   run_count (line run_length)...      line table, run length encoded
+ *   constant_count (type payload)...    type is an object::ObjectType
+ *   inline_cache_count                  see chunk::InlineCache
+ *
+ * Numbers are stored as their 8 byte IEEE representation, strings as their
+ * length followed by their bytes. Functions are stored as their name like a
+ * string, their arity and then their own chunk in the layout above from
+ * code_size on.
+ */
+
+constexpr u32 k_format_version = 3;
+
+struct Key {
+    u64 source_hash;
+    u64 source_size;
+    bool optimized;
+
+    bool operator==(const Key& other) const = default;
+};
+
+[[nodiscard]] Key make_key(std::string_view source, bool optimized);
+// Hash of the source text, not cryptographic, it only has to notice edits.
+[[nodiscard]] u64 hash_source(std::string_view source);
+
+// Cache file for a script, next to it or named after its absolute path in `cache_dir`.
+[[nodiscard]] std::string cache_path(const std::string& script_path, const std::string& cache_dir);
+
+[[nodiscard]] std::string serialize(const chunk::Chunk& chunk, const Key& key);
+// Returns nullptr when the data is not a cache file for `key` of this version.
+[[nodiscard]] std::shared_ptr<chunk::Chunk> deserialize(std::string_view data, const Key& key);
+
+// Returns nullptr when there is no usable cache file at `path`.
+[[nodiscard]] std::shared_ptr<chunk::Chunk> load(const std::string& path, const Key& key);
+// Writes the cache file atomically, returns false when it could not be written.
+bool store(const std::string& path, const chunk::Chunk& chunk, const Key& key);
+
+} // namespace cache
@@ -2,29 +2,265 @@
 #include "common.h"
 #include "object.h"
 #include "value.h"
+#include <algorithm>
 #include <memory>
+#include <optional>
+#include <span>
+#include <utility>
 #include <vector>
 
 using namespace object;
 
 namespace chunk {
+namespace {
+struct StackEffect {
+    usize length;
+    int delta;
+};
+
+std::optional<StackEffect> stack_effect(u8 instruction) {
+    switch (instruction) {
+    case OpCode::OP_NIL:
+    case OpCode::OP_TRUE:
+    case OpCode::OP_FALSE:
+        return StackEffect{1, 1};
+    case OpCode::OP_POP:
+    case OpCode::OP_CLOSE_UPVALUE:
+    case OpCode::OP_EQUAL:
+    case OpCode::OP_GREATER:
+    case OpCode::OP_LESS:
+    case OpCode::OP_ADD:
+    case OpCode::OP_SUBTRACT:
+    case OpCode::OP_MULTIPLY:
+    case OpCode::OP_DIVIDE:
+    case OpCode::OP_PRINT:
+        return StackEffect{1, -1};
+    case OpCode::OP_NOT:
+    case OpCode::OP_NEGATE:
+    case OpCode::OP_RETURN:
+        return StackEffect{1, 0};
+    case OpCode::OP_GET_INDEX:
+        return StackEffect{1, -1};
+    case OpCode::OP_SET_INDEX:
+        return StackEffect{1, -2};
+    // pops the elements as well, see max_stack_depth
+    case OpCode::OP_BUILD_LIST:
+        return StackEffect{2, 1};
+    case OpCode::OP_CONSTANT:
+    case OpCode::OP_GET_LOCAL:
+    case OpCode::OP_GET_GLOBAL:
+    case OpCode::OP_GET_UPVALUE:
+    case OpCode::OP_CLASS:
+        return StackEffect{2, 1};
+    case OpCode::OP_DEFINE_GLOBAL:
+    case OpCode::OP_METHOD:
+        return StackEffect{2, -1};
+    case OpCode::OP_SET_LOCAL:
+    case OpCode::OP_SET_GLOBAL:
+    case OpCode::OP_SET_UPVALUE:
+        return StackEffect{2, 0};
+    // pops the arguments as well, see max_stack_depth
+    case OpCode::OP_CALL:
+    case OpCode::OP_TAIL_CALL:
+        return StackEffect{2, 0};
+    case OpCode::OP_JUMP:
+    case OpCode::OP_JUMP_IF_FALSE:
+    case OpCode::OP_LOOP:
+        return StackEffect{3, 0};
+    // followed by the upvalue pairs, see max_stack_depth
+    case OpCode::OP_CLOSURE:
+        return StackEffect{3, 1};
+    case OpCode::OP_GET_PROPERTY:
+        return StackEffect{4, 0};
+    case OpCode::OP_SET_PROPERTY:
+        return StackEffect{4, -1};
+    case OpCode::OP_INHERIT:
+        return StackEffect{1, -1};
+    case OpCode::OP_GET_SUPER:
+        return StackEffect{2, -1};
+    // pop the arguments as well, see max_stack_depth
+    case OpCode::OP_INVOKE:
+        return StackEffect{5, 0};
+    case OpCode::OP_SUPER_INVOKE:
+        return StackEffect{3, -1};
+    case OpCode::OP_FOR_PREP:
+        return StackEffect{6, 0};
+    case OpCode::OP_FOR_LOOP:
+        return StackEffect{7, 0};
+    default:
+        return std::nullopt;
+    }
+}
+} // namespace
+
+std::shared_ptr<Chunk> Chunk::borrow(std::span<const u8> code, std::span<const LineRun> lines, std::shared_ptr<const void> backing) {
+    auto chunk = std::make_shared<Chunk>();
+    chunk->m_borrowed_code = code;
+    chunk->m_borrowed_lines = lines;
+    chunk->m_backing = std::move(backing);
+    return chunk;
+}
+
 usize Chunk::size() const {
-    return m_code.size();
+    return code().size();
+}
+
+std::span<const u8> Chunk::code() const {
+    if (m_backing != nullptr) {
+        return m_borrowed_code;
+    }
+    return m_code;
+}
+
+usize Chunk::line_at(usize offset) const {
+    std::span<const LineRun> runs = get_line_runs();
+    auto run = std::upper_bound(runs.begin(), runs.end(), offset, [](usize offset, const LineRun& run) {
+        return offset < run.offset;
+    });
+    return run == runs.begin() ? 0 : std::prev(run)->line;
+}
+
+std::span<const LineRun> Chunk::get_line_runs() const {
+    if (m_backing != nullptr) {
+        return m_borrowed_lines;
+    }
+    return m_line_runs;
 }
 
 void Chunk::write_byte(u8 byte, usize line) {
+    if (m_line_runs.empty() || m_line_runs.back().line != line) {
+        m_line_runs.push_back({static_cast<u32>(m_code.size()), static_cast<u32>(line)});
+    }
     m_code.emplace_back(byte);
-    m_lines.emplace_back(line);
 }
 
 void Chunk::write_byte_at(usize offset, u8 byte) {
     m_code[offset] = byte;
 }
 
+void Chunk::truncate(usize size) {
+    m_code.resize(size);
+    while (!m_line_runs.empty() && m_line_runs.back().offset >= size) {
+        m_line_runs.pop_back();
+    }
+}
+
 const std::vector<u8>& Chunk::get_code() const {
     return m_code;
 }
 
+std::optional<usize> Chunk::max_stack_depth() const {
+    std::span<const u8> code = this->code();
+    std::vector<int> depth_at(code.size() + 1, -1);
+    std::vector<usize> work{0};
+    depth_at[0] = 0;
+
+    // the depth at an offset is known once, later paths have to agree with it
+    auto reach = [&](usize offset, int depth) {
+        if (offset > code.size()) {
+            return false;
+        }
+        if (depth_at[offset] < 0) {
+            depth_at[offset] = depth;
+            work.emplace_back(offset);
+        }
+        return depth_at[offset] == depth;
+    };
+
+    usize max_depth = 0;
+    while (!work.empty()) {
+        usize offset = work.back();
+        work.pop_back();
+        if (offset == code.size()) {
+            continue;
+        }
+
+        std::optional<StackEffect> effect = stack_effect(code[offset]);
+        if (!effect || effect->length > code.size() - offset) {
+            return std::nullopt;
+        }
+        if (code[offset] == OpCode::OP_CLOSURE) {
+            effect->length += 2 * static_cast<usize>(code[offset + 2]);
+            if (effect->length > code.size() - offset) {
+                return std::nullopt;
+            }
+        }
+        int depth = depth_at[offset] + effect->delta;
+        // the callee and its arguments are replaced by the result
+        if (code[offset] == OpCode::OP_CALL || code[offset] == OpCode::OP_TAIL_CALL) {
+            depth -= code[offset + 1];
+        } else if (code[offset] == OpCode::OP_INVOKE) {
+            depth -= code[offset + 4];
+        } else if (code[offset] == OpCode::OP_SUPER_INVOKE) {
+            depth -= code[offset + 2];
+        } else if (code[offset] == OpCode::OP_BUILD_LIST) {
+            depth -= code[offset + 1];
+        }
+        if (depth < 0) {
+            return std::nullopt;
+        }
+        max_depth = std::max(max_depth, static_cast<usize>(depth));
+
+        usize next = offset + effect->length;
+        // the offset is the last two bytes of a jump
+        usize jump = effect->length >= 3 ? static_cast<usize>((code[next - 2] << 8) | code[next - 1]) : 0;
+        bool consistent = true;
+        switch (code[offset]) {
+        case OpCode::OP_RETURN:
+            break;
+        case OpCode::OP_JUMP:
+            consistent = reach(next + jump, depth);
+            break;
+        case OpCode::OP_LOOP:
+            consistent = jump <= next && reach(next - jump, depth);
+            break;
+        case OpCode::OP_JUMP_IF_FALSE:
+            consistent = reach(next + jump, depth) && reach(next, depth);
+            break;
+        // the loop variable and the bound or step are pushed when they are not numbers
+        case OpCode::OP_FOR_PREP:
+            max_depth = std::max(max_depth, static_cast<usize>(depth) + 2);
+            consistent = reach(next + jump, depth) && reach(next, depth);
+            break;
+        case OpCode::OP_FOR_LOOP:
+            max_depth = std::max(max_depth, static_cast<usize>(depth) + 2);
+            consistent = jump <= next && reach(next - jump, depth) && reach(next, depth);
+            break;
+        default:
+            consistent = reach(next, depth);
+            break;
+        }
+        if (!consistent) {
+            return std::nullopt;
+        }
+    }
+    return max_depth;
+}
+
+void InlineCache::add(InlineCacheEntry entry) {
+    if (count == entries.size()) {
+        megamorphic = true;
+        // the entries won't be looked at anymore
+        entries = {};
+        count = 0;
+        return;
+    }
+    entries[count++] = std::move(entry);
+}
+
+usize Chunk::add_inline_cache() {
+    m_inline_caches.emplace_back();
+    return m_inline_caches.size() - 1;
+}
+
+usize Chunk::inline_cache_count() const {
+    return m_inline_caches.size();
+}
+
+InlineCache* Chunk::inline_caches() const {
+    return m_inline_caches.data();
+}
+
 usize Chunk::write_constant(std::shared_ptr<Object> value) {
     m_constants.write_value(value);
     return m_constants.get_values().size() - 1;
@@ -34,10 +270,6 @@ const value::ValueArray& Chunk::get_constants() const {
     return m_constants;
 }
 
-const std::vector<usize>& Chunk::get_lines() const {
-    return m_lines;
-}
-
 void Chunk::clear_constants() {
     m_constants.clear();
 }
@@ -2,10 +2,15 @@
 
 #include "common.h"
 #include "value.h"
+#include <array>
+#include <memory>
+#include <optional>
+#include <span>
 #include <vector>
 
 namespace object {
 class Object;
+struct Shape;
 } // namespace object
 
 namespace chunk {
@@ -37,24 +42,148 @@ enum OpCode : u8 {
     OP_JUMP,
     OP_JUMP_IF_FALSE,
     OP_LOOP,
-    OP_RETURN
+    // operand is the argument count, the callee is below the arguments
+    OP_CALL,
+    OP_RETURN,
+    // added after the rest so cached bytecode keeps its meaning
+    OP_GET_UPVALUE,
+    OP_SET_UPVALUE,
+    // operands are the function constant and the upvalue count, followed by
+    // an (is_local, index) byte pair per upvalue
+    OP_CLOSURE,
+    OP_CLOSE_UPVALUE,
+    // operand is the name constant
+    OP_CLASS,
+    OP_METHOD,
+    // operands are the name constant and a two byte inline cache index
+    OP_GET_PROPERTY,
+    OP_SET_PROPERTY,
+    // like OP_GET_PROPERTY followed by OP_CALL, the last operand is the
+    // argument count
+    OP_INVOKE,
+    OP_INHERIT,
+    // operand is the name constant
+    OP_GET_SUPER,
+    // operands are the name constant and the argument count
+    OP_SUPER_INVOKE,
+    // an OP_CALL whose result the function returns, followed by OP_RETURN
+    OP_TAIL_CALL,
+    // counting loops, see Compiler::for_statement. Operands are the slot of
+    // the loop variable, the ForLoopFlags and the bound's slot or constant,
+    // OP_FOR_LOOP adds the step constant. Both end in a two byte jump,
+    // forward past the loop or back to its body.
+    OP_FOR_PREP,
+    OP_FOR_LOOP,
+    // operand is the element count, the elements are on the stack in order
+    OP_BUILD_LIST,
+    // `list[index]`, the list is below the index
+    OP_GET_INDEX,
+    // `list[index] = value`, leaves the value
+    OP_SET_INDEX
+};
+
+// How OP_FOR_PREP and OP_FOR_LOOP compare and step the loop variable.
+enum ForLoopFlags : u8 {
+    FOR_LESS = 0,
+    FOR_LESS_EQUAL = 1,
+    FOR_GREATER = 2,
+    FOR_GREATER_EQUAL = 3,
+    FOR_COMPARISON = 3,
+    // the bound is a constant rather than a local
+    FOR_BOUND_CONSTANT = 4,
+    // the step is subtracted rather than added
+    FOR_SUBTRACT = 8
+};
+
+// Shapes an inline cache remembers before its instruction is megamorphic.
+constexpr usize k_inline_cache_entries = 4;
+
+// What a property lookup found on instances of one shape.
+struct InlineCacheEntry {
+    std::shared_ptr<object::Shape> shape;
+    // the field's slot, or where a set that adds the field puts it
+    u32 slot;
+    // for a set that adds the field, the shape the instance moves to
+    std::shared_ptr<object::Shape> transition;
+    // for a get that finds no field, the method of the instance's class
+    std::shared_ptr<object::Object> method;
+};
+
+/*
+ * Runtime feedback of one property instruction: the lookups it did for the
+ * last few shapes of instances it saw, so the next instance of one of these
+ * shapes only costs a pointer compare. An instruction that sees more shapes
+ * than fit is megamorphic and looks properties up by name from then on.
+ */
+struct InlineCache {
+    [[nodiscard]] const InlineCacheEntry* find(const object::Shape* shape) const {
+        for (usize i = 0; i < count; i++) {
+            if (entries[i].shape.get() == shape) {
+                return &entries[i];
+            }
+        }
+        return nullptr;
+    }
+    // Makes the cache megamorphic when it is full.
+    void add(InlineCacheEntry entry);
+
+    std::array<InlineCacheEntry, k_inline_cache_entries> entries;
+    usize count{0};
+    bool megamorphic{false};
+};
+
+/*
+ * Consecutive instructions almost always come from the same line, so lines
+ * are kept as runs instead of one per byte of code. A run covers the code
+ * from its offset up to the offset of the next run.
+ */
+struct LineRun {
+    u32 offset;
+    u32 line;
+
+    bool operator==(const LineRun& other) const = default;
 };
 
 class Chunk {
 public:
+    // A chunk whose code and line table live in memory kept alive by
+    // `backing`, such as a mapped bytecode image (see image.h). Only its
+    // constants are owned and written after creation.
+    static std::shared_ptr<Chunk> borrow(std::span<const u8> code, std::span<const LineRun> lines, std::shared_ptr<const void> backing);
+
     [[nodiscard]] usize size() const;
+    // The code being run, borrowed or compiled.
+    [[nodiscard]] std::span<const u8> code() const;
+    // Binary search over the line runs.
+    [[nodiscard]] usize line_at(usize offset) const;
+    [[nodiscard]] std::span<const LineRun> get_line_runs() const;
     void write_byte(u8 byte, usize line);
     void write_byte_at(usize offset, u8 byte);
+    // Drops the code from `size` on, for the compiler to rewrite what it just wrote.
+    void truncate(usize size);
     [[nodiscard]] usize write_constant(std::shared_ptr<object::Object> value);
+    // Most values the code keeps on the stack at once, found by following
+    // every path through it. Nothing when the code is malformed or reaches
+    // an instruction with different stack depths.
+    [[nodiscard]] std::optional<usize> max_stack_depth() const;
+    // Adds the inline cache of a property instruction and returns its index.
+    usize add_inline_cache();
+    [[nodiscard]] usize inline_cache_count() const;
+    // Caches are updated while the chunk runs, they are not part of its code.
+    [[nodiscard]] InlineCache* inline_caches() const;
 
+    // What the compiler wrote, empty for borrowed chunks.
     [[nodiscard]] const std::vector<u8>& get_code() const;
-    [[nodiscard]] const std::vector<usize>& get_lines() const;
     [[nodiscard]] const value::ValueArray& get_constants() const;
     void clear_constants();
 
 private:
     std::vector<u8> m_code;
-    std::vector<usize> m_lines;
+    std::vector<LineRun> m_line_runs;
     value::ValueArray m_constants;
+    std::span<const u8> m_borrowed_code;
+    std::span<const LineRun> m_borrowed_lines;
+    std::shared_ptr<const void> m_backing;
+    mutable std::vector<InlineCache> m_inline_caches;
 };
 } // namespace chunk
@@ -7,11 +7,15 @@
 #include "token.h"
 #include "utility.h"
 #include "value.h"
+#include <array>
+#include <charconv>
 #include <cstdint>
-#include <functional>
+#include <initializer_list>
 #include <memory>
 #include <optional>
 #include <string>
+#include <string_view>
+#include <system_error>
 #include <utility>
 
 using namespace token;
@@ -21,19 +25,51 @@ using namespace value;
 
 namespace compiler {
 
-Local::Local()
-    : m_name{TokenType::TOKEN_EOF, "", 0},
-      m_depth{std::nullopt} {}
+/*
+ * Built once at compile time rather than per compiler instance. Tokens
+ * without an entry have neither a prefix nor an infix rule.
+ */
+constexpr std::array<ParseRule, k_token_type_count> Compiler::k_rules = [] {
+    std::array<ParseRule, k_token_type_count> rules{};
+    auto set = [&rules](TokenType token_type, ParseFn prefix, ParseFn infix, Precedence precedence) {
+        rules[static_cast<usize>(token_type)] = {prefix, infix, precedence};
+    };
+
+    set(TokenType::TOKEN_LEFT_PAREN, &Compiler::grouping, &Compiler::call, Precedence::PREC_CALL);
+    set(TokenType::TOKEN_LEFT_BRACKET, &Compiler::list, &Compiler::index, Precedence::PREC_CALL);
+    set(TokenType::TOKEN_DOT, nullptr, &Compiler::dot, Precedence::PREC_CALL);
+    set(TokenType::TOKEN_MINUS, &Compiler::unary, &Compiler::binary, Precedence::PREC_TERM);
+    set(TokenType::TOKEN_PLUS, nullptr, &Compiler::binary, Precedence::PREC_TERM);
+    set(TokenType::TOKEN_SLASH, nullptr, &Compiler::binary, Precedence::PREC_FACTOR);
+    set(TokenType::TOKEN_STAR, nullptr, &Compiler::binary, Precedence::PREC_FACTOR);
+    set(TokenType::TOKEN_BANG, &Compiler::unary, nullptr, Precedence::PREC_NONE);
+    set(TokenType::TOKEN_BANG_EQUAL, nullptr, &Compiler::binary, Precedence::PREC_EQUALITY);
+    set(TokenType::TOKEN_EQUAL_EQUAL, nullptr, &Compiler::binary, Precedence::PREC_EQUALITY);
+    set(TokenType::TOKEN_GREATER, nullptr, &Compiler::binary, Precedence::PREC_COMPARISON);
+    set(TokenType::TOKEN_GREATER_EQUAL, nullptr, &Compiler::binary, Precedence::PREC_COMPARISON);
+    set(TokenType::TOKEN_LESS, nullptr, &Compiler::binary, Precedence::PREC_COMPARISON);
+    set(TokenType::TOKEN_LESS_EQUAL, nullptr, &Compiler::binary, Precedence::PREC_COMPARISON);
+    set(TokenType::TOKEN_IDENTIFIER, &Compiler::variable, nullptr, Precedence::PREC_NONE);
+    set(TokenType::TOKEN_STRING, &Compiler::string, nullptr, Precedence::PREC_NONE);
+    set(TokenType::TOKEN_NUMBER, &Compiler::number, nullptr, Precedence::PREC_NONE);
+    set(TokenType::TOKEN_AND, nullptr, &Compiler::and_infix, Precedence::PREC_AND);
+    set(TokenType::TOKEN_FALSE, &Compiler::literal, nullptr, Precedence::PREC_NONE);
+    set(TokenType::TOKEN_NIL, &Compiler::literal, nullptr, Precedence::PREC_NONE);
+    set(TokenType::TOKEN_OR, nullptr, &Compiler::or_infix, Precedence::PREC_OR);
+    set(TokenType::TOKEN_SUPER, &Compiler::super_, nullptr, Precedence::PREC_NONE);
+    set(TokenType::TOKEN_THIS, &Compiler::this_, nullptr, Precedence::PREC_NONE);
+    set(TokenType::TOKEN_TRUE, &Compiler::literal, nullptr, Precedence::PREC_NONE);
+    return rules;
+}();
 
 Compiler::Compiler(std::shared_ptr<Scanner> scanner, std::shared_ptr<Chunk> chunk)
     : m_scanner{std::move(scanner)},
       m_parser{Token{TokenType::TOKEN_EOF, "", 1},
                Token{TokenType::TOKEN_EOF, "", 1},
                false,
+               false,
                false},
-      m_local_count{0},
-      m_scope_depth{0},
-      m_chunk{std::move(chunk)} {}
+      m_functions{FunctionState{std::move(chunk), nullptr, FunctionType::TYPE_SCRIPT}} {}
 
 bool Compiler::compile() {
     advance();
@@ -46,8 +82,42 @@ bool Compiler::compile() {
     return !m_parser.m_had_error;
 }
 
+/*
+ * Every declaration ends at scope depth 0 with its last token scanned and the
+ * next one still pending, so the scanner may drop the text before that last
+ * token and the declaration can run without waiting for more input.
+ */
+std::optional<std::shared_ptr<Chunk>> Compiler::compile_next() {
+    if (!m_started) {
+        advance();
+        m_started = true;
+    }
+
+    if (match(TokenType::TOKEN_EOF)) {
+        return std::nullopt;
+    }
+
+    current_function().m_chunk = std::make_shared<Chunk>();
+    declaration();
+    end_compilation();
+    m_scanner->release();
+    return current_chunk();
+}
+
+bool Compiler::had_error() const {
+    return m_parser.m_had_error;
+}
+
+FunctionState& Compiler::current_function() {
+    return m_functions.back();
+}
+
+const std::shared_ptr<Chunk>& Compiler::current_chunk() {
+    return m_functions.back().m_chunk;
+}
+
 const ParseRule& Compiler::get_rule(token::TokenType token_type) {
-    return m_rules[token_type];
+    return k_rules[static_cast<usize>(token_type)];
 }
 
 void Compiler::synchronize() {
@@ -55,13 +125,13 @@ void Compiler::synchronize() {
     // we assume further statements as valid.
     m_parser.m_panic_mode = false;
 
-    while (m_parser.m_current.get_type() != TokenType::TOKEN_EOF) {
+    while (current().get_type() != TokenType::TOKEN_EOF) {
         // We looked a semicolon, our boundary point for statements
         if (m_parser.m_previous.get_type() == TokenType::TOKEN_SEMICOLON) {
             return;
         }
 
-        switch (m_parser.m_current.get_type()) {
+        switch (current().get_type()) {
         case TokenType::TOKEN_CLASS:
         case TokenType::TOKEN_FUN:
         case TokenType::TOKEN_VAR:
@@ -78,11 +148,11 @@ void Compiler::synchronize() {
     }
 }
 
-u8 Compiler::parse_variable(const std::string& error_msg) {
+u8 Compiler::parse_variable(std::string_view error_msg) {
     consume(TokenType::TOKEN_IDENTIFIER, error_msg);
 
     declare_variable();
-    if (m_scope_depth > 0) {
+    if (current_function().m_scope_depth > 0) {
         // look up on stack rather than constant table to hash table value
         return 0;
     }
@@ -91,17 +161,23 @@ u8 Compiler::parse_variable(const std::string& error_msg) {
 }
 
 void Compiler::mark_initialized() {
-    m_locals[m_local_count - 1].m_depth = m_scope_depth;
+    FunctionState& function = current_function();
+    if (function.m_scope_depth == 0) {
+        // globals are defined by OP_DEFINE_GLOBAL
+        return;
+    }
+    function.m_locals.back().m_depth = function.m_scope_depth;
 }
 
 u8 Compiler::identifier_constant(const token::Token& token) {
-    auto obj_string = std::make_shared<object::StringObject>(token.get_lexeme());
+    auto obj_string = std::make_shared<object::StringObject>(std::string{token.get_lexeme()});
     return make_constant(std::move(obj_string));
 }
 
-std::optional<u8> Compiler::resolve_local(const Token& name) {
-    for (int i = m_local_count - 1; i >= 0; i--) {
-        const Local& local = m_locals[i];
+std::optional<u8> Compiler::resolve_local(usize function_index, const Token& name) {
+    const std::vector<Local>& locals = m_functions[function_index].m_locals;
+    for (int i = static_cast<int>(locals.size()) - 1; i >= 0; i--) {
+        const Local& local = locals[i];
         if (local.m_name.get_lexeme() == name.get_lexeme()) {
             if (local.m_depth == std::nullopt) {
                 error("Can't read local variable in its own initializer.");
@@ -113,29 +189,71 @@ std::optional<u8> Compiler::resolve_local(const Token& name) {
     return std::nullopt;
 }
 
+/*
+ * Looks the name up in the enclosing functions, innermost first. Only the
+ * local that is found is marked as captured, every function in between gets
+ * an upvalue passing it down. Locals no closure refers to stay plain stack
+ * slots.
+ */
+std::optional<u8> Compiler::resolve_upvalue(usize function_index, const Token& name) {
+    if (function_index == 0) {
+        return std::nullopt;
+    }
+
+    std::optional<u8> local = resolve_local(function_index - 1, name);
+    if (local) {
+        m_functions[function_index - 1].m_locals[local.value()].m_is_captured = true;
+        return add_upvalue(function_index, local.value(), true);
+    }
+
+    std::optional<u8> upvalue = resolve_upvalue(function_index - 1, name);
+    if (upvalue) {
+        return add_upvalue(function_index, upvalue.value(), false);
+    }
+
+    return std::nullopt;
+}
+
+u8 Compiler::add_upvalue(usize function_index, u8 index, bool is_local) {
+    std::vector<Upvalue>& upvalues = m_functions[function_index].m_upvalues;
+    for (usize i = 0; i < upvalues.size(); i++) {
+        if (upvalues[i].m_index == index && upvalues[i].m_is_local == is_local) {
+            return static_cast<u8>(i);
+        }
+    }
+
+    // the count is a single byte operand of OP_CLOSURE
+    if (upvalues.size() == UINT8_MAX) {
+        error("Too many closure variables in function.");
+        return 0;
+    }
+    upvalues.emplace_back(Upvalue{index, is_local});
+    return static_cast<u8>(upvalues.size() - 1);
+}
+
 void Compiler::add_local(const Token& name) {
-    if (m_local_count == UINT8_COUNT) {
+    std::vector<Local>& locals = current_function().m_locals;
+    if (locals.size() == UINT8_COUNT) {
         error("Too many local variables in function.");
         return;
     }
-    Local& local = m_locals[m_local_count++];
-    local.m_name = name;
-    local.m_depth = std::nullopt;
+    locals.emplace_back(Local{name, std::nullopt});
 }
 
 void Compiler::declare_variable() {
-    if (m_scope_depth == 0) {
+    const FunctionState& function = current_function();
+    if (function.m_scope_depth == 0) {
         return;
     }
 
     const Token& name = m_parser.m_previous;
 
-    for (int i = m_local_count - 1; i >= 0; i--) {
-        const Local& local = m_locals[i];
+    for (int i = static_cast<int>(function.m_locals.size()) - 1; i >= 0; i--) {
+        const Local& local = function.m_locals[i];
         // check the local variables from the end of the array
         // to the beginning. if a variable has a depth lower than
         // the current, it is owned by the preceeding scope.
-        if (local.m_depth != std::nullopt && local.m_depth.value() < m_scope_depth) {
+        if (local.m_depth != std::nullopt && local.m_depth.value() < function.m_scope_depth) {
             break;
         }
 
@@ -148,7 +266,7 @@ void Compiler::declare_variable() {
 }
 
 void Compiler::define_variable(u8 global) {
-    if (m_scope_depth > 0) {
+    if (current_function().m_scope_depth > 0) {
         mark_initialized();
         return;
     }
@@ -158,11 +276,15 @@ void Compiler::define_variable(u8 global) {
 void Compiler::named_variable(const token::Token& name, bool can_assign) {
     u8 get_op = 0;
     u8 set_op = 0;
-    std::optional<u8> arg = resolve_local(name);
+    usize function_index = m_functions.size() - 1;
+    std::optional<u8> arg = resolve_local(function_index, name);
 
     if (arg) {
         get_op = OpCode::OP_GET_LOCAL;
         set_op = OpCode::OP_SET_LOCAL;
+    } else if ((arg = resolve_upvalue(function_index, name))) {
+        get_op = OpCode::OP_GET_UPVALUE;
+        set_op = OpCode::OP_SET_UPVALUE;
     } else {
         arg = identifier_constant(name);
         get_op = OpCode::OP_GET_GLOBAL;
@@ -178,15 +300,17 @@ void Compiler::named_variable(const token::Token& name, bool can_assign) {
 }
 
 void Compiler::begin_scope() {
-    m_scope_depth++;
+    current_function().m_scope_depth++;
 }
 
 void Compiler::end_scope() {
-    m_scope_depth--;
+    FunctionState& function = current_function();
+    function.m_scope_depth--;
 
-    while (m_local_count > 0 && m_locals[m_local_count - 1].m_depth != std::nullopt && m_locals[m_local_count - 1].m_depth.value() > m_scope_depth) {
-        emit_byte(OpCode::OP_POP);
-        m_local_count--;
+    while (!function.m_locals.empty() && function.m_locals.back().m_depth != std::nullopt && function.m_locals.back().m_depth.value() > function.m_scope_depth) {
+        // a captured local lives on in its upvalue
+        emit_byte(function.m_locals.back().m_is_captured ? OpCode::OP_CLOSE_UPVALUE : OpCode::OP_POP);
+        function.m_locals.pop_back();
     }
 }
 
@@ -194,21 +318,21 @@ int Compiler::emit_jump(u8 instruction) {
     emit_byte(instruction);
     emit_byte(0xff);
     emit_byte(0xff);
-    return m_chunk->size() - 2;
+    return current_chunk()->size() - 2;
 }
 
 void Compiler::patch_jump(int offset) {
     // -2 to adjust for the bytecode for the jump offset itself.
-    int jump = m_chunk->size() - offset - 2;
+    int jump = current_chunk()->size() - offset - 2;
 
     if (jump > UINT16_MAX) {
         error("Too much code to jump over.");
     }
 
     // high byte
-    m_chunk->write_byte_at(offset, (jump >> 8) & 0xff);
+    current_chunk()->write_byte_at(offset, (jump >> 8) & 0xff);
     // low byte
-    m_chunk->write_byte_at(offset + 1, jump & 0xff);
+    current_chunk()->write_byte_at(offset + 1, jump & 0xff);
 }
 
 bool Compiler::match(token::TokenType token_type) {
@@ -221,12 +345,14 @@ bool Compiler::match(token::TokenType token_type) {
 }
 
 bool Compiler::check(token::TokenType token_type) {
-    return m_parser.m_current.get_type() == token_type;
+    return current().get_type() == token_type;
 }
 
 void Compiler::statement() {
     if (match(TokenType::TOKEN_PRINT)) {
         print_statement();
+    } else if (match(TokenType::TOKEN_RETURN)) {
+        return_statement();
     } else if (match(TokenType::TOKEN_FOR)) {
         for_statement();
     } else if (match(TokenType::TOKEN_IF)) {
@@ -243,7 +369,11 @@ void Compiler::statement() {
 }
 
 void Compiler::declaration() {
-    if (match(TokenType::TOKEN_VAR)) {
+    if (match(TokenType::TOKEN_CLASS)) {
+        class_declaration();
+    } else if (match(TokenType::TOKEN_FUN)) {
+        fun_declaration();
+    } else if (match(TokenType::TOKEN_VAR)) {
         var_declaration();
     } else {
         statement();
@@ -258,6 +388,115 @@ void Compiler::declaration() {
     }
 }
 
+/*
+ * The class is created and bound to its name first. A superclass is kept in
+ * a local named `super` for the duration of the class body, so methods can
+ * capture it, and its methods are copied into the class before the class's
+ * own methods are added. Then the class is pushed once more for the methods,
+ * which are added to it one by one, and popped at the end.
+ */
+void Compiler::class_declaration() {
+    consume(TokenType::TOKEN_IDENTIFIER, "Expect class name.");
+    Token class_name = m_parser.m_previous;
+    u8 name_constant = identifier_constant(class_name);
+    declare_variable();
+
+    emit_bytes(OpCode::OP_CLASS, name_constant);
+    define_variable(name_constant);
+
+    m_classes.emplace_back(ClassState{class_name});
+    if (match(TokenType::TOKEN_LESS)) {
+        consume(TokenType::TOKEN_IDENTIFIER, "Expect superclass name.");
+        variable(false);
+        if (class_name.get_lexeme() == m_parser.m_previous.get_lexeme()) {
+            error("A class can't inherit from itself.");
+        }
+
+        begin_scope();
+        add_local(Token{TokenType::TOKEN_SUPER, "super", m_parser.m_previous.get_line()});
+        define_variable(0);
+        named_variable(class_name, false);
+        emit_byte(OpCode::OP_INHERIT);
+        m_classes.back().m_has_superclass = true;
+    }
+
+    named_variable(class_name, false);
+    consume(TokenType::TOKEN_LEFT_BRACE, "Expect '{' before class body.");
+    while (!check(TokenType::TOKEN_RIGHT_BRACE) && !check(TokenType::TOKEN_EOF)) {
+        method();
+    }
+    consume(TokenType::TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
+    emit_byte(OpCode::OP_POP);
+
+    if (m_classes.back().m_has_superclass) {
+        end_scope();
+    }
+    m_classes.pop_back();
+}
+
+void Compiler::method() {
+    consume(TokenType::TOKEN_IDENTIFIER, "Expect method name.");
+    u8 constant = identifier_constant(m_parser.m_previous);
+    FunctionType type = m_parser.m_previous.get_lexeme() == "init" ? FunctionType::TYPE_INITIALIZER : FunctionType::TYPE_METHOD;
+    function(type);
+    emit_bytes(OpCode::OP_METHOD, constant);
+}
+
+void Compiler::fun_declaration() {
+    u8 global = parse_variable("Expect function name.");
+    // the body may call the function itself
+    mark_initialized();
+    function(FunctionType::TYPE_FUNCTION);
+    define_variable(global);
+}
+
+/*
+ * The function gets a chunk of its own. Its parameters are its first locals
+ * after slot 0, which holds the function being called, so the arguments a
+ * caller pushes already are the locals of the call. Whether it needs a
+ * closure is only known once its body has been compiled.
+ */
+void Compiler::function(FunctionType type) {
+    auto function = std::make_shared<object::FunctionObject>(std::string{m_parser.m_previous.get_lexeme()}, 0, std::make_shared<Chunk>());
+    m_functions.emplace_back(FunctionState{function->chunk, function, type});
+    // methods find their receiver there as `this`, otherwise the slot cannot
+    // be named as no identifier is empty
+    std::string_view slot_name = type == FunctionType::TYPE_FUNCTION ? "" : "this";
+    current_function().m_locals.emplace_back(Local{Token{TokenType::TOKEN_IDENTIFIER, slot_name, m_parser.m_previous.get_line()}, 0});
+    begin_scope();
+
+    consume(TokenType::TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+    if (!check(TokenType::TOKEN_RIGHT_PAREN)) {
+        do {
+            if (function->arity == UINT8_MAX) {
+                error_at_current("Can't have more than 255 parameters.");
+            } else {
+                function->arity++;
+            }
+            u8 constant = parse_variable("Expect parameter name.");
+            define_variable(constant);
+        } while (match(TokenType::TOKEN_COMMA));
+    }
+    consume(TokenType::TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+    consume(TokenType::TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+    block_statement();
+
+    // the frame is dropped on return, its locals need no pops
+    std::vector<Upvalue> upvalues = std::move(current_function().m_upvalues);
+    end_function();
+    if (upvalues.empty()) {
+        // nothing to capture, the function is used as it is
+        emit_constant(std::move(function));
+        return;
+    }
+
+    emit_bytes(OpCode::OP_CLOSURE, make_constant(std::move(function)));
+    emit_byte(static_cast<u8>(upvalues.size()));
+    for (const Upvalue& upvalue : upvalues) {
+        emit_bytes(upvalue.m_is_local ? 1 : 0, upvalue.m_index);
+    }
+}
+
 void Compiler::var_declaration() {
     u8 global = parse_variable("Expect variable name.");
 
@@ -278,18 +517,44 @@ void Compiler::print_statement() {
     emit_byte(OpCode::OP_PRINT);
 }
 
+void Compiler::return_statement() {
+    if (current_function().m_type == FunctionType::TYPE_SCRIPT) {
+        error("Can't return from top-level code.");
+    }
+
+    if (match(TokenType::TOKEN_SEMICOLON)) {
+        emit_return();
+    } else {
+        if (current_function().m_type == FunctionType::TYPE_INITIALIZER) {
+            error("Can't return a value from an initializer.");
+        }
+        m_last_call = std::nullopt;
+        expression();
+        consume(TokenType::TOKEN_SEMICOLON, "Expect ';' after return value.");
+        // a call that is the last thing the function does is a tail call,
+        // also on the right of `and` and `or`, whose result it is as well
+        if (m_last_call && m_last_call.value() + 2 == current_chunk()->size()) {
+            current_chunk()->write_byte_at(m_last_call.value(), OpCode::OP_TAIL_CALL);
+        }
+        emit_byte(OpCode::OP_RETURN);
+    }
+}
+
 void Compiler::for_statement() {
     begin_scope();
     consume(TokenType::TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+    bool declares_variable = false;
     if (match(TokenType::TOKEN_SEMICOLON)) {
         // No initializer
     } else if (match(TokenType::TOKEN_VAR)) {
         var_declaration();
+        declares_variable = true;
     } else {
         expression_statement();
     }
 
-    int loop_start = m_chunk->size();
+    int loop_start = current_chunk()->size();
+    int condition_start = loop_start;
     int exit_jump = -1;
     if (!match(TokenType::TOKEN_SEMICOLON)) {
         expression();
@@ -303,7 +568,7 @@ void Compiler::for_statement() {
     if (!match(TokenType::TOKEN_RIGHT_PAREN)) {
         // jump to the body of the for loop
         int body_jump = emit_jump(OpCode::OP_JUMP);
-        int increment_start = m_chunk->size();
+        int increment_start = current_chunk()->size();
         expression();
         emit_byte(OpCode::OP_POP);
         consume(TokenType::TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
@@ -314,6 +579,17 @@ void Compiler::for_statement() {
         loop_start = increment_start;
         // patch the body jump address as we have compiled the looping logic
         patch_jump(body_jump);
+
+        std::optional<CountingLoop> loop;
+        if (declares_variable && !m_parser.m_had_error) {
+            loop = match_counting_loop(condition_start, increment_start);
+        }
+        if (loop) {
+            current_chunk()->truncate(condition_start);
+            counting_loop(loop.value());
+            end_scope();
+            return;
+        }
     }
 
     statement();
@@ -326,6 +602,91 @@ void Compiler::for_statement() {
     end_scope();
 }
 
+/*
+ * Looks at the code just compiled for the condition and the increment of a
+ * for loop that declared its variable, the last local:
+ *
+ *   condition_start: OP_GET_LOCAL i, OP_GET_LOCAL bound | OP_CONSTANT bound,
+ *                    OP_LESS | OP_GREATER, OP_NOT if negated
+ *                    OP_JUMP_IF_FALSE, OP_POP, OP_JUMP
+ *   increment_start: OP_GET_LOCAL i, OP_CONSTANT step, OP_ADD | OP_SUBTRACT,
+ *                    OP_SET_LOCAL i, OP_POP, OP_LOOP
+ */
+std::optional<CountingLoop> Compiler::match_counting_loop(usize condition_start, usize increment_start) {
+    const std::vector<u8>& code = current_chunk()->get_code();
+    u8 slot = static_cast<u8>(current_function().m_locals.size() - 1);
+    CountingLoop loop{slot, 0, 0, 0, current_chunk()->line_at(condition_start), current_chunk()->line_at(increment_start)};
+
+    // the condition is followed by 7 bytes of jumps and the increment by the loop
+    usize condition_size = increment_start - condition_start - 7;
+    if ((condition_size != 5 && condition_size != 6) || code.size() != increment_start + 11) {
+        return std::nullopt;
+    }
+    const u8* condition = code.data() + condition_start;
+    if (condition[0] != OpCode::OP_GET_LOCAL || condition[1] != slot) {
+        return std::nullopt;
+    }
+    if (condition[2] == OpCode::OP_CONSTANT) {
+        loop.m_flags |= ForLoopFlags::FOR_BOUND_CONSTANT;
+    } else if (condition[2] != OpCode::OP_GET_LOCAL) {
+        return std::nullopt;
+    }
+    loop.m_bound = condition[3];
+    bool negated = condition_size == 6;
+    if (negated && condition[5] != OpCode::OP_NOT) {
+        return std::nullopt;
+    }
+    // `<=` is compiled as `!(>)` and `>=` as `!(<)`
+    if (condition[4] == OpCode::OP_LESS) {
+        loop.m_flags |= negated ? ForLoopFlags::FOR_GREATER_EQUAL : ForLoopFlags::FOR_LESS;
+    } else if (condition[4] == OpCode::OP_GREATER) {
+        loop.m_flags |= negated ? ForLoopFlags::FOR_LESS_EQUAL : ForLoopFlags::FOR_GREATER;
+    } else {
+        return std::nullopt;
+    }
+
+    const u8* increment = code.data() + increment_start;
+    if (increment[0] != OpCode::OP_GET_LOCAL || increment[1] != slot || increment[2] != OpCode::OP_CONSTANT || increment[5] != OpCode::OP_SET_LOCAL || increment[6] != slot || increment[7] != OpCode::OP_POP) {
+        return std::nullopt;
+    }
+    loop.m_step = increment[3];
+    if (current_chunk()->get_constants().get_values()[loop.m_step]->type != object::ObjectType::OBJ_NUMBER) {
+        return std::nullopt;
+    }
+    if (increment[4] == OpCode::OP_SUBTRACT) {
+        loop.m_flags |= ForLoopFlags::FOR_SUBTRACT;
+    } else if (increment[4] != OpCode::OP_ADD) {
+        return std::nullopt;
+    }
+    return loop;
+}
+
+/*
+ * OP_FOR_PREP skips the loop when the condition fails at the start and
+ * OP_FOR_LOOP steps, compares and jumps back to the body in one go. Both
+ * read the loop variable and the bound from their slots every time, so the
+ * body may assign either or capture them.
+ */
+void Compiler::counting_loop(const CountingLoop& loop) {
+    auto write = [this](std::initializer_list<u8> bytes, usize line) {
+        for (u8 byte : bytes) {
+            current_chunk()->write_byte(byte, line);
+        }
+    };
+
+    write({OpCode::OP_FOR_PREP, loop.m_slot, loop.m_flags, loop.m_bound, 0xff, 0xff}, loop.m_condition_line);
+    usize exit_jump = current_chunk()->size() - 2;
+    usize body_start = current_chunk()->size();
+    statement();
+
+    usize offset = current_chunk()->size() + 7 - body_start;
+    if (offset > UINT16_MAX) {
+        error("Loop body too large.");
+    }
+    write({OpCode::OP_FOR_LOOP, loop.m_slot, loop.m_flags, loop.m_bound, loop.m_step, static_cast<u8>((offset >> 8) & 0xff), static_cast<u8>(offset & 0xff)}, loop.m_increment_line);
+    patch_jump(static_cast<int>(exit_jump));
+}
+
 void Compiler::expression_statement() {
     expression();
     consume(TokenType::TOKEN_SEMICOLON, "Expect ';' after expression.");
@@ -367,7 +728,7 @@ void Compiler::if_statement() {
 }
 
 void Compiler::while_statement() {
-    int loop_start = m_chunk->size();
+    int loop_start = current_chunk()->size();
     consume(TokenType::TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
     expression();
     consume(TokenType::TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
@@ -414,7 +775,7 @@ void Compiler::unary(bool can_assign) {
 
 void Compiler::binary(bool can_assign) {
     TokenType operator_type = m_parser.m_previous.get_type();
-    ParseRule rule = get_rule(operator_type);
+    const ParseRule& rule = get_rule(operator_type);
     Precedence current_precedence = static_cast<Precedence>(static_cast<int>(rule.m_precedence) + 1);
     parse_precedence(current_precedence);
 
@@ -455,21 +816,41 @@ void Compiler::binary(bool can_assign) {
 }
 
 void Compiler::advance() {
-    m_parser.m_previous = m_parser.m_current;
+    m_parser.m_previous = current();
+    m_parser.m_current_pending = true;
+}
 
-    while (true) {
+/*
+ * The token after the previous one is scanned when the parser first looks at
+ * it rather than in `advance`, so a streamed declaration can be compiled and
+ * run before any of the text after it has arrived.
+ */
+const Token& Compiler::current() {
+    while (m_parser.m_current_pending) {
         m_parser.m_current = m_scanner->scan_token();
         if (m_parser.m_current.get_type() != TokenType::TOKEN_ERROR) {
-            break;
+            m_parser.m_current_pending = false;
+        } else {
+            error_at(m_parser.m_current, m_parser.m_current.get_lexeme());
         }
-
-        error_at_current(m_parser.m_current.get_lexeme());
     }
+    return m_parser.m_current;
 }
 
 void Compiler::number(bool can_assign) {
-    auto value = std::make_shared<object::NumberObject>(std::stod(m_parser.m_previous.get_lexeme()));
-    emit_constant(std::move(value));
+    // parsed straight from the source, independent of the locale
+    std::string_view lexeme = m_parser.m_previous.get_lexeme();
+    double value = 0;
+    auto [end, ec] = std::from_chars(lexeme.data(), lexeme.data() + lexeme.size(), value);
+    if (ec == std::errc::result_out_of_range) {
+        error("Number literal is out of range.");
+        return;
+    }
+    if (ec != std::errc{} || end != lexeme.data() + lexeme.size()) {
+        error("Invalid number literal.");
+        return;
+    }
+    emit_constant(std::make_shared<object::NumberObject>(value));
 }
 
 void Compiler::literal(bool can_assign) {
@@ -490,8 +871,117 @@ void Compiler::literal(bool can_assign) {
 }
 
 void Compiler::string(bool can_assign) {
-    std::string str = m_parser.m_previous.get_lexeme().substr(1, m_parser.m_previous.get_lexeme().length() - 2);
-    emit_constant(std::make_shared<object::StringObject>(std::move(str)));
+    std::string_view lexeme = m_parser.m_previous.get_lexeme();
+    // strip the surrounding quotes
+    emit_constant(std::make_shared<object::StringObject>(std::string{lexeme.substr(1, lexeme.length() - 2)}));
+}
+
+void Compiler::call(bool can_assign) {
+    u8 arg_count = argument_list();
+    m_last_call = current_chunk()->size();
+    emit_bytes(OpCode::OP_CALL, arg_count);
+}
+
+/*
+ * A method call `a.m(args)` compiles to a single OP_INVOKE, which calls the
+ * method without binding it to the instance first.
+ */
+void Compiler::dot(bool can_assign) {
+    consume(TokenType::TOKEN_IDENTIFIER, "Expect property name after '.'.");
+    u8 name = identifier_constant(m_parser.m_previous);
+
+    if (can_assign && match(TokenType::TOKEN_EQUAL)) {
+        expression();
+        emit_property(OpCode::OP_SET_PROPERTY, name);
+    } else if (match(TokenType::TOKEN_LEFT_PAREN)) {
+        u8 arg_count = argument_list();
+        emit_property(OpCode::OP_INVOKE, name);
+        emit_byte(arg_count);
+    } else {
+        emit_property(OpCode::OP_GET_PROPERTY, name);
+    }
+}
+
+void Compiler::list(bool can_assign) {
+    u8 count = 0;
+    if (!check(TokenType::TOKEN_RIGHT_BRACKET)) {
+        do {
+            expression();
+            if (count == UINT8_MAX) {
+                error("Can't have more than 255 elements in a list literal.");
+            } else {
+                count++;
+            }
+        } while (match(TokenType::TOKEN_COMMA));
+    }
+    consume(TokenType::TOKEN_RIGHT_BRACKET, "Expect ']' after list elements.");
+    emit_bytes(OpCode::OP_BUILD_LIST, count);
+}
+
+void Compiler::index(bool can_assign) {
+    expression();
+    consume(TokenType::TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+
+    if (can_assign && match(TokenType::TOKEN_EQUAL)) {
+        expression();
+        emit_byte(OpCode::OP_SET_INDEX);
+    } else {
+        emit_byte(OpCode::OP_GET_INDEX);
+    }
+}
+
+void Compiler::this_(bool can_assign) {
+    if (m_classes.empty()) {
+        error("Can't use 'this' outside of a class.");
+        return;
+    }
+    // the receiver is the local in slot 0 of the method
+    variable(false);
+}
+
+/*
+ * `super.m` binds the superclass's method to `this`, `super.m(args)` calls it
+ * right away. Either way the receiver is pushed first and the superclass
+ * last.
+ */
+void Compiler::super_(bool can_assign) {
+    if (m_classes.empty()) {
+        error("Can't use 'super' outside of a class.");
+    } else if (!m_classes.back().m_has_superclass) {
+        error("Can't use 'super' in a class with no superclass.");
+    }
+
+    consume(TokenType::TOKEN_DOT, "Expect '.' after 'super'.");
+    consume(TokenType::TOKEN_IDENTIFIER, "Expect superclass method name.");
+    u8 name = identifier_constant(m_parser.m_previous);
+    usize line = m_parser.m_previous.get_line();
+
+    named_variable(Token{TokenType::TOKEN_THIS, "this", line}, false);
+    if (match(TokenType::TOKEN_LEFT_PAREN)) {
+        u8 arg_count = argument_list();
+        named_variable(Token{TokenType::TOKEN_SUPER, "super", line}, false);
+        emit_bytes(OpCode::OP_SUPER_INVOKE, name);
+        emit_byte(arg_count);
+    } else {
+        named_variable(Token{TokenType::TOKEN_SUPER, "super", line}, false);
+        emit_bytes(OpCode::OP_GET_SUPER, name);
+    }
+}
+
+u8 Compiler::argument_list() {
+    u8 arg_count = 0;
+    if (!check(TokenType::TOKEN_RIGHT_PAREN)) {
+        do {
+            expression();
+            if (arg_count == UINT8_MAX) {
+                error("Can't have more than 255 arguments.");
+            } else {
+                arg_count++;
+            }
+        } while (match(TokenType::TOKEN_COMMA));
+    }
+    consume(TokenType::TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+    return arg_count;
 }
 
 void Compiler::variable(bool can_assign) {
@@ -530,8 +1020,8 @@ void Compiler::or_infix(bool can_assign) {
     patch_jump(end_jump);
 }
 
-void Compiler::consume(TokenType token_type, const std::string& message) {
-    if (m_parser.m_current.get_type() == token_type) {
+void Compiler::consume(TokenType token_type, std::string_view message) {
+    if (current().get_type() == token_type) {
         advance();
         return;
     }
@@ -542,25 +1032,25 @@ void Compiler::consume(TokenType token_type, const std::string& message) {
 void Compiler::parse_precedence(Precedence precedence) {
     advance();
 
-    std::optional<ParseFn> prefix_rule = get_rule(m_parser.m_previous.get_type()).m_prefix;
+    ParseFn prefix_rule = get_rule(m_parser.m_previous.get_type()).m_prefix;
 
-    if (!prefix_rule) {
+    if (prefix_rule == nullptr) {
         error("Expect expression.");
         return;
     }
 
     // only parse assignments if the current precedence is at PREC_ASSIGNMENT or lower
     bool can_assign = precedence <= Precedence::PREC_ASSIGNMENT;
-    (prefix_rule.value())(can_assign);
+    (this->*prefix_rule)(can_assign);
 
     // keep parsing, looking for infix parse rules if the current token has higher precedence than the previous one
     // if we find a infix rule that has higher precedence then parse it and emit bytes.
-    while (precedence <= get_rule(m_parser.m_current.get_type()).m_precedence) {
+    while (precedence <= get_rule(current().get_type()).m_precedence) {
         // recursively parse infix rules while the current parsed token has greater precedence than
         // the previously parse token
         advance();
-        std::optional<ParseFn> infix_rule = get_rule(m_parser.m_previous.get_type()).m_infix;
-        (infix_rule.value())(can_assign);
+        ParseFn infix_rule = get_rule(m_parser.m_previous.get_type()).m_infix;
+        (this->*infix_rule)(can_assign);
     }
 
     if (can_assign && match(TokenType::TOKEN_EQUAL)) {
@@ -569,7 +1059,7 @@ void Compiler::parse_precedence(Precedence precedence) {
 }
 
 void Compiler::emit_byte(u8 byte) {
-    m_chunk->write_byte(byte, m_parser.m_previous.get_line());
+    current_chunk()->write_byte(byte, m_parser.m_previous.get_line());
 }
 
 void Compiler::emit_bytes(u8 byte_1, u8 byte_2) {
@@ -581,14 +1071,37 @@ void Compiler::emit_constant(std::shared_ptr<object::Object> value) {
     emit_bytes(OpCode::OP_CONSTANT, make_constant(std::move(value)));
 }
 
+// Property instructions get an inline cache of their own.
+void Compiler::emit_property(u8 instruction, u8 name) {
+    emit_bytes(instruction, name);
+    usize cache = current_chunk()->add_inline_cache();
+    if (cache > UINT16_MAX) {
+        error("Too many property accesses in one chunk.");
+    }
+    emit_bytes((cache >> 8) & 0xff, cache & 0xff);
+}
+
 void Compiler::emit_return() {
+    switch (current_function().m_type) {
+    case FunctionType::TYPE_INITIALIZER:
+        // initializers return the new instance
+        emit_bytes(OpCode::OP_GET_LOCAL, 0);
+        break;
+    case FunctionType::TYPE_FUNCTION:
+    case FunctionType::TYPE_METHOD:
+        // falling off the end of a function returns nil
+        emit_byte(OpCode::OP_NIL);
+        break;
+    case FunctionType::TYPE_SCRIPT:
+        break;
+    }
     emit_byte(OpCode::OP_RETURN);
 }
 
 void Compiler::emit_loop(int loop_start) {
     emit_byte(OpCode::OP_LOOP);
 
-    int offset = m_chunk->size() - loop_start + 2;
+    int offset = current_chunk()->size() - loop_start + 2;
     if (offset > UINT16_MAX) {
         error("Loop body too large.");
     }
@@ -602,13 +1115,24 @@ void Compiler::end_compilation() {
 
 #ifdef DEBUG_PRINT_CODE
     if (!m_parser.m_had_error) {
-        disassemble_chunk(*m_chunk, "code");
+        disassemble_chunk(*current_chunk(), "code");
+    }
+#endif
+}
+
+void Compiler::end_function() {
+    emit_return();
+
+#ifdef DEBUG_PRINT_CODE
+    if (!m_parser.m_had_error) {
+        disassemble_chunk(*current_chunk(), current_function().m_function->to_string());
     }
 #endif
+    m_functions.pop_back();
 }
 
 u8 Compiler::make_constant(std::shared_ptr<object::Object> value) {
-    usize constant_idx = m_chunk->write_constant(std::move(value));
+    usize constant_idx = current_chunk()->write_constant(std::move(value));
     if (constant_idx > UINT8_MAX) {
         error("Too many constants in one chunk.");
         return 0;
@@ -617,15 +1141,15 @@ u8 Compiler::make_constant(std::shared_ptr<object::Object> value) {
     return static_cast<u8>(constant_idx);
 }
 
-void Compiler::error_at_current(const std::string& message) {
+void Compiler::error_at_current(std::string_view message) {
     error_at(m_parser.m_current, message);
 }
 
-void Compiler::error(const std::string& message) {
+void Compiler::error(std::string_view message) {
     error_at(m_parser.m_previous, message);
 }
 
-void Compiler::error_at(const Token& token, const std::string& message) {
+void Compiler::error_at(const Token& token, std::string_view message) {
     if (m_parser.m_panic_mode == true) {
         return;
     }
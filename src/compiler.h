@@ -7,10 +7,11 @@
 #include "token.h"
 #include "value.h"
 #include <array>
-#include <functional>
 #include <memory>
 #include <optional>
 #include <string>
+#include <string_view>
+#include <vector>
 
 namespace compiler {
 
@@ -19,12 +20,69 @@ struct Parser {
     token::Token m_previous;
     bool m_had_error;
     bool m_panic_mode;
+    // set by `advance`, m_current is only scanned once it is looked at
+    bool m_current_pending;
 };
 
 struct Local {
-    Local();
     token::Token m_name;
     std::optional<u8> m_depth;
+    // set when a closure captures the local, which then has to be moved off
+    // the stack when it goes out of scope
+    bool m_is_captured{false};
+};
+
+// A variable of an enclosing function that a function uses.
+struct Upvalue {
+    // the local slot in the enclosing function, or its upvalue index
+    u8 m_index;
+    bool m_is_local;
+};
+
+enum class FunctionType {
+    TYPE_FUNCTION,
+    TYPE_INITIALIZER,
+    TYPE_METHOD,
+    TYPE_SCRIPT
+};
+
+/*
+ * What the compiler keeps for a function while compiling its body. Function
+ * declarations nest, the script is compiled first and the innermost
+ * function last.
+ */
+struct FunctionState {
+    std::shared_ptr<chunk::Chunk> m_chunk;
+    // nullptr for the script
+    std::shared_ptr<object::FunctionObject> m_function;
+    FunctionType m_type{FunctionType::TYPE_SCRIPT};
+    // grows as locals are declared, so compiling a snippet without any
+    // doesn't pay for constructing UINT8_COUNT of them up front
+    std::vector<Local> m_locals{};
+    int m_scope_depth{0};
+    std::vector<Upvalue> m_upvalues{};
+};
+
+// What the compiler keeps for a class while compiling its methods.
+struct ClassState {
+    token::Token m_name;
+    // its methods find the superclass in the local `super` of the class body
+    bool m_has_superclass{false};
+};
+
+/*
+ * A for loop whose header is `var i = ...; i < bound; i = i + step`, with a
+ * local or constant bound and a constant step, written as OP_FOR_PREP and
+ * OP_FOR_LOOP. Any comparison of <, <=, > and >= works, so does `-` for the
+ * step.
+ */
+struct CountingLoop {
+    u8 m_slot;
+    u8 m_flags;
+    u8 m_bound;
+    u8 m_step;
+    usize m_condition_line;
+    usize m_increment_line;
 };
 
 enum class Precedence {
@@ -37,15 +95,17 @@ enum class Precedence {
     PREC_TERM,       // + -
     PREC_FACTOR,     // * /
     PREC_UNARY,      // ! -
-    PREC_CALL,       // . ()
+    PREC_CALL,       // . () []
     PREC_PRIMARY
 };
 
-using ParseFn = std::function<void(bool)>;
+class Compiler;
+
+using ParseFn = void (Compiler::*)(bool can_assign);
 
 struct ParseRule {
-    std::optional<ParseFn> m_prefix;
-    std::optional<ParseFn> m_infix;
+    ParseFn m_prefix;
+    ParseFn m_infix;
     Precedence m_precedence;
 };
 
@@ -54,18 +114,33 @@ public:
     Compiler(std::shared_ptr<scanner::Scanner> scanner, std::shared_ptr<chunk::Chunk> chunk);
 
     bool compile();
+    // Compiles the next top-level declaration of the source into its own
+    // chunk so it can run before the rest of the source has been read.
+    // Returns nothing at the end of the source.
+    std::optional<std::shared_ptr<chunk::Chunk>> compile_next();
+    [[nodiscard]] bool had_error() const;
 
 private:
     void advance();
+    const token::Token& current();
+    FunctionState& current_function();
+    const std::shared_ptr<chunk::Chunk>& current_chunk();
     bool match(token::TokenType token_type);
     bool check(token::TokenType token_type);
 
     // statements
     void statement();
     void declaration();
+    void class_declaration();
+    void method();
+    void fun_declaration();
+    void function(FunctionType type);
     void var_declaration();
     void print_statement();
+    void return_statement();
     void for_statement();
+    [[nodiscard]] std::optional<CountingLoop> match_counting_loop(usize condition_start, usize increment_start);
+    void counting_loop(const CountingLoop& loop);
     void expression_statement();
     void block_statement();
     void if_statement();
@@ -79,18 +154,27 @@ private:
     void binary(bool can_assign);
     void literal(bool can_assign);
     void string(bool can_assign);
+    void call(bool can_assign);
+    void dot(bool can_assign);
+    void list(bool can_assign);
+    void index(bool can_assign);
+    void this_(bool can_assign);
+    void super_(bool can_assign);
+    u8 argument_list();
     void variable(bool can_assign);
     void and_infix(bool can_assign);
     void or_infix(bool can_assign);
 
-    void consume(token::TokenType token_type, const std::string& message);
+    void consume(token::TokenType token_type, std::string_view message);
     void parse_precedence(Precedence precedence);
-    const ParseRule& get_rule(token::TokenType token_type);
+    static const ParseRule& get_rule(token::TokenType token_type);
     void synchronize();
-    u8 parse_variable(const std::string& error_msg);
+    u8 parse_variable(std::string_view error_msg);
     void mark_initialized();
     u8 identifier_constant(const token::Token& token);
-    std::optional<u8> resolve_local(const token::Token& name);
+    std::optional<u8> resolve_local(usize function_index, const token::Token& name);
+    std::optional<u8> resolve_upvalue(usize function_index, const token::Token& name);
+    u8 add_upvalue(usize function_index, u8 index, bool is_local);
     void add_local(const token::Token& name);
     void declare_variable();
     void define_variable(u8 global);
@@ -103,63 +187,27 @@ private:
     void emit_byte(u8 byte);
     void emit_bytes(u8 byte_1, u8 byte_2);
     void emit_constant(std::shared_ptr<object::Object> value);
+    void emit_property(u8 instruction, u8 name);
     void emit_return();
     void end_compilation();
+    void end_function();
     void emit_loop(int loop_start);
     u8 make_constant(std::shared_ptr<object::Object> value);
 
-    void error_at_current(const std::string& message);
-    void error(const std::string& message);
-    void error_at(const token::Token& token, const std::string& message);
+    void error_at_current(std::string_view message);
+    void error(std::string_view message);
+    void error_at(const token::Token& token, std::string_view message);
 
-    Parser m_parser;
-    std::array<Local, UINT8_COUNT> m_locals;
-    int m_local_count;
-    int m_scope_depth;
     std::shared_ptr<scanner::Scanner> m_scanner;
-    std::shared_ptr<chunk::Chunk> m_chunk;
-
-    std::unordered_map<token::TokenType, ParseRule> m_rules{
-        {token::TokenType::TOKEN_LEFT_PAREN, {std::bind(&Compiler::grouping, this, std::placeholders::_1), std::nullopt, Precedence::PREC_NONE}},
-        {token::TokenType::TOKEN_RIGHT_PAREN, {std::nullopt, std::nullopt, Precedence::PREC_NONE}},
-        {token::TokenType::TOKEN_LEFT_BRACE, {std::nullopt, std::nullopt, Precedence::PREC_NONE}},
-        {token::TokenType::TOKEN_RIGHT_BRACE, {std::nullopt, std::nullopt, Precedence::PREC_NONE}},
-        {token::TokenType::TOKEN_COMMA, {std::nullopt, std::nullopt, Precedence::PREC_NONE}},
-        {token::TokenType::TOKEN_DOT, {std::nullopt, std::nullopt, Precedence::PREC_NONE}},
-        {token::TokenType::TOKEN_MINUS, {std::bind(&Compiler::unary, this, std::placeholders::_1), std::bind(&Compiler::binary, this, std::placeholders::_1), Precedence::PREC_TERM}},
-        {token::TokenType::TOKEN_PLUS, {std::nullopt, std::bind(&Compiler::binary, this, std::placeholders::_1), Precedence::PREC_TERM}},
-        {token::TokenType::TOKEN_SEMICOLON, {std::nullopt, std::nullopt, Precedence::PREC_NONE}},
-        {token::TokenType::TOKEN_SLASH, {std::nullopt, std::bind(&Compiler::binary, this, std::placeholders::_1), Precedence::PREC_FACTOR}},
-        {token::TokenType::TOKEN_STAR, {std::nullopt, std::bind(&Compiler::binary, this, std::placeholders::_1), Precedence::PREC_FACTOR}},
-        {token::TokenType::TOKEN_BANG, {std::bind(&Compiler::unary, this, std::placeholders::_1), std::nullopt, Precedence::PREC_NONE}},
-        {token::TokenType::TOKEN_BANG_EQUAL, {std::nullopt, std::bind(&Compiler::binary, this, std::placeholders::_1), Precedence::PREC_EQUALITY}},
-        {token::TokenType::TOKEN_EQUAL, {std::nullopt, std::nullopt, Precedence::PREC_NONE}},
-        {token::TokenType::TOKEN_EQUAL_EQUAL, {std::nullopt, std::bind(&Compiler::binary, this, std::placeholders::_1), Precedence::PREC_EQUALITY}},
-        {token::TokenType::TOKEN_GREATER, {std::nullopt, std::bind(&Compiler::binary, this, std::placeholders::_1), Precedence::PREC_COMPARISON}},
-        {token::TokenType::TOKEN_GREATER_EQUAL, {std::nullopt, std::bind(&Compiler::binary, this, std::placeholders::_1), Precedence::PREC_COMPARISON}},
-        {token::TokenType::TOKEN_LESS, {std::nullopt, std::bind(&Compiler::binary, this, std::placeholders::_1), Precedence::PREC_COMPARISON}},
-        {token::TokenType::TOKEN_LESS_EQUAL, {std::nullopt, std::bind(&Compiler::binary, this, std::placeholders::_1), Precedence::PREC_COMPARISON}},
-        {token::TokenType::TOKEN_IDENTIFIER, {std::bind(&Compiler::variable, this, std::placeholders::_1), std::nullopt, Precedence::PREC_NONE}},
-        {token::TokenType::TOKEN_STRING, {std::bind(&Compiler::string, this, std::placeholders::_1), std::nullopt, Precedence::PREC_NONE}},
-        {token::TokenType::TOKEN_NUMBER, {std::bind(&Compiler::number, this, std::placeholders::_1), std::nullopt, Precedence::PREC_NONE}},
-        {token::TokenType::TOKEN_AND, {std::nullopt, std::bind(&Compiler::and_infix, this, std::placeholders::_1), Precedence::PREC_AND}},
-        {token::TokenType::TOKEN_CLASS, {std::nullopt, std::nullopt, Precedence::PREC_NONE}},
-        {token::TokenType::TOKEN_ELSE, {std::nullopt, std::nullopt, Precedence::PREC_NONE}},
-        {token::TokenType::TOKEN_FALSE, {std::bind(&Compiler::literal, this, std::placeholders::_1), std::nullopt, Precedence::PREC_NONE}},
-        {token::TokenType::TOKEN_FOR, {std::nullopt, std::nullopt, Precedence::PREC_NONE}},
-        {token::TokenType::TOKEN_FUN, {std::nullopt, std::nullopt, Precedence::PREC_NONE}},
-        {token::TokenType::TOKEN_IF, {std::nullopt, std::nullopt, Precedence::PREC_NONE}},
-        {token::TokenType::TOKEN_NIL, {std::bind(&Compiler::literal, this, std::placeholders::_1), std::nullopt, Precedence::PREC_NONE}},
-        {token::TokenType::TOKEN_OR, {std::nullopt, std::bind(&Compiler::or_infix, this, std::placeholders::_1), Precedence::PREC_NONE}},
-        {token::TokenType::TOKEN_PRINT, {std::nullopt, std::nullopt, Precedence::PREC_NONE}},
-        {token::TokenType::TOKEN_RETURN, {std::nullopt, std::nullopt, Precedence::PREC_NONE}},
-        {token::TokenType::TOKEN_SUPER, {std::nullopt, std::nullopt, Precedence::PREC_NONE}},
-        {token::TokenType::TOKEN_THIS, {std::nullopt, std::nullopt, Precedence::PREC_NONE}},
-        {token::TokenType::TOKEN_TRUE, {std::bind(&Compiler::literal, this, std::placeholders::_1), std::nullopt, Precedence::PREC_NONE}},
-        {token::TokenType::TOKEN_VAR, {std::nullopt, std::nullopt, Precedence::PREC_NONE}},
-        {token::TokenType::TOKEN_WHILE, {std::nullopt, std::nullopt, Precedence::PREC_NONE}},
-        {token::TokenType::TOKEN_ERROR, {std::nullopt, std::nullopt, Precedence::PREC_NONE}},
-        {token::TokenType::TOKEN_EOF, {std::nullopt, std::nullopt, Precedence::PREC_NONE}},
-    };
+    Parser m_parser;
+    bool m_started{false};
+    std::vector<FunctionState> m_functions;
+    // classes being compiled, the innermost last
+    std::vector<ClassState> m_classes;
+    // offset of the last OP_CALL, to turn it into a tail call when its result is returned
+    std::optional<usize> m_last_call;
+
+    // Pratt parser rules indexed by token type, shared by every compiler.
+    static const std::array<ParseRule, token::k_token_type_count> k_rules;
 };
 } // namespace compiler
@@ -4,6 +4,10 @@
 #include "object.h"
 #include "utility.h"
 #include "value.h"
+#include <array>
+#include <format>
+#include <memory>
+#include <span>
 #include <string>
 
 using namespace chunk;
@@ -15,7 +19,7 @@ usize simple_instruction(const std::string& name, usize offset) {
 }
 
 usize constant_instruction(const std::string& name, const Chunk& chunk, usize offset) {
-    u8 constant = chunk.get_code().at(offset + 1);
+    u8 constant = chunk.code()[offset + 1];
     print("{:16s} {:4d} '", name, constant);
 
     std::shared_ptr<object::Object> value = chunk.get_constants().get_values().at(constant);
@@ -25,15 +29,69 @@ usize constant_instruction(const std::string& name, const Chunk& chunk, usize of
     return offset + 2;
 }
 
+usize property_instruction(const std::string& name, const Chunk& chunk, usize offset) {
+    u8 constant = chunk.code()[offset + 1];
+    u16 cache = static_cast<u16>((chunk.code()[offset + 2] << 8) | chunk.code()[offset + 3]);
+    println("{:16s} {:4d} '{}' cache {}", name, constant, chunk.get_constants().get_values().at(constant)->to_string(), cache);
+    return offset + 4;
+}
+
+usize invoke_instruction(const std::string& name, const Chunk& chunk, usize offset) {
+    u8 constant = chunk.code()[offset + 1];
+    u16 cache = static_cast<u16>((chunk.code()[offset + 2] << 8) | chunk.code()[offset + 3]);
+    u8 arg_count = chunk.code()[offset + 4];
+    println("{:16s} ({} args) {:4d} '{}' cache {}", name, arg_count, constant, chunk.get_constants().get_values().at(constant)->to_string(), cache);
+    return offset + 5;
+}
+
+usize super_invoke_instruction(const std::string& name, const Chunk& chunk, usize offset) {
+    u8 constant = chunk.code()[offset + 1];
+    u8 arg_count = chunk.code()[offset + 2];
+    println("{:16s} ({} args) {:4d} '{}'", name, arg_count, constant, chunk.get_constants().get_values().at(constant)->to_string());
+    return offset + 3;
+}
+
 usize byte_instruction(const std::string& name, const Chunk& chunk, usize offset) {
-    u8 slot = chunk.get_code().at(offset + 1);
+    u8 slot = chunk.code()[offset + 1];
     println("{:16s} {:4d}", name, slot);
     return offset + 2;
 }
 
+usize closure_instruction(const Chunk& chunk, usize offset) {
+    u8 constant = chunk.code()[offset + 1];
+    u8 upvalue_count = chunk.code()[offset + 2];
+    println("{:16s} {:4d} {}", "OP_CLOSURE", constant, chunk.get_constants().get_values().at(constant)->to_string());
+
+    offset += 3;
+    for (u8 i = 0; i < upvalue_count; i++) {
+        u8 is_local = chunk.code()[offset];
+        u8 index = chunk.code()[offset + 1];
+        println("{:04d}    |                     {} {}", offset, is_local != 0 ? "local" : "upvalue", index);
+        offset += 2;
+    }
+    return offset;
+}
+
+// slot, comparison and bound, then the step, then the jump
+usize for_instruction(const std::string& name, int sign, const Chunk& chunk, usize offset) {
+    static constexpr std::array k_comparisons{"<", "<=", ">", ">="};
+    std::span<const u8> code = chunk.code();
+    u8 flags = code[offset + 2];
+    std::string bound = (flags & ForLoopFlags::FOR_BOUND_CONSTANT) != 0 ? chunk.get_constants().get_values().at(code[offset + 3])->to_string() : std::format("[{}]", code[offset + 3]);
+    std::string step;
+    usize next = offset + 6;
+    if (sign < 0) {
+        step = std::format(" {} {}", (flags & ForLoopFlags::FOR_SUBTRACT) != 0 ? "-" : "+", chunk.get_constants().get_values().at(code[offset + 4])->to_string());
+        next++;
+    }
+    u16 jump = static_cast<u16>((code[next - 2] << 8) | code[next - 1]);
+    println("{:16s} [{}]{} {} {} -> {:d}", name, code[offset + 1], step, k_comparisons[flags & ForLoopFlags::FOR_COMPARISON], bound, next + sign * jump);
+    return next;
+}
+
 usize jump_instruction(const std::string& name, int sign, const Chunk& chunk, usize offset) {
-    u16 jump = static_cast<u16>(chunk.get_code().at(offset + 1) << 8);
-    jump |= chunk.get_code().at(offset + 2);
+    u16 jump = static_cast<u16>(chunk.code()[offset + 1] << 8);
+    jump |= chunk.code()[offset + 2];
     println("{:16s} {:4d} -> {:d}", name, offset, offset + 3 + sign * jump);
     return offset + 3;
 }
@@ -41,13 +99,13 @@ usize jump_instruction(const std::string& name, int sign, const Chunk& chunk, us
 
 usize disassemble_instruction(const Chunk& chunk, usize offset) {
     print("{:04d} ", offset);
-    if (offset > 0 && chunk.get_lines().at(offset) == chunk.get_lines().at(offset - 1)) {
+    if (offset > 0 && chunk.line_at(offset) == chunk.line_at(offset - 1)) {
         print("\t| ");
     } else {
-        print("{:4d} ", chunk.get_lines().at(offset));
+        print("{:4d} ", chunk.line_at(offset));
     }
 
-    u8 instruction = chunk.get_code().at(offset);
+    u8 instruction = chunk.code()[offset];
     switch (instruction) {
     case OpCode::OP_JUMP:
         return jump_instruction("OP_JUMP", 1, chunk, offset);
@@ -55,6 +113,14 @@ usize disassemble_instruction(const Chunk& chunk, usize offset) {
         return jump_instruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
     case OpCode::OP_LOOP:
         return jump_instruction("OP_LOOP", -1, chunk, offset);
+    case OpCode::OP_FOR_PREP:
+        return for_instruction("OP_FOR_PREP", 1, chunk, offset);
+    case OpCode::OP_FOR_LOOP:
+        return for_instruction("OP_FOR_LOOP", -1, chunk, offset);
+    case OpCode::OP_CALL:
+        return byte_instruction("OP_CALL", chunk, offset);
+    case OpCode::OP_TAIL_CALL:
+        return byte_instruction("OP_TAIL_CALL", chunk, offset);
     case OpCode::OP_RETURN:
         return simple_instruction("OP_RETURN", offset);
     case OpCode::OP_PRINT:
@@ -97,6 +163,36 @@ usize disassemble_instruction(const Chunk& chunk, usize offset) {
         return simple_instruction("OP_DIVIDE", offset);
     case OpCode::OP_NOT:
         return simple_instruction("OP_NOT", offset);
+    case OpCode::OP_GET_UPVALUE:
+        return byte_instruction("OP_GET_UPVALUE", chunk, offset);
+    case OpCode::OP_SET_UPVALUE:
+        return byte_instruction("OP_SET_UPVALUE", chunk, offset);
+    case OpCode::OP_CLOSURE:
+        return closure_instruction(chunk, offset);
+    case OpCode::OP_CLOSE_UPVALUE:
+        return simple_instruction("OP_CLOSE_UPVALUE", offset);
+    case OpCode::OP_CLASS:
+        return constant_instruction("OP_CLASS", chunk, offset);
+    case OpCode::OP_METHOD:
+        return constant_instruction("OP_METHOD", chunk, offset);
+    case OpCode::OP_GET_PROPERTY:
+        return property_instruction("OP_GET_PROPERTY", chunk, offset);
+    case OpCode::OP_SET_PROPERTY:
+        return property_instruction("OP_SET_PROPERTY", chunk, offset);
+    case OpCode::OP_INVOKE:
+        return invoke_instruction("OP_INVOKE", chunk, offset);
+    case OpCode::OP_INHERIT:
+        return simple_instruction("OP_INHERIT", offset);
+    case OpCode::OP_GET_SUPER:
+        return constant_instruction("OP_GET_SUPER", chunk, offset);
+    case OpCode::OP_SUPER_INVOKE:
+        return super_invoke_instruction("OP_SUPER_INVOKE", chunk, offset);
+    case OpCode::OP_BUILD_LIST:
+        return byte_instruction("OP_BUILD_LIST", chunk, offset);
+    case OpCode::OP_GET_INDEX:
+        return simple_instruction("OP_GET_INDEX", offset);
+    case OpCode::OP_SET_INDEX:
+        return simple_instruction("OP_SET_INDEX", offset);
     default: {
         println("Unknown opcode {}", instruction);
         offset += 1;
@@ -110,7 +206,7 @@ usize disassemble_instruction(const Chunk& chunk, usize offset) {
 void disassemble_chunk(const Chunk& chunk, const std::string& name) {
     println("== {} ==", name);
     usize offset = 0;
-    while (offset < chunk.get_code().size()) {
+    while (offset < chunk.size()) {
         offset = disassemble_instruction(chunk, offset);
     }
 }
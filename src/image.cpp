@@ -0,0 +1,235 @@
+#include "image.h"
+#include "chunk.h"
+#include "common.h"
+#include "object.h"
+#include "source_buffer.h"
+#include "value.h"
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+using namespace chunk;
+using namespace object;
+
+namespace image {
+
+namespace {
+constexpr u32 k_byte_order = 0x01020304;
+
+static_assert(std::is_trivially_copyable_v<Header> && std::is_trivially_copyable_v<ChunkEntry> && std::is_trivially_copyable_v<Constant> && std::is_trivially_copyable_v<LineRun>);
+static_assert(sizeof(LineRun) == 8 && sizeof(ChunkEntry) == 56 && sizeof(Constant) == 16);
+
+usize align_up(usize offset, usize alignment) {
+    return (offset + alignment - 1) & ~(alignment - 1);
+}
+
+template<typename T>
+void put(std::string& data, usize offset, const T& value) {
+    std::memcpy(data.data() + offset, &value, sizeof(T));
+}
+
+// Whether `count` elements of `size` bytes at `offset` lie within `data_size`.
+bool fits(u64 offset, u64 count, u64 size, u64 data_size) {
+    return offset <= data_size && count <= (data_size - offset) / size;
+}
+} // namespace
+
+bool is_image(std::string_view data) {
+    return data.starts_with(k_magic);
+}
+
+/*
+ * Chunks are numbered breadth first from the script, so a function's entry
+ * always comes after the entry of the chunk declaring it.
+ */
+std::string serialize(const Chunk& chunk) {
+    std::vector<const Chunk*> chunks{&chunk};
+    std::vector<ChunkEntry> entries(1);
+    std::vector<u8> code;
+    std::vector<LineRun> line_runs;
+    std::vector<Constant> constants;
+    std::string strings;
+
+    for (usize i = 0; i < chunks.size(); i++) {
+        const Chunk& current = *chunks[i];
+        // a function's arity and name are filled in where it was found
+        ChunkEntry entry = entries[i];
+        entry.code_start = code.size();
+        entry.code_size = current.get_code().size();
+        code.insert(code.end(), current.get_code().begin(), current.get_code().end());
+        entry.line_run_start = static_cast<u32>(line_runs.size());
+        entry.line_run_count = static_cast<u32>(current.get_line_runs().size());
+        line_runs.insert(line_runs.end(), current.get_line_runs().begin(), current.get_line_runs().end());
+        entry.constant_start = static_cast<u32>(constants.size());
+        entry.constant_count = static_cast<u32>(current.get_constants().size());
+        entry.inline_cache_count = current.inline_cache_count();
+        entries[i] = entry;
+
+        for (const auto& value : current.get_constants().get_values()) {
+            Constant constant{static_cast<u32>(value->type), 0, 0};
+            switch (value->type) {
+            case ObjectType::OBJ_NUMBER:
+                constant.payload = std::bit_cast<u64>(static_cast<const NumberObject&>(*value).value);
+                break;
+            case ObjectType::OBJ_BOOLEAN:
+                constant.payload = static_cast<const BooleanObject&>(*value).value ? 1 : 0;
+                break;
+            case ObjectType::OBJ_STRING: {
+                const std::string& text = static_cast<const StringObject&>(*value).value;
+                constant.length = static_cast<u32>(text.size());
+                constant.payload = strings.size();
+                strings += text;
+            } break;
+            case ObjectType::OBJ_FUNCTION: {
+                const auto& function = static_cast<const FunctionObject&>(*value);
+                constant.payload = chunks.size();
+                chunks.emplace_back(function.chunk.get());
+                ChunkEntry function_entry{};
+                function_entry.arity = function.arity;
+                function_entry.name_length = static_cast<u32>(function.name.size());
+                function_entry.name_offset = strings.size();
+                strings += function.name;
+                entries.emplace_back(function_entry);
+            } break;
+            default:
+                break;
+            }
+            constants.emplace_back(constant);
+        }
+    }
+
+    Header header{};
+    std::memcpy(header.magic, k_magic.data(), sizeof(header.magic));
+    header.byte_order = k_byte_order;
+    header.version = k_format_version;
+    header.chunk_count = static_cast<u32>(entries.size());
+    header.chunks_offset = sizeof(Header);
+    header.code_offset = header.chunks_offset + entries.size() * sizeof(ChunkEntry);
+    header.code_size = code.size();
+    header.line_runs_offset = align_up(header.code_offset + header.code_size, alignof(LineRun));
+    header.line_run_count = line_runs.size();
+    header.constants_offset = align_up(header.line_runs_offset + line_runs.size() * sizeof(LineRun), alignof(Constant));
+    header.constant_count = constants.size();
+    header.strings_offset = header.constants_offset + constants.size() * sizeof(Constant);
+    header.strings_size = strings.size();
+
+    std::string data(header.strings_offset + header.strings_size, '\0');
+    put(data, 0, header);
+    std::memcpy(data.data() + header.chunks_offset, entries.data(), entries.size() * sizeof(ChunkEntry));
+    std::memcpy(data.data() + header.code_offset, code.data(), code.size());
+    std::memcpy(data.data() + header.line_runs_offset, line_runs.data(), line_runs.size() * sizeof(LineRun));
+    std::memcpy(data.data() + header.constants_offset, constants.data(), constants.size() * sizeof(Constant));
+    std::memcpy(data.data() + header.strings_offset, strings.data(), strings.size());
+    return data;
+}
+
+/*
+ * Checks that every section lies within the image and is aligned, that the
+ * chunks' ranges lie within the sections and that constants refer to
+ * strings within the pool or to later chunks, so functions cannot contain
+ * themselves. The code itself is trusted like the output of the compiler is.
+ */
+std::shared_ptr<Chunk> load(scanner::SourceBuffer data) {
+    auto backing = std::make_shared<const scanner::SourceBuffer>(std::move(data));
+    std::string_view bytes = backing->view();
+    const char* base = bytes.data();
+
+    Header header;
+    if (bytes.size() < sizeof(Header) || !is_image(bytes) || reinterpret_cast<std::uintptr_t>(base) % alignof(Constant) != 0) {
+        return nullptr;
+    }
+    std::memcpy(&header, base, sizeof(Header));
+    if (header.byte_order != k_byte_order || header.version != k_format_version || header.chunk_count == 0) {
+        return nullptr;
+    }
+
+    u64 size = bytes.size();
+    if (!fits(header.chunks_offset, header.chunk_count, sizeof(ChunkEntry), size)
+        || !fits(header.code_offset, header.code_size, 1, size)
+        || !fits(header.line_runs_offset, header.line_run_count, sizeof(LineRun), size)
+        || !fits(header.constants_offset, header.constant_count, sizeof(Constant), size)
+        || !fits(header.strings_offset, header.strings_size, 1, size)
+        || header.chunks_offset % alignof(ChunkEntry) != 0 || header.line_runs_offset % alignof(LineRun) != 0
+        || header.constants_offset % alignof(Constant) != 0) {
+        return nullptr;
+    }
+
+    std::span<const ChunkEntry> entries{reinterpret_cast<const ChunkEntry*>(base + header.chunks_offset), header.chunk_count};
+    std::span<const u8> code{reinterpret_cast<const u8*>(base + header.code_offset), header.code_size};
+    std::span<const LineRun> line_runs{reinterpret_cast<const LineRun*>(base + header.line_runs_offset), header.line_run_count};
+    std::span<const Constant> constants{reinterpret_cast<const Constant*>(base + header.constants_offset), header.constant_count};
+    std::string_view strings = bytes.substr(header.strings_offset, header.strings_size);
+
+    std::vector<std::shared_ptr<Chunk>> chunks;
+    std::vector<std::shared_ptr<FunctionObject>> functions;
+    for (usize i = 0; i < entries.size(); i++) {
+        const ChunkEntry& entry = entries[i];
+        if (!fits(entry.code_start, entry.code_size, 1, code.size())
+            || !fits(entry.line_run_start, entry.line_run_count, 1, line_runs.size())
+            || !fits(entry.constant_start, entry.constant_count, 1, constants.size())
+            || !fits(entry.name_offset, entry.name_length, 1, strings.size()) || entry.arity > UINT8_MAX
+            || entry.inline_cache_count > entry.code_size / 4) {
+            return nullptr;
+        }
+        chunks.emplace_back(Chunk::borrow(code.subspan(entry.code_start, entry.code_size), line_runs.subspan(entry.line_run_start, entry.line_run_count), backing));
+        for (u64 cache = 0; cache < entry.inline_cache_count; cache++) {
+            chunks.back()->add_inline_cache();
+        }
+        if (i > 0) {
+            functions.emplace_back(std::make_shared<FunctionObject>(std::string{strings.substr(entry.name_offset, entry.name_length)}, static_cast<u8>(entry.arity), chunks.back()));
+        } else {
+            // the script
+            functions.emplace_back(nullptr);
+        }
+    }
+
+    for (usize i = 0; i < entries.size(); i++) {
+        for (const Constant& constant : constants.subspan(entries[i].constant_start, entries[i].constant_count)) {
+            std::shared_ptr<Object> value;
+            switch (static_cast<ObjectType>(constant.type)) {
+            case ObjectType::OBJ_NULL:
+                value = std::make_shared<NullObject>();
+                break;
+            case ObjectType::OBJ_NUMBER:
+                value = std::make_shared<NumberObject>(std::bit_cast<double>(constant.payload));
+                break;
+            case ObjectType::OBJ_BOOLEAN:
+                value = std::make_shared<BooleanObject>(constant.payload != 0);
+                break;
+            case ObjectType::OBJ_STRING:
+                if (!fits(constant.payload, constant.length, 1, strings.size())) {
+                    return nullptr;
+                }
+                value = std::make_shared<StringObject>(std::string{strings.substr(constant.payload, constant.length)});
+                break;
+            case ObjectType::OBJ_FUNCTION:
+                if (constant.payload <= i || constant.payload >= functions.size()) {
+                    return nullptr;
+                }
+                value = functions[constant.payload];
+                break;
+            default:
+                return nullptr;
+            }
+            (void)chunks[i]->write_constant(std::move(value));
+        }
+    }
+    return chunks.front();
+}
+
+std::shared_ptr<Chunk> load(const std::string& path) {
+    std::optional<scanner::SourceBuffer> data = scanner::SourceBuffer::open(path);
+    if (!data || !data->is_mapped()) {
+        return nullptr;
+    }
+    return load(std::move(data.value()));
+}
+
+} // namespace image
@@ -0,0 +1,94 @@
+#pragma once
+
+#include "chunk.h"
+#include "common.h"
+#include "source_buffer.h"
+#include <memory>
+#include <string>
+#include <string_view>
+
+namespace image {
+
+/*
+ * Bytecode image. Unlike a cache file (see cache.h) an image is not decoded
+ * when it is loaded: the file is mapped read-only and the code and line
+ * tables of its chunks point straight into the mapping, so processes running
+ * the same image share its pages through the page cache. All references
+ * inside the image are offsets from its start, it works wherever it is
+ * mapped.
+ *
+ * The script and every function declared in it have a chunk of their own,
+ * listed in the chunk table with the script first. Each chunk owns a range
+ * of the code, the line runs and the constants.
+ *
+ * Only constants need heap objects. They are listed in a fix-up table that
+ * the loader walks to create them, strings refer to the string pool and
+ * functions to a later entry of the chunk table.
+ *
+ *   Header
+ *   chunk table          ChunkEntry[chunk_count], 8 byte aligned
+ *   code                 code_size bytes
+ *   line runs            chunk::LineRun[line_run_count], 4 byte aligned
+ *   fix-ups              Constant[constant_count], 8 byte aligned
+ *   string pool          strings_size bytes
+ *
+ * Fields are in the byte order of the machine that wrote the image, an image
+ * from a machine with another byte order is rejected.
+ */
+
+constexpr u32 k_format_version = 3;
+constexpr std::string_view k_magic = "LOXI";
+
+struct Header {
+    char magic[4];
+    u32 byte_order;
+    u32 version;
+    u32 chunk_count;
+    u64 chunks_offset;
+    u64 code_offset;
+    u64 code_size;
+    u64 line_runs_offset;
+    u64 line_run_count;
+    u64 constants_offset;
+    u64 constant_count;
+    u64 strings_offset;
+    u64 strings_size;
+};
+
+struct ChunkEntry {
+    // ranges of the code, line runs and constants of the image
+    u64 code_start;
+    u64 code_size;
+    u32 line_run_start;
+    u32 line_run_count;
+    u32 constant_start;
+    u32 constant_count;
+    // of a function, a name in the string pool, zero for the script
+    u32 arity;
+    u32 name_length;
+    u64 name_offset;
+    // property access sites, each gets an empty inline cache when loaded
+    u64 inline_cache_count;
+};
+
+struct Constant {
+    // an object::ObjectType
+    u32 type;
+    // length of a string
+    u32 length;
+    // bits of a number, value of a boolean, offset of a string in the pool,
+    // index of a function's entry in the chunk table
+    u64 payload;
+};
+
+// Whether `data` starts like an image, it may still be corrupt.
+[[nodiscard]] bool is_image(std::string_view data);
+
+[[nodiscard]] std::string serialize(const chunk::Chunk& chunk);
+// The returned chunk borrows from `data` and keeps it alive. Returns nullptr
+// when `data` is not an image of this version.
+[[nodiscard]] std::shared_ptr<chunk::Chunk> load(scanner::SourceBuffer data);
+// Returns nullptr when there is no usable image at `path`.
+[[nodiscard]] std::shared_ptr<chunk::Chunk> load(const std::string& path);
+
+} // namespace image
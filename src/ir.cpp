@@ -0,0 +1,1387 @@
+#include "ir.h"
+#include "chunk.h"
+#include "common.h"
+#include "object.h"
+#include <algorithm>
+#include <cstdint>
+#include <format>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace chunk;
+
+namespace ir {
+
+void* Arena::allocate(usize size, usize alignment) {
+    auto padding_for = [alignment](const std::byte* cursor) {
+        return (alignment - reinterpret_cast<std::uintptr_t>(cursor) % alignment) % alignment;
+    };
+
+    usize padding = padding_for(m_cursor);
+    if (m_cursor == nullptr || padding + size > m_remaining) {
+        usize block_size = std::max(k_block_size, size + alignment);
+        m_blocks.emplace_back(std::make_unique<std::byte[]>(block_size));
+        m_cursor = m_blocks.back().get();
+        m_remaining = block_size;
+        padding = padding_for(m_cursor);
+    }
+
+    std::byte* memory = m_cursor + padding;
+    m_cursor = memory + size;
+    m_remaining -= padding + size;
+    return memory;
+}
+
+Instr* resolve(Instr* instr) {
+    while (instr->forward != nullptr) {
+        instr = instr->forward;
+    }
+    return instr;
+}
+
+Instr* Instr::arg(u32 index) const {
+    return resolve(args[index]);
+}
+
+bool Instr::has_result() const {
+    return op != Op::IR_DEFINE_GLOBAL && op != Op::IR_SET_GLOBAL && op != Op::IR_PRINT;
+}
+
+bool Instr::is_rematerializable() const {
+    return op == Op::IR_CONSTANT || op == Op::IR_NIL || op == Op::IR_TRUE || op == Op::IR_FALSE;
+}
+
+u32 Block::successor_count() const {
+    switch (terminator) {
+    case Terminator::TERM_JUMP:
+        return 1;
+    case Terminator::TERM_BRANCH:
+        return 2;
+    case Terminator::TERM_RETURN:
+        return 0;
+    }
+    return 0;
+}
+
+u32 Block::predecessor_index(const Block* pred) const {
+    for (u32 i = 0; i < pred_count; i++) {
+        if (preds[i] == pred) {
+            return i;
+        }
+    }
+    return pred_count;
+}
+
+void Block::append(Instr* instr) {
+    instr->block = this;
+    instr->prev = last;
+    instr->next = nullptr;
+    if (last != nullptr) {
+        last->next = instr;
+    } else {
+        first = instr;
+    }
+    last = instr;
+}
+
+void Block::unlink(Instr* instr) {
+    if (instr->prev != nullptr) {
+        instr->prev->next = instr->next;
+    } else {
+        first = instr->next;
+    }
+    if (instr->next != nullptr) {
+        instr->next->prev = instr->prev;
+    } else {
+        last = instr->prev;
+    }
+    instr->prev = nullptr;
+    instr->next = nullptr;
+}
+
+Function::Function(const Chunk& chunk)
+    : m_chunk{chunk},
+      m_instr_count{0} {}
+
+Block* Function::make_block(usize offset) {
+    Block* block = m_arena.make<Block>();
+    block->id = static_cast<u32>(m_all_blocks.size());
+    block->offset = offset;
+    block->terminator = Terminator::TERM_RETURN;
+    m_all_blocks.emplace_back(block);
+    return block;
+}
+
+Instr* Function::make_instr(Block* block, Op op, u32 line, std::initializer_list<Instr*> args, u8 operand) {
+    Instr* instr = m_arena.make<Instr>();
+    instr->op = op;
+    instr->operand = operand;
+    instr->line = line;
+    instr->id = m_instr_count++;
+    instr->arg_count = static_cast<u32>(args.size());
+    instr->args = m_arena.make_array<Instr*>(args.size());
+    std::copy(args.begin(), args.end(), instr->args);
+    block->append(instr);
+    return instr;
+}
+
+Instr* Function::make_phi(Block* block, u32 line, u32 arg_count) {
+    Instr* phi = make_instr(block, Op::IR_PHI, line, {});
+    phi->arg_count = arg_count;
+    phi->args = m_arena.make_array<Instr*>(arg_count);
+    return phi;
+}
+
+void Function::set_predecessors(Block* block, u32 count) {
+    block->preds = m_arena.make_array<Block*>(count);
+    block->pred_count = 0;
+}
+
+void Function::replace(Instr* instr, Instr* value) {
+    instr->forward = value;
+    instr->block->unlink(instr);
+}
+
+void Function::remove(Instr* instr) {
+    instr->block->unlink(instr);
+}
+
+void Function::remove_predecessor(Block* block, const Block* pred) {
+    u32 index = block->predecessor_index(pred);
+    if (index == block->pred_count) {
+        return;
+    }
+
+    std::copy(block->preds + index + 1, block->preds + block->pred_count, block->preds + index);
+    block->pred_count--;
+
+    // phi operands are kept in predecessor order
+    for (Instr* instr = block->first; instr != nullptr && instr->op == Op::IR_PHI; instr = instr->next) {
+        std::copy(instr->args + index + 1, instr->args + instr->arg_count, instr->args + index);
+        instr->arg_count--;
+    }
+}
+
+/*
+ * Orders the reachable blocks in reverse postorder. Successors are visited
+ * falsey branch first so that the truthy branch, which is the fallthrough in
+ * the original bytecode, directly follows its block. Edges out of blocks that
+ * became unreachable are dropped from their successors.
+ */
+void Function::compute_order() {
+    std::vector<bool> visited(m_all_blocks.size(), false);
+    std::vector<Block*> postorder;
+    std::vector<std::pair<Block*, u32>> work{{m_all_blocks.front(), 0}};
+    visited[m_all_blocks.front()->id] = true;
+
+    while (!work.empty()) {
+        auto& [block, next] = work.back();
+        u32 count = block->successor_count();
+        if (next < count) {
+            Block* successor = block->targets[count - 1 - next];
+            next++;
+            if (!visited[successor->id]) {
+                visited[successor->id] = true;
+                work.emplace_back(successor, 0);
+            }
+            continue;
+        }
+        postorder.emplace_back(block);
+        work.pop_back();
+    }
+
+    for (Block* block : m_all_blocks) {
+        if (visited[block->id]) {
+            continue;
+        }
+        for (u32 i = 0; i < block->successor_count(); i++) {
+            remove_predecessor(block->targets[i], block);
+        }
+        block->terminator = Terminator::TERM_RETURN;
+    }
+
+    m_blocks.assign(postorder.rbegin(), postorder.rend());
+    for (u32 i = 0; i < m_blocks.size(); i++) {
+        m_blocks[i]->rpo_index = i;
+    }
+}
+
+// "A Simple, Fast Dominance Algorithm" by Cooper, Harvey and Kennedy.
+void Function::compute_dominators() {
+    for (Block* block : m_blocks) {
+        block->idom = nullptr;
+    }
+    Block* entry = get_entry();
+    entry->idom = entry;
+
+    auto intersect = [](Block* lhs, Block* rhs) {
+        while (lhs != rhs) {
+            while (lhs->rpo_index > rhs->rpo_index) {
+                lhs = lhs->idom;
+            }
+            while (rhs->rpo_index > lhs->rpo_index) {
+                rhs = rhs->idom;
+            }
+        }
+        return lhs;
+    };
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (Block* block : m_blocks) {
+            if (block == entry) {
+                continue;
+            }
+            Block* idom = nullptr;
+            for (u32 i = 0; i < block->pred_count; i++) {
+                Block* pred = block->preds[i];
+                if (pred->idom == nullptr) {
+                    continue;
+                }
+                idom = idom == nullptr ? pred : intersect(pred, idom);
+            }
+            if (block->idom != idom) {
+                block->idom = idom;
+                changed = true;
+            }
+        }
+    }
+
+    std::vector<std::vector<Block*>> children(m_all_blocks.size());
+    for (Block* block : m_blocks) {
+        if (block != entry) {
+            children[block->idom->id].emplace_back(block);
+        }
+    }
+    u32 time = 0;
+    std::vector<std::pair<Block*, usize>> stack{{entry, 0}};
+    entry->dom_enter = time++;
+    while (!stack.empty()) {
+        auto& [block, next_child] = stack.back();
+        if (next_child < children[block->id].size()) {
+            Block* child = children[block->id][next_child++];
+            child->dom_enter = time++;
+            stack.emplace_back(child, 0);
+        } else {
+            block->dom_exit = time++;
+            stack.pop_back();
+        }
+    }
+}
+
+bool Function::dominates(const Block* dominator, const Block* block) const {
+    return dominator->dom_enter <= block->dom_enter && block->dom_exit <= dominator->dom_exit;
+}
+
+const Chunk& Function::get_chunk() const {
+    return m_chunk;
+}
+
+Block* Function::get_entry() const {
+    return m_all_blocks.front();
+}
+
+const std::vector<Block*>& Function::get_blocks() const {
+    return m_blocks;
+}
+
+u32 Function::block_count() const {
+    return static_cast<u32>(m_all_blocks.size());
+}
+
+u32 Function::instr_count() const {
+    return m_instr_count;
+}
+
+std::string Function::to_string() const {
+    static constexpr const char* op_names[] = {
+        "constant", "nil", "true", "false", "copy", "phi", "get_global", "define_global", "set_global",
+        "equal", "greater", "less", "add", "subtract", "multiply", "divide", "not", "negate", "print"};
+
+    std::string out;
+    for (const Block* block : m_blocks) {
+        out += std::format("block{}:", block->id);
+        for (u32 i = 0; i < block->pred_count; i++) {
+            out += std::format(" <- block{}", block->preds[i]->id);
+        }
+        out += "\n";
+        for (const Instr* instr = block->first; instr != nullptr; instr = instr->next) {
+            out += instr->has_result() ? std::format("  v{} = ", instr->id) : std::string{"  "};
+            out += op_names[static_cast<u8>(instr->op)];
+            if (instr->op == Op::IR_CONSTANT || instr->op == Op::IR_GET_GLOBAL || instr->op == Op::IR_DEFINE_GLOBAL || instr->op == Op::IR_SET_GLOBAL) {
+                out += " '" + m_chunk.get_constants().get_values().at(instr->operand)->to_string() + "'";
+            }
+            for (u32 i = 0; i < instr->arg_count; i++) {
+                out += std::format("{} v{}", i == 0 ? "" : ",", instr->arg(i)->id);
+            }
+            out += "\n";
+        }
+        switch (block->terminator) {
+        case Terminator::TERM_JUMP:
+            out += std::format("  jump block{}\n", block->targets[0]->id);
+            break;
+        case Terminator::TERM_BRANCH:
+            out += std::format("  branch v{} ? block{} : block{}\n", resolve(block->condition)->id, block->targets[0]->id, block->targets[1]->id);
+            break;
+        case Terminator::TERM_RETURN:
+            out += "  return\n";
+            break;
+        }
+    }
+    return out;
+}
+
+namespace {
+// Length of an instruction including its operands, zero for
+// instructions the IR does not model.
+usize instruction_length(u8 instruction) {
+    switch (instruction) {
+    case OpCode::OP_NIL:
+    case OpCode::OP_TRUE:
+    case OpCode::OP_FALSE:
+    case OpCode::OP_POP:
+    case OpCode::OP_EQUAL:
+    case OpCode::OP_GREATER:
+    case OpCode::OP_LESS:
+    case OpCode::OP_ADD:
+    case OpCode::OP_SUBTRACT:
+    case OpCode::OP_MULTIPLY:
+    case OpCode::OP_DIVIDE:
+    case OpCode::OP_NOT:
+    case OpCode::OP_NEGATE:
+    case OpCode::OP_PRINT:
+    case OpCode::OP_RETURN:
+        return 1;
+    case OpCode::OP_CONSTANT:
+    case OpCode::OP_GET_LOCAL:
+    case OpCode::OP_SET_LOCAL:
+    case OpCode::OP_GET_GLOBAL:
+    case OpCode::OP_DEFINE_GLOBAL:
+    case OpCode::OP_SET_GLOBAL:
+        return 2;
+    case OpCode::OP_JUMP:
+    case OpCode::OP_JUMP_IF_FALSE:
+    case OpCode::OP_LOOP:
+        return 3;
+    case OpCode::OP_FOR_PREP:
+    case OpCode::OP_FOR_LOOP:
+        // counting loops run faster as compiled than as the compare, add
+        // and jumps they would be lowered to
+        return 0;
+    default:
+        return 0;
+    }
+}
+
+std::optional<usize> jump_target(const std::vector<u8>& code, usize offset) {
+    usize jump = (code[offset + 1] << 8) | code[offset + 2];
+    if (code[offset] == OpCode::OP_LOOP) {
+        if (jump > offset + 3) {
+            return std::nullopt;
+        }
+        return offset + 3 - jump;
+    }
+    return offset + 3 + jump;
+}
+
+Op binary_op(u8 instruction) {
+    switch (instruction) {
+    case OpCode::OP_EQUAL:
+        return Op::IR_EQUAL;
+    case OpCode::OP_GREATER:
+        return Op::IR_GREATER;
+    case OpCode::OP_LESS:
+        return Op::IR_LESS;
+    case OpCode::OP_ADD:
+        return Op::IR_ADD;
+    case OpCode::OP_SUBTRACT:
+        return Op::IR_SUBTRACT;
+    case OpCode::OP_MULTIPLY:
+        return Op::IR_MULTIPLY;
+    default:
+        return Op::IR_DIVIDE;
+    }
+}
+} // namespace
+
+/*
+ * The chunk is split into basic blocks at jump targets and after jumps,
+ * then each block is interpreted abstractly over a stack of SSA values.
+ * Local variable slots are just stack positions, so reading or writing a
+ * local becomes a copy of the value currently in that position. Blocks
+ * with several predecessors start with one phi per stack position; the
+ * trivial ones are cleaned up by copy propagation.
+ */
+std::unique_ptr<Function> build(const Chunk& chunk) {
+    const auto& code = chunk.get_code();
+
+    std::vector<bool> starts(code.size() + 1, false);
+    std::vector<bool> leaders(code.size() + 1, false);
+    leaders[0] = true;
+    leaders[code.size()] = true;
+    for (usize offset = 0; offset < code.size();) {
+        usize length = instruction_length(code[offset]);
+        if (length == 0 || offset + length > code.size()) {
+            return nullptr;
+        }
+        starts[offset] = true;
+
+        if (code[offset] == OpCode::OP_JUMP || code[offset] == OpCode::OP_JUMP_IF_FALSE || code[offset] == OpCode::OP_LOOP) {
+            std::optional<usize> target = jump_target(code, offset);
+            if (!target || target.value() > code.size()) {
+                return nullptr;
+            }
+            leaders[target.value()] = true;
+            leaders[offset + length] = true;
+        } else if (code[offset] == OpCode::OP_RETURN) {
+            leaders[offset + length] = true;
+        }
+        offset += length;
+    }
+    starts[code.size()] = true;
+
+    auto function = std::make_unique<Function>(chunk);
+    std::vector<Block*> block_at(code.size() + 1, nullptr);
+    for (usize offset = 0; offset <= code.size(); offset++) {
+        if (!leaders[offset]) {
+            continue;
+        }
+        if (!starts[offset]) {
+            // jump into the middle of an instruction
+            return nullptr;
+        }
+        block_at[offset] = function->make_block(offset);
+    }
+
+    // find the terminator of every block
+    std::vector<u32> pred_counts(function->block_count(), 0);
+    for (usize start = 0; start <= code.size(); start++) {
+        Block* block = block_at[start];
+        if (block == nullptr) {
+            continue;
+        }
+
+        usize offset = start;
+        while (offset < code.size()) {
+            u8 instruction = code[offset];
+            usize next = offset + instruction_length(instruction);
+            block->line = static_cast<u32>(chunk.line_at(offset));
+            if (instruction == OpCode::OP_JUMP || instruction == OpCode::OP_LOOP) {
+                block->terminator = Terminator::TERM_JUMP;
+                block->targets[0] = block_at[jump_target(code, offset).value()];
+                break;
+            }
+            if (instruction == OpCode::OP_JUMP_IF_FALSE) {
+                block->terminator = Terminator::TERM_BRANCH;
+                block->targets[0] = block_at[next];
+                block->targets[1] = block_at[jump_target(code, offset).value()];
+                if (block->targets[0] == block->targets[1]) {
+                    block->terminator = Terminator::TERM_JUMP;
+                }
+                break;
+            }
+            if (instruction == OpCode::OP_RETURN) {
+                block->terminator = Terminator::TERM_RETURN;
+                break;
+            }
+            if (leaders[next]) {
+                block->terminator = Terminator::TERM_JUMP;
+                block->targets[0] = block_at[next];
+                break;
+            }
+            offset = next;
+        }
+
+        for (u32 i = 0; i < block->successor_count(); i++) {
+            pred_counts[block->targets[i]->id]++;
+        }
+    }
+
+    for (Block* block : block_at) {
+        if (block != nullptr) {
+            function->set_predecessors(block, pred_counts[block->id]);
+        }
+    }
+    for (Block* block : block_at) {
+        if (block == nullptr) {
+            continue;
+        }
+        for (u32 i = 0; i < block->successor_count(); i++) {
+            Block* target = block->targets[i];
+            target->preds[target->pred_count++] = block;
+        }
+    }
+
+    function->compute_order();
+
+    std::vector<std::vector<Instr*>> exit_stacks(function->block_count());
+    std::vector<std::vector<Instr*>> entry_phis(function->block_count());
+    std::vector<bool> done(function->block_count(), false);
+
+    for (Block* block : function->get_blocks()) {
+        std::vector<Instr*> stack;
+        if (block != function->get_entry() && block->pred_count == 1) {
+            if (!done[block->preds[0]->id]) {
+                return nullptr;
+            }
+            stack = exit_stacks[block->preds[0]->id];
+        } else if (block != function->get_entry()) {
+            std::optional<usize> height;
+            for (u32 i = 0; i < block->pred_count; i++) {
+                if (done[block->preds[i]->id]) {
+                    height = exit_stacks[block->preds[i]->id].size();
+                    break;
+                }
+            }
+            if (!height) {
+                return nullptr;
+            }
+            for (usize slot = 0; slot < height.value(); slot++) {
+                stack.emplace_back(function->make_phi(block, block->line, block->pred_count));
+            }
+            entry_phis[block->id] = stack;
+        }
+
+        auto pop = [&stack]() -> Instr* {
+            if (stack.empty()) {
+                return nullptr;
+            }
+            Instr* value = stack.back();
+            stack.pop_back();
+            return value;
+        };
+
+        usize offset = block->offset;
+        while (offset < code.size()) {
+            u8 instruction = code[offset];
+            u32 line = static_cast<u32>(chunk.line_at(offset));
+            u8 operand = instruction_length(instruction) > 1 ? code[offset + 1] : 0;
+
+            switch (instruction) {
+            case OpCode::OP_CONSTANT:
+                stack.emplace_back(function->make_instr(block, Op::IR_CONSTANT, line, {}, operand));
+                break;
+            case OpCode::OP_NIL:
+                stack.emplace_back(function->make_instr(block, Op::IR_NIL, line, {}));
+                break;
+            case OpCode::OP_TRUE:
+                stack.emplace_back(function->make_instr(block, Op::IR_TRUE, line, {}));
+                break;
+            case OpCode::OP_FALSE:
+                stack.emplace_back(function->make_instr(block, Op::IR_FALSE, line, {}));
+                break;
+            case OpCode::OP_POP:
+                if (pop() == nullptr) {
+                    return nullptr;
+                }
+                break;
+            case OpCode::OP_GET_LOCAL:
+                if (operand >= stack.size()) {
+                    return nullptr;
+                }
+                stack.emplace_back(function->make_instr(block, Op::IR_COPY, line, {stack[operand]}));
+                break;
+            case OpCode::OP_SET_LOCAL:
+                if (operand >= stack.size()) {
+                    return nullptr;
+                }
+                stack[operand] = function->make_instr(block, Op::IR_COPY, line, {stack.back()});
+                break;
+            case OpCode::OP_GET_GLOBAL:
+                stack.emplace_back(function->make_instr(block, Op::IR_GET_GLOBAL, line, {}, operand));
+                break;
+            case OpCode::OP_DEFINE_GLOBAL: {
+                Instr* value = pop();
+                if (value == nullptr) {
+                    return nullptr;
+                }
+                function->make_instr(block, Op::IR_DEFINE_GLOBAL, line, {value}, operand);
+                break;
+            }
+            case OpCode::OP_SET_GLOBAL:
+                if (stack.empty()) {
+                    return nullptr;
+                }
+                function->make_instr(block, Op::IR_SET_GLOBAL, line, {stack.back()}, operand);
+                break;
+            case OpCode::OP_EQUAL:
+            case OpCode::OP_GREATER:
+            case OpCode::OP_LESS:
+            case OpCode::OP_ADD:
+            case OpCode::OP_SUBTRACT:
+            case OpCode::OP_MULTIPLY:
+            case OpCode::OP_DIVIDE: {
+                Instr* rhs = pop();
+                Instr* lhs = pop();
+                if (lhs == nullptr || rhs == nullptr) {
+                    return nullptr;
+                }
+                stack.emplace_back(function->make_instr(block, binary_op(instruction), line, {lhs, rhs}));
+                break;
+            }
+            case OpCode::OP_NOT:
+            case OpCode::OP_NEGATE: {
+                Instr* value = pop();
+                if (value == nullptr) {
+                    return nullptr;
+                }
+                Op op = instruction == OpCode::OP_NOT ? Op::IR_NOT : Op::IR_NEGATE;
+                stack.emplace_back(function->make_instr(block, op, line, {value}));
+                break;
+            }
+            case OpCode::OP_PRINT: {
+                Instr* value = pop();
+                if (value == nullptr) {
+                    return nullptr;
+                }
+                function->make_instr(block, Op::IR_PRINT, line, {value});
+                break;
+            }
+            case OpCode::OP_JUMP_IF_FALSE:
+                if (stack.empty()) {
+                    return nullptr;
+                }
+                // the condition stays on the stack for both successors
+                block->condition = stack.back();
+                break;
+            default:
+                break;
+            }
+
+            usize next = offset + instruction_length(instruction);
+            if (next > code.size() || leaders[next] || instruction == OpCode::OP_JUMP || instruction == OpCode::OP_LOOP || instruction == OpCode::OP_JUMP_IF_FALSE || instruction == OpCode::OP_RETURN) {
+                break;
+            }
+            offset = next;
+        }
+
+        exit_stacks[block->id] = std::move(stack);
+        done[block->id] = true;
+    }
+
+    for (Block* block : function->get_blocks()) {
+        const std::vector<Instr*>& phis = entry_phis[block->id];
+        if (block == function->get_entry() && block->pred_count > 0 && !exit_stacks[block->preds[0]->id].empty()) {
+            // the entry is only ever reached with an empty stack
+            return nullptr;
+        }
+        if (block == function->get_entry() || block->pred_count < 2) {
+            continue;
+        }
+        for (u32 i = 0; i < block->pred_count; i++) {
+            const std::vector<Instr*>& incoming = exit_stacks[block->preds[i]->id];
+            if (incoming.size() != phis.size()) {
+                return nullptr;
+            }
+            for (usize slot = 0; slot < phis.size(); slot++) {
+                phis[slot]->args[i] = incoming[slot];
+            }
+        }
+    }
+
+    return function;
+}
+
+namespace {
+struct Range {
+    u32 from;
+    u32 to;
+};
+
+/*
+ * Lowers SSA back onto the VM's value stack. Values with a single use
+ * later in the same block are left on the stack for their user, constants
+ * are re-emitted where they are needed and everything else lives in a
+ * register: a stack slot reserved with OP_NIL on entry and accessed with
+ * OP_GET_LOCAL / OP_SET_LOCAL. Registers are shared between values whose
+ * live ranges do not overlap, preferring the slot of a related phi so that
+ * the moves on loop back edges disappear.
+ */
+class Lowering {
+public:
+    Lowering(Function& function, Chunk& out)
+        : m_function{function},
+          m_out{out},
+          m_positions(function.instr_count(), 0),
+          m_ranges(function.instr_count()),
+          m_block_starts(function.block_count(), 0),
+          m_block_ends(function.block_count(), 0) {}
+
+    bool run() {
+        count_uses();
+        assign_placements();
+        if (!allocate_registers()) {
+            return false;
+        }
+        return emit_code();
+    }
+
+private:
+    template<typename F>
+    void for_each_instr(F&& f) {
+        for (Block* block : m_function.get_blocks()) {
+            for (Instr* instr = block->first; instr != nullptr; instr = instr->next) {
+                f(block, instr);
+            }
+        }
+    }
+
+    void count_uses() {
+        for_each_instr([](Block*, Instr* instr) {
+            instr->use_count = 0;
+            instr->escapes = false;
+        });
+        for_each_instr([](Block* block, Instr* instr) {
+            for (u32 i = 0; i < instr->arg_count; i++) {
+                instr->args[i] = instr->arg(i);
+                instr->args[i]->use_count++;
+                if (instr->op == Op::IR_PHI || instr->args[i]->block != block) {
+                    instr->args[i]->escapes = true;
+                }
+            }
+        });
+        for (Block* block : m_function.get_blocks()) {
+            if (block->terminator == Terminator::TERM_BRANCH) {
+                block->condition = resolve(block->condition);
+                block->condition->use_count++;
+                if (block->condition->block != block) {
+                    block->condition->escapes = true;
+                }
+            }
+        }
+    }
+
+    void assign_placements() {
+        for_each_instr([](Block*, Instr* instr) {
+            if (instr->is_rematerializable()) {
+                instr->placement = Placement::PLACE_REMATERIALIZE;
+            } else if (instr->op == Op::IR_PHI) {
+                instr->placement = Placement::PLACE_REGISTER;
+            } else if (!instr->has_result() || instr->use_count == 0) {
+                instr->placement = Placement::PLACE_DISCARD;
+            } else if (instr->use_count == 1 && !instr->escapes) {
+                instr->placement = Placement::PLACE_INLINE;
+            } else {
+                instr->placement = Placement::PLACE_REGISTER;
+            }
+        });
+
+        for (Block* block : m_function.get_blocks()) {
+            while (!validate_inline_values(block)) {
+            }
+        }
+    }
+
+    static void demote(Instr* instr) {
+        if (instr->placement == Placement::PLACE_INLINE) {
+            instr->placement = Placement::PLACE_REGISTER;
+        }
+    }
+
+    // Simulates the stack of a block, demoting inline values that would not
+    // be on top of the stack, in order, when their user runs.
+    static bool validate_inline_values(Block* block) {
+        std::vector<Instr*> pending;
+
+        auto take_operands = [&pending](Instr* const* operands, u32 count) {
+            u32 prefix = 0;
+            while (prefix < count && operands[prefix]->placement == Placement::PLACE_INLINE) {
+                prefix++;
+            }
+
+            bool valid = prefix <= pending.size();
+            for (u32 i = prefix; i < count; i++) {
+                if (operands[i]->placement == Placement::PLACE_INLINE) {
+                    valid = false;
+                }
+            }
+            for (u32 i = 0; valid && i < prefix; i++) {
+                valid = pending[pending.size() - prefix + i] == operands[i];
+            }
+
+            if (!valid) {
+                for (u32 i = 0; i < count; i++) {
+                    demote(operands[i]);
+                }
+                return false;
+            }
+            pending.resize(pending.size() - prefix);
+            return true;
+        };
+
+        for (Instr* instr = block->first; instr != nullptr; instr = instr->next) {
+            if (instr->op == Op::IR_PHI || instr->is_rematerializable()) {
+                continue;
+            }
+            if (!take_operands(instr->args, instr->arg_count)) {
+                return false;
+            }
+            if (instr->placement == Placement::PLACE_INLINE) {
+                pending.emplace_back(instr);
+            }
+        }
+
+        if (block->terminator == Terminator::TERM_BRANCH && !take_operands(&block->condition, 1)) {
+            return false;
+        }
+
+        if (!pending.empty()) {
+            for (Instr* instr : pending) {
+                demote(instr);
+            }
+            return false;
+        }
+        return true;
+    }
+
+    static bool is_register(const Instr* instr) {
+        return instr->placement == Placement::PLACE_REGISTER;
+    }
+
+    /*
+     * Every instruction gets two positions: operands are read at the first
+     * and the result is written at the second. Moves into phis at the end of
+     * a predecessor read at the block end and write one position later, so
+     * a phi and the value flowing into it can share a register.
+     */
+    void number_positions() {
+        u32 position = 0;
+        for (Block* block : m_function.get_blocks()) {
+            m_block_starts[block->id] = position;
+            position += 2;
+            for (Instr* instr = block->first; instr != nullptr; instr = instr->next) {
+                m_positions[instr->id] = instr->op == Op::IR_PHI ? m_block_starts[block->id] : position;
+                position += 2;
+            }
+            m_block_ends[block->id] = position;
+            position += 2;
+        }
+    }
+
+    // registers read by the moves on the edge from `block` to `successor`
+    template<typename F>
+    static void for_each_phi_source(const Block* block, const Block* successor, F&& f) {
+        u32 index = successor->predecessor_index(block);
+        for (Instr* phi = successor->first; phi != nullptr && phi->op == Op::IR_PHI; phi = phi->next) {
+            f(phi, phi->arg(index));
+        }
+    }
+
+    /*
+     * Live sets are sorted value ids rather than bitsets over every value, a
+     * block only has a handful of values live across it and functions with
+     * thousands of blocks would otherwise need blocks * values bits.
+     * live_in = gen + (live_out - defined in the block), where gen are the
+     * registers read in the block (including by the moves into successor
+     * phis and the branch) but defined before it.
+     */
+    void compute_liveness(std::vector<std::vector<u32>>& live_in, std::vector<std::vector<u32>>& live_out) {
+        const auto& blocks = m_function.get_blocks();
+        live_in.assign(m_function.block_count(), {});
+        live_out.assign(m_function.block_count(), {});
+
+        std::vector<const Block*> defined_in(m_function.instr_count(), nullptr);
+        for_each_instr([&defined_in](Block* block, Instr* instr) {
+            defined_in[instr->id] = block;
+        });
+
+        std::vector<std::vector<u32>> gen(m_function.block_count());
+        for (Block* block : blocks) {
+            std::vector<u32>& uses = gen[block->id];
+            auto use = [&uses, block](const Instr* value) {
+                if (is_register(value) && value->block != block) {
+                    uses.push_back(value->id);
+                }
+            };
+            for (Instr* instr = block->first; instr != nullptr; instr = instr->next) {
+                if (instr->op != Op::IR_PHI) {
+                    for (u32 i = 0; i < instr->arg_count; i++) {
+                        use(instr->args[i]);
+                    }
+                }
+            }
+            for (u32 i = 0; i < block->successor_count(); i++) {
+                for_each_phi_source(block, block->targets[i], [&use](Instr*, Instr* source) {
+                    use(source);
+                });
+            }
+            if (block->terminator == Terminator::TERM_BRANCH) {
+                use(block->condition);
+            }
+            std::sort(uses.begin(), uses.end());
+            uses.erase(std::unique(uses.begin(), uses.end()), uses.end());
+        }
+
+        std::vector<u32> live;
+        std::vector<u32> merged;
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (auto it = blocks.rbegin(); it != blocks.rend(); ++it) {
+                Block* block = *it;
+                live.clear();
+                for (u32 i = 0; i < block->successor_count(); i++) {
+                    const std::vector<u32>& successor_in = live_in[block->targets[i]->id];
+                    merged.clear();
+                    std::set_union(live.begin(), live.end(), successor_in.begin(), successor_in.end(), std::back_inserter(merged));
+                    live.swap(merged);
+                }
+                live_out[block->id] = live;
+
+                std::erase_if(live, [&defined_in, block](u32 value) {
+                    return defined_in[value] == block;
+                });
+                merged.clear();
+                std::set_union(live.begin(), live.end(), gen[block->id].begin(), gen[block->id].end(), std::back_inserter(merged));
+
+                if (merged != live_in[block->id]) {
+                    live_in[block->id] = merged;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    void add_range(const Instr* instr, u32 from, u32 to) {
+        m_ranges[instr->id].push_back({from, to});
+    }
+
+    // shortens the ranges opened at the block start to begin at the definition
+    void define_at(const Instr* instr, u32 block_start, u32 position) {
+        auto& ranges = m_ranges[instr->id];
+        bool found = false;
+        for (Range& range : ranges) {
+            if (range.from == block_start && range.to >= position) {
+                range.from = position;
+                found = true;
+            }
+        }
+        if (!found) {
+            ranges.push_back({position, position});
+        }
+    }
+
+    void build_ranges() {
+        std::vector<std::vector<u32>> live_in;
+        std::vector<std::vector<u32>> live_out;
+        compute_liveness(live_in, live_out);
+
+        const auto& blocks = m_function.get_blocks();
+        for (auto it = blocks.rbegin(); it != blocks.rend(); ++it) {
+            Block* block = *it;
+            u32 start = m_block_starts[block->id];
+            u32 end = m_block_ends[block->id];
+
+            for (u32 value : live_out[block->id]) {
+                m_ranges[value].push_back({start, end + 1});
+            }
+            for (u32 i = 0; i < block->successor_count(); i++) {
+                for_each_phi_source(block, block->targets[i], [&](Instr* phi, Instr* source) {
+                    if (is_register(source)) {
+                        add_range(source, start, end);
+                    }
+                    add_range(phi, end + 1, end + 1);
+                });
+            }
+            if (block->terminator == Terminator::TERM_BRANCH && is_register(block->condition)) {
+                add_range(block->condition, start, end);
+            }
+
+            for (Instr* instr = block->last; instr != nullptr; instr = instr->prev) {
+                if (instr->op == Op::IR_PHI) {
+                    define_at(instr, start, start);
+                    continue;
+                }
+                u32 position = m_positions[instr->id];
+                if (is_register(instr)) {
+                    define_at(instr, start, position + 1);
+                }
+                for (u32 i = 0; i < instr->arg_count; i++) {
+                    if (is_register(instr->args[i])) {
+                        add_range(instr->args[i], start, position);
+                    }
+                }
+            }
+        }
+    }
+
+    bool interferes(const Instr* lhs, const Instr* rhs) const {
+        for (const Range& a : m_ranges[lhs->id]) {
+            for (const Range& b : m_ranges[rhs->id]) {
+                if (a.from <= b.to && b.from <= a.to) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    bool allocate_registers() {
+        number_positions();
+        build_ranges();
+
+        std::vector<Instr*> values;
+        for_each_instr([&values](Block*, Instr* instr) {
+            if (is_register(instr)) {
+                values.emplace_back(instr);
+            }
+        });
+
+        std::vector<u32> first_position(m_function.instr_count(), UINT32_MAX);
+        std::vector<u32> last_position(m_function.instr_count(), 0);
+        for (const Instr* value : values) {
+            for (const Range& range : m_ranges[value->id]) {
+                first_position[value->id] = std::min(first_position[value->id], range.from);
+                last_position[value->id] = std::max(last_position[value->id], range.to);
+            }
+        }
+        std::stable_sort(values.begin(), values.end(), [&](const Instr* lhs, const Instr* rhs) {
+            return first_position[lhs->id] < first_position[rhs->id];
+        });
+
+        // values related through phis, trying their slots first removes moves
+        std::vector<std::vector<Instr*>> hints(m_function.instr_count());
+        for_each_instr([&hints](Block*, Instr* instr) {
+            if (instr->op != Op::IR_PHI) {
+                return;
+            }
+            for (u32 i = 0; i < instr->arg_count; i++) {
+                Instr* source = instr->arg(i);
+                if (is_register(source)) {
+                    hints[instr->id].emplace_back(source);
+                    hints[source->id].emplace_back(instr);
+                }
+            }
+        });
+
+        std::vector<std::vector<Instr*>> slots;
+        std::vector<bool> assigned(m_function.instr_count(), false);
+        auto fits = [&](u32 slot, const Instr* value) {
+            // values are assigned by their first position, one that ends
+            // before it cannot interfere with this value or any later one
+            std::erase_if(slots[slot], [&](const Instr* other) {
+                return last_position[other->id] < first_position[value->id];
+            });
+            for (const Instr* other : slots[slot]) {
+                if (interferes(other, value)) {
+                    return false;
+                }
+            }
+            return true;
+        };
+
+        for (Instr* value : values) {
+            std::optional<u32> chosen;
+            for (const Instr* hint : hints[value->id]) {
+                if (assigned[hint->id] && fits(hint->slot, value)) {
+                    chosen = hint->slot;
+                    break;
+                }
+            }
+            for (u32 slot = 0; !chosen && slot < slots.size(); slot++) {
+                if (fits(slot, value)) {
+                    chosen = slot;
+                }
+            }
+            if (!chosen) {
+                chosen = static_cast<u32>(slots.size());
+                slots.emplace_back();
+            }
+            value->slot = chosen.value();
+            slots[value->slot].emplace_back(value);
+            assigned[value->id] = true;
+        }
+
+        m_register_count = static_cast<u32>(slots.size());
+        return m_register_count <= UINT8_MAX;
+    }
+
+    void emit_byte(u8 byte, u32 line) {
+        m_out.write_byte(byte, line);
+    }
+
+    void adjust_depth(int delta) {
+        m_depth += delta;
+        m_max_depth = std::max(m_max_depth, m_depth);
+    }
+
+    void emit_operand(const Instr* value, u32 line) {
+        switch (value->placement) {
+        case Placement::PLACE_INLINE:
+            return;
+        case Placement::PLACE_REGISTER:
+            emit_byte(OpCode::OP_GET_LOCAL, line);
+            emit_byte(static_cast<u8>(value->slot), line);
+            break;
+        default:
+            switch (value->op) {
+            case Op::IR_CONSTANT:
+                emit_byte(OpCode::OP_CONSTANT, line);
+                emit_byte(value->operand, line);
+                break;
+            case Op::IR_NIL:
+                emit_byte(OpCode::OP_NIL, line);
+                break;
+            case Op::IR_TRUE:
+                emit_byte(OpCode::OP_TRUE, line);
+                break;
+            default:
+                emit_byte(OpCode::OP_FALSE, line);
+                break;
+            }
+            break;
+        }
+        adjust_depth(1);
+    }
+
+    bool emit_instr(const Instr* instr) {
+        if (instr->op == Op::IR_PHI || instr->is_rematerializable()) {
+            return true;
+        }
+        u32 line = instr->line;
+        for (u32 i = 0; i < instr->arg_count; i++) {
+            emit_operand(instr->args[i], line);
+        }
+
+        switch (instr->op) {
+        case Op::IR_GET_GLOBAL:
+            emit_byte(OpCode::OP_GET_GLOBAL, line);
+            emit_byte(instr->operand, line);
+            adjust_depth(1);
+            break;
+        case Op::IR_DEFINE_GLOBAL:
+            emit_byte(OpCode::OP_DEFINE_GLOBAL, line);
+            emit_byte(instr->operand, line);
+            adjust_depth(-1);
+            break;
+        case Op::IR_SET_GLOBAL:
+            emit_byte(OpCode::OP_SET_GLOBAL, line);
+            emit_byte(instr->operand, line);
+            emit_byte(OpCode::OP_POP, line);
+            adjust_depth(-1);
+            break;
+        case Op::IR_EQUAL:
+            emit_byte(OpCode::OP_EQUAL, line);
+            adjust_depth(-1);
+            break;
+        case Op::IR_GREATER:
+            emit_byte(OpCode::OP_GREATER, line);
+            adjust_depth(-1);
+            break;
+        case Op::IR_LESS:
+            emit_byte(OpCode::OP_LESS, line);
+            adjust_depth(-1);
+            break;
+        case Op::IR_ADD:
+            emit_byte(OpCode::OP_ADD, line);
+            adjust_depth(-1);
+            break;
+        case Op::IR_SUBTRACT:
+            emit_byte(OpCode::OP_SUBTRACT, line);
+            adjust_depth(-1);
+            break;
+        case Op::IR_MULTIPLY:
+            emit_byte(OpCode::OP_MULTIPLY, line);
+            adjust_depth(-1);
+            break;
+        case Op::IR_DIVIDE:
+            emit_byte(OpCode::OP_DIVIDE, line);
+            adjust_depth(-1);
+            break;
+        case Op::IR_NOT:
+            emit_byte(OpCode::OP_NOT, line);
+            break;
+        case Op::IR_NEGATE:
+            emit_byte(OpCode::OP_NEGATE, line);
+            break;
+        case Op::IR_PRINT:
+            emit_byte(OpCode::OP_PRINT, line);
+            adjust_depth(-1);
+            break;
+        default:
+            // copies are removed before lowering
+            return false;
+        }
+
+        if (instr->has_result()) {
+            if (instr->placement == Placement::PLACE_REGISTER) {
+                emit_byte(OpCode::OP_SET_LOCAL, line);
+                emit_byte(static_cast<u8>(instr->slot), line);
+            }
+            if (instr->placement != Placement::PLACE_INLINE) {
+                emit_byte(OpCode::OP_POP, line);
+                adjust_depth(-1);
+            }
+        }
+        return true;
+    }
+
+    // parallel copy into the phis of `successor`: read every source, then write
+    void emit_moves(const Block* block, const Block* successor) {
+        std::vector<const Instr*> targets;
+        for_each_phi_source(block, successor, [&](Instr* phi, Instr* source) {
+            if (is_register(source) && source->slot == phi->slot) {
+                return;
+            }
+            emit_operand(source, block->line);
+            targets.emplace_back(phi);
+        });
+        for (auto it = targets.rbegin(); it != targets.rend(); ++it) {
+            emit_byte(OpCode::OP_SET_LOCAL, block->line);
+            emit_byte(static_cast<u8>((*it)->slot), block->line);
+            emit_byte(OpCode::OP_POP, block->line);
+            adjust_depth(-1);
+        }
+    }
+
+    // a successor entered only through this branch pops the condition itself
+    bool pops_condition_on_entry(const Block* block) const {
+        return block != m_function.get_entry() && block->pred_count == 1 && block->preds[0]->terminator == Terminator::TERM_BRANCH && (block->first == nullptr || block->first->op != Op::IR_PHI);
+    }
+
+    usize emit_forward_jump(u8 instruction, u32 line) {
+        emit_byte(instruction, line);
+        emit_byte(0xff, line);
+        emit_byte(0xff, line);
+        return m_out.size() - 2;
+    }
+
+    bool patch_jump(usize offset, usize target) {
+        usize jump = target - offset - 2;
+        if (jump > UINT16_MAX) {
+            return false;
+        }
+        m_out.write_byte_at(offset, (jump >> 8) & 0xff);
+        m_out.write_byte_at(offset + 1, jump & 0xff);
+        return true;
+    }
+
+    bool emit_jump_to(const Block* target, u32 line) {
+        if (m_placed[target->id]) {
+            emit_byte(OpCode::OP_LOOP, line);
+            usize jump = m_out.size() - m_offsets[target->id] + 2;
+            if (jump > UINT16_MAX) {
+                return false;
+            }
+            emit_byte((jump >> 8) & 0xff, line);
+            emit_byte(jump & 0xff, line);
+            return true;
+        }
+        m_patches.emplace_back(emit_forward_jump(OpCode::OP_JUMP, line), target);
+        return true;
+    }
+
+    bool emit_terminator(const Block* block, const Block* next) {
+        u32 line = block->line;
+        switch (block->terminator) {
+        case Terminator::TERM_RETURN:
+            emit_byte(OpCode::OP_RETURN, line);
+            return true;
+        case Terminator::TERM_JUMP:
+            emit_moves(block, block->targets[0]);
+            return block->targets[0] == next || emit_jump_to(block->targets[0], line);
+        case Terminator::TERM_BRANCH:
+            break;
+        }
+
+        const Block* truthy = block->targets[0];
+        const Block* falsey = block->targets[1];
+        bool truthy_pops = pops_condition_on_entry(truthy);
+        bool falsey_pops = pops_condition_on_entry(falsey);
+
+        emit_operand(block->condition, line);
+        usize condition_jump = emit_forward_jump(OpCode::OP_JUMP_IF_FALSE, line);
+
+        if (!truthy_pops) {
+            emit_byte(OpCode::OP_POP, line);
+            emit_moves(block, truthy);
+        }
+        if (!(truthy == next && falsey_pops) && !emit_jump_to(truthy, line)) {
+            return false;
+        }
+
+        if (falsey_pops) {
+            m_patches.emplace_back(condition_jump, falsey);
+        } else {
+            if (!patch_jump(condition_jump, m_out.size())) {
+                return false;
+            }
+            emit_byte(OpCode::OP_POP, line);
+            emit_moves(block, falsey);
+            if (falsey != next && !emit_jump_to(falsey, line)) {
+                return false;
+            }
+        }
+        m_depth = m_register_count;
+        return true;
+    }
+
+    bool emit_code() {
+        for (const auto& constant : m_function.get_chunk().get_constants().get_values()) {
+            (void)m_out.write_constant(constant);
+        }
+
+        const auto& blocks = m_function.get_blocks();
+        u32 entry_line = blocks.front()->first != nullptr ? blocks.front()->first->line : blocks.front()->line;
+        for (u32 i = 0; i < m_register_count; i++) {
+            emit_byte(OpCode::OP_NIL, entry_line);
+        }
+        m_depth = m_register_count;
+        m_max_depth = m_depth;
+
+        m_offsets.assign(m_function.block_count(), 0);
+        m_placed.assign(m_function.block_count(), false);
+        for (usize i = 0; i < blocks.size(); i++) {
+            const Block* block = blocks[i];
+            const Block* next = i + 1 < blocks.size() ? blocks[i + 1] : nullptr;
+            m_offsets[block->id] = m_out.size();
+            m_placed[block->id] = true;
+            m_depth = m_register_count;
+
+            if (pops_condition_on_entry(block)) {
+                emit_byte(OpCode::OP_POP, block->preds[0]->line);
+            }
+            for (const Instr* instr = block->first; instr != nullptr; instr = instr->next) {
+                if (!emit_instr(instr)) {
+                    return false;
+                }
+            }
+            if (!emit_terminator(block, next)) {
+                return false;
+            }
+        }
+
+        for (const auto& [offset, target] : m_patches) {
+            if (!patch_jump(offset, m_offsets[target->id])) {
+                return false;
+            }
+        }
+        return m_max_depth <= UINT8_COUNT;
+    }
+
+    Function& m_function;
+    Chunk& m_out;
+    std::vector<u32> m_positions;
+    std::vector<std::vector<Range>> m_ranges;
+    std::vector<u32> m_block_starts;
+    std::vector<u32> m_block_ends;
+    std::vector<usize> m_offsets;
+    std::vector<bool> m_placed;
+    std::vector<std::pair<usize, const Block*>> m_patches;
+    u32 m_register_count{0};
+    int m_depth{0};
+    int m_max_depth{0};
+};
+} // namespace
+
+bool emit(Function& function, Chunk& out) {
+    Lowering lowering{function, out};
+    return lowering.run();
+}
+
+} // namespace ir
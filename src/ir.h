@@ -0,0 +1,195 @@
+#pragma once
+
+#include "chunk.h"
+#include "common.h"
+#include <cstddef>
+#include <initializer_list>
+#include <memory>
+#include <new>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace ir {
+
+/*
+ * Bump allocator that owns every node of an IR function. Nodes are never
+ * freed one by one, the whole arena goes away with the function, so only
+ * trivially destructible types may live in it.
+ */
+class Arena {
+public:
+    Arena() = default;
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    template<typename T, typename... Args>
+    T* make(Args&&... args) {
+        static_assert(std::is_trivially_destructible_v<T>);
+        return new (allocate(sizeof(T), alignof(T))) T{std::forward<Args>(args)...};
+    }
+
+    template<typename T>
+    T* make_array(usize count) {
+        static_assert(std::is_trivially_destructible_v<T>);
+        T* array = static_cast<T*>(allocate(sizeof(T) * count, alignof(T)));
+        std::uninitialized_value_construct_n(array, count);
+        return array;
+    }
+
+private:
+    void* allocate(usize size, usize alignment);
+
+    static constexpr usize k_block_size = 16 * 1024;
+
+    std::vector<std::unique_ptr<std::byte[]>> m_blocks;
+    std::byte* m_cursor{nullptr};
+    usize m_remaining{0};
+};
+
+enum class Op : u8 {
+    // values that are cheaper to re-emit at every use than to keep in a slot
+    IR_CONSTANT,
+    IR_NIL,
+    IR_TRUE,
+    IR_FALSE,
+
+    IR_COPY,
+    IR_PHI,
+    IR_GET_GLOBAL,
+    IR_DEFINE_GLOBAL,
+    IR_SET_GLOBAL,
+    IR_EQUAL,
+    IR_GREATER,
+    IR_LESS,
+    IR_ADD,
+    IR_SUBTRACT,
+    IR_MULTIPLY,
+    IR_DIVIDE,
+    IR_NOT,
+    IR_NEGATE,
+    IR_PRINT
+};
+
+// Lattice for type inference, TYPE_UNKNOWN is "no information yet"
+// and TYPE_DYNAMIC is "could be anything at runtime".
+enum class Type : u8 {
+    TYPE_UNKNOWN,
+    TYPE_NIL,
+    TYPE_BOOLEAN,
+    TYPE_NUMBER,
+    TYPE_STRING,
+    TYPE_DYNAMIC
+};
+
+// Where the bytecode emitter keeps a value between its definition and uses.
+enum class Placement : u8 {
+    PLACE_UNASSIGNED,
+    PLACE_REMATERIALIZE, // re-emitted at every use
+    PLACE_INLINE,        // left on the value stack for its only user
+    PLACE_REGISTER,      // stored in a stack slot reserved on entry
+    PLACE_DISCARD        // result is never used
+};
+
+struct Block;
+
+struct Instr {
+    Op op;
+    Type type;
+    Placement placement;
+    // constant table index for IR_CONSTANT and the global operations
+    u8 operand;
+    u32 line;
+    u32 id;
+    u32 arg_count;
+    Instr** args;
+    Block* block;
+    Instr* prev;
+    Instr* next;
+    // set when this instruction has been replaced by another value
+    Instr* forward;
+    u32 use_count;
+    u32 slot;
+    bool escapes;
+
+    [[nodiscard]] Instr* arg(u32 index) const;
+    [[nodiscard]] bool has_result() const;
+    [[nodiscard]] bool is_rematerializable() const;
+};
+
+Instr* resolve(Instr* instr);
+
+enum class Terminator : u8 {
+    TERM_JUMP,
+    TERM_BRANCH,
+    TERM_RETURN
+};
+
+struct Block {
+    u32 id;
+    u32 line;
+    usize offset;
+    Terminator terminator;
+    Instr* condition;
+    // TERM_JUMP uses the first target, TERM_BRANCH continues to the first
+    // target when the condition is truthy and to the second otherwise
+    Block* targets[2];
+    Block** preds;
+    u32 pred_count;
+    Instr* first;
+    Instr* last;
+    Block* idom;
+    u32 rpo_index;
+    // entry and exit times of a walk over the dominator tree, a block
+    // dominates exactly the blocks whose interval lies within its own
+    u32 dom_enter;
+    u32 dom_exit;
+
+    [[nodiscard]] u32 successor_count() const;
+    [[nodiscard]] u32 predecessor_index(const Block* pred) const;
+    void append(Instr* instr);
+    void unlink(Instr* instr);
+};
+
+class Function {
+public:
+    explicit Function(const chunk::Chunk& chunk);
+
+    Block* make_block(usize offset);
+    Instr* make_instr(Block* block, Op op, u32 line, std::initializer_list<Instr*> args, u8 operand = 0);
+    Instr* make_phi(Block* block, u32 line, u32 arg_count);
+    void set_predecessors(Block* block, u32 count);
+
+    void replace(Instr* instr, Instr* value);
+    void remove(Instr* instr);
+    void remove_predecessor(Block* block, const Block* pred);
+    void compute_order();
+    void compute_dominators();
+    [[nodiscard]] bool dominates(const Block* dominator, const Block* block) const;
+
+    [[nodiscard]] const chunk::Chunk& get_chunk() const;
+    [[nodiscard]] Block* get_entry() const;
+    [[nodiscard]] const std::vector<Block*>& get_blocks() const;
+    [[nodiscard]] u32 block_count() const;
+    [[nodiscard]] u32 instr_count() const;
+    [[nodiscard]] std::string to_string() const;
+
+private:
+    Arena m_arena;
+    const chunk::Chunk& m_chunk;
+    std::vector<Block*> m_all_blocks;
+    // reachable blocks in reverse postorder
+    std::vector<Block*> m_blocks;
+    u32 m_instr_count;
+};
+
+// Lifts a chunk into SSA form, returns nullptr for chunks using
+// instructions the IR does not model.
+std::unique_ptr<Function> build(const chunk::Chunk& chunk);
+
+// Lowers the function back to stack bytecode, returns false when the
+// result would not fit the VM's limits.
+bool emit(Function& function, chunk::Chunk& out);
+
+} // namespace ir
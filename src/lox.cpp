@@ -1,27 +1,151 @@
 #include "lox.h"
+#include "aot.h"
+#include "cache.h"
 #include "chunk.h"
 #include "compiler.h"
+#include "image.h"
+#include "optimizer.h"
 #include "scanner.h"
+#include "source_buffer.h"
 #include "utility.h"
 #include "vm.h"
+#include <charconv>
+#include <cstdlib>
 #include <fstream>
 #include <iostream>
 #include <memory>
+#include <optional>
 #include <string>
+#include <string_view>
+#include <system_error>
+#include <unistd.h>
 #include <utility>
+#include <vector>
 
 using namespace compiler;
 using namespace scanner;
 using namespace chunk;
 
 namespace lox {
+namespace {
+/*
+ * Streamed sources run one top-level declaration at a time as soon as it is
+ * compiled, so memory is bounded by the largest declaration and output starts
+ * before the input ends. After a compile error nothing runs anymore but the
+ * rest of the source is still compiled to report its errors.
+ */
+vm::InterpretResult interpret_stream(SourceBuffer source, vm::VirtualMachine& vm, const Options& options) {
+    auto scanner = std::make_shared<Scanner>(std::move(source));
+    Compiler compiler{scanner, nullptr};
+
+    while (std::optional<std::shared_ptr<Chunk>> chunk = compiler.compile_next()) {
+        if (compiler.had_error()) {
+            continue;
+        }
+
+        if (options.optimize) {
+            optimizer::optimize(**chunk);
+        }
+
+        vm.load_new_chunk(std::move(chunk.value()));
+        vm::InterpretResult result = vm.run();
+        if (result != vm::InterpretResult::INTERPRET_OK) {
+            return result;
+        }
+    }
+
+    return compiler.had_error() ? vm::InterpretResult::INTERPRET_COMPILE_ERROR : vm::InterpretResult::INTERPRET_OK;
+}
 
-vm::InterpretResult interpret(std::string source, vm::VirtualMachine& vm) {
+// Returns nullptr when the source does not compile.
+std::shared_ptr<Chunk> compile(SourceBuffer source, const Options& options) {
     auto scanner = std::make_shared<Scanner>(std::move(source));
     auto chunk = std::make_shared<Chunk>();
     Compiler compiler{scanner, chunk};
 
     if (!compiler.compile()) {
+        return nullptr;
+    }
+
+    if (options.optimize) {
+        // chunks the optimizer cannot handle run as compiled
+        optimizer::optimize(*chunk);
+    }
+
+    return chunk;
+}
+
+void print_stats(vm::VirtualMachine& vm) {
+    // after the program's own output, which may still be buffered
+    vm.get_output().flush();
+    const vm::InlineCacheStats& stats = vm.get_inline_cache_stats();
+    println_err("inline caches: {} hits, {} misses, {} megamorphic", stats.hits, stats.misses, stats.megamorphic);
+}
+
+void exit_on_error(vm::VirtualMachine& vm, vm::InterpretResult result, const Options& options) {
+    if (options.stats) {
+        print_stats(vm);
+    }
+
+    if (result != vm::InterpretResult::INTERPRET_OK) {
+        // exit() does not unwind, nothing else flushes the output
+        vm.get_output().flush();
+    }
+
+    if (result == vm::InterpretResult::INTERPRET_COMPILE_ERROR) {
+        exit(65);
+    }
+
+    if (result == vm::InterpretResult::INTERPRET_RUNTIME_ERROR) {
+        exit(70);
+    }
+}
+
+void run_source(SourceBuffer source, vm::VirtualMachine& vm, const Options& options) {
+    exit_on_error(vm, interpret(std::move(source), vm, options), options);
+}
+
+/*
+ * The cache is keyed by the source text, so it is checked after mapping the
+ * script but before scanning it. Scripts with compile errors are not cached.
+ */
+void run_cached(const std::string& path, SourceBuffer source, vm::VirtualMachine& vm, const Options& options) {
+    cache::Key key = cache::make_key(source.view(), options.optimize);
+    std::string cache_path = cache::cache_path(path, options.cache_dir);
+
+    std::shared_ptr<Chunk> chunk = cache::load(cache_path, key);
+    if (chunk == nullptr) {
+        chunk = compile(std::move(source), options);
+        if (chunk == nullptr) {
+            exit(65);
+        }
+        // a cache file that cannot be written only costs the next run a compile
+        (void)cache::store(cache_path, *chunk, key);
+    }
+
+    vm.load_new_chunk(chunk);
+    exit_on_error(vm, vm.run(), options);
+}
+
+void run_image(SourceBuffer image, vm::VirtualMachine& vm, const Options& options) {
+    std::shared_ptr<Chunk> chunk = image::load(std::move(image));
+    if (chunk == nullptr) {
+        println_err("Invalid or incompatible bytecode image");
+        exit(65);
+    }
+
+    vm.load_new_chunk(std::move(chunk));
+    exit_on_error(vm, vm.run(), options);
+}
+} // namespace
+
+vm::InterpretResult interpret(SourceBuffer source, vm::VirtualMachine& vm, const Options& options) {
+    if (source.is_stream()) {
+        return interpret_stream(std::move(source), vm, options);
+    }
+
+    std::shared_ptr<Chunk> chunk = compile(std::move(source), options);
+    if (chunk == nullptr) {
         return vm::InterpretResult::INTERPRET_COMPILE_ERROR;
     }
 
@@ -29,23 +153,72 @@ vm::InterpretResult interpret(std::string source, vm::VirtualMachine& vm) {
     return vm.run();
 }
 
-void run_file(const std::string& path, vm::VirtualMachine& vm) {
-    std::ifstream input_file{path, std::ios::binary};
+void run_file(const std::string& path, vm::VirtualMachine& vm, const Options& options) {
+    std::optional<SourceBuffer> source = SourceBuffer::open(path);
 
-    if (!input_file.is_open()) {
+    if (!source) {
         println("Failed to open file");
         return;
     }
 
-    std::string source{std::istreambuf_iterator<char>(input_file), std::istreambuf_iterator<char>()};
-    vm::InterpretResult result = interpret(std::move(source), vm);
+    if (source->is_mapped() && image::is_image(source->view())) {
+        run_image(std::move(source.value()), vm, options);
+    } else if (options.cache && !source->is_stream()) {
+        run_cached(path, std::move(source.value()), vm, options);
+    } else {
+        run_source(std::move(source.value()), vm, options);
+    }
+}
 
-    if (result == vm::InterpretResult::INTERPRET_COMPILE_ERROR) {
+void emit_cpp(const std::string& path, const std::string& output_path, const Options& options) {
+    std::optional<SourceBuffer> source = SourceBuffer::open(path);
+
+    if (!source) {
+        println("Failed to open file");
+        exit(74);
+    }
+
+    std::shared_ptr<Chunk> chunk = compile(std::move(source.value()), options);
+    if (chunk == nullptr) {
         exit(65);
     }
 
-    if (result == vm::InterpretResult::INTERPRET_RUNTIME_ERROR) {
-        exit(70);
+    std::ofstream output_file{output_path, std::ios::binary};
+    if (!output_file.is_open()) {
+        println_err("Failed to open output file '{}'", output_path);
+        exit(74);
+    }
+
+    aot::Emitter emitter{*chunk, path};
+    if (!emitter.emit(output_file)) {
+        exit(65);
+    }
+}
+
+void emit_image(const std::string& path, const std::string& output_path, const Options& options) {
+    std::optional<SourceBuffer> source = SourceBuffer::open(path);
+
+    if (!source) {
+        println("Failed to open file");
+        exit(74);
+    }
+
+    std::shared_ptr<Chunk> chunk = compile(std::move(source.value()), options);
+    if (chunk == nullptr) {
+        exit(65);
+    }
+
+    std::ofstream output_file{output_path, std::ios::binary};
+    if (!output_file.is_open()) {
+        println_err("Failed to open output file '{}'", output_path);
+        exit(74);
+    }
+
+    std::string image = image::serialize(*chunk);
+    output_file.write(image.data(), static_cast<std::streamsize>(image.size()));
+    if (!output_file) {
+        println_err("Failed to write output file '{}'", output_path);
+        exit(74);
     }
 }
 
@@ -60,18 +233,71 @@ void repl(vm::VirtualMachine& vm) {
             println("");
             break;
         }
-        interpret(std::move(line), vm);
+        // every line is its own chunk, not worth optimizing
+        interpret(SourceBuffer{std::move(line)}, vm, Options{.optimize = false});
     }
 }
 
 void startup(int argc, const char* argv[]) {
+    Options options;
+    if (const char* cache_dir = std::getenv("LOX_CACHE_DIR"); cache_dir != nullptr && *cache_dir != '\0') {
+        options.cache = true;
+        options.cache_dir = cache_dir;
+    }
+
+    std::vector<std::string_view> args;
+    for (int i = 1; i < argc; i++) {
+        std::string_view arg{argv[i]};
+        if (arg == "-O0") {
+            options.optimize = false;
+        } else if (arg == "-O1") {
+            options.optimize = true;
+        } else if (arg == "--no-tail-calls") {
+            options.tail_calls = false;
+        } else if (arg == "--stats") {
+            options.stats = true;
+        } else if (arg == "--cache") {
+            options.cache = true;
+        } else if (arg == "--flush=auto") {
+            options.flush = output::FlushPolicy::FLUSH_AUTO;
+        } else if (arg == "--flush=line") {
+            options.flush = output::FlushPolicy::FLUSH_LINE;
+        } else if (arg == "--flush=full") {
+            options.flush = output::FlushPolicy::FLUSH_FULL;
+        } else if (arg.starts_with("--max-stack=")) {
+            std::string_view slots = arg.substr(std::string_view{"--max-stack="}.size());
+            auto [end, ec] = std::from_chars(slots.data(), slots.data() + slots.size(), options.max_stack);
+            if (ec != std::errc{} || end != slots.data() + slots.size()) {
+                println_err("Invalid stack size '{}'", slots);
+                exit(64);
+            }
+        } else if (arg.starts_with("--cache-dir=")) {
+            options.cache = true;
+            options.cache_dir = arg.substr(std::string_view{"--cache-dir="}.size());
+        } else {
+            args.emplace_back(arg);
+        }
+    }
+
     vm::VirtualMachine vm;
-    if (argc == 1) {
+    vm.get_output().set_policy(options.flush);
+    vm.set_max_stack(options.max_stack);
+    vm.set_tail_calls(options.tail_calls);
+    if (args.empty() && !isatty(STDIN_FILENO)) {
+        // piped programs run as they arrive instead of line by line
+        run_source(SourceBuffer::stream(dup(STDIN_FILENO)), vm, options);
+    } else if (args.empty()) {
         repl(vm);
-    } else if (argc == 2) {
-        run_file(argv[1], vm);
+    } else if (args.size() == 1 && !args[0].starts_with("--")) {
+        run_file(std::string{args[0]}, vm, options);
+    } else if (args.size() == 3 && args[0] == "--emit-cpp") {
+        emit_cpp(std::string{args[1]}, std::string{args[2]}, options);
+    } else if (args.size() == 3 && args[0] == "--emit-image") {
+        emit_image(std::string{args[1]}, std::string{args[2]}, options);
     } else {
-        println("Usage: clox [path]");
+        println("Usage: clox [-O1] [--cache | --cache-dir=<dir>] [--flush=auto|line|full] [--max-stack=<slots>] [--no-tail-calls] [--stats] [path]");
+        println("       clox [-O1] --emit-cpp [path] [output.cpp]");
+        println("       clox [-O1] --emit-image [path] [output.loxi]");
         exit(64);
     }
 }
@@ -1,12 +1,33 @@
 #pragma once
 
+#include "output.h"
+#include "source_buffer.h"
 #include "vm.h"
 #include <string>
 
 namespace lox {
 
-vm::InterpretResult interpret(std::string source, vm::VirtualMachine& vm);
+struct Options {
+    // run the SSA optimizer over compiled chunks with `-O1`, by default scripts run as compiled
+    bool optimize{false};
+    // load compiled scripts from a bytecode cache and store them in it, see cache.h
+    bool cache{false};
+    // where cache files go, next to the script when empty
+    std::string cache_dir{};
+    // when printed output is written, `--flush=auto|line|full`
+    output::FlushPolicy flush{output::FlushPolicy::FLUSH_AUTO};
+    // stack slots scripts may use, `--max-stack=<slots>`
+    usize max_stack{vm::k_default_max_stack};
+    // report inline cache hits and misses on stderr after running a script, `--stats`
+    bool stats{false};
+    // `return f(args);` reuses the returning frame, `--no-tail-calls` keeps every frame for stack traces
+    bool tail_calls{true};
+};
+
+vm::InterpretResult interpret(scanner::SourceBuffer source, vm::VirtualMachine& vm, const Options& options = {});
 void run_file(const std::string& path);
+void emit_cpp(const std::string& path, const std::string& output_path, const Options& options);
+void emit_image(const std::string& path, const std::string& output_path, const Options& options);
 void repl();
 void startup(int argc, const char* argv[]);
 
@@ -0,0 +1,112 @@
+#include "natives.h"
+#include "common.h"
+#include "object.h"
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <ctime>
+#include <memory>
+#include <span>
+
+using namespace object;
+
+namespace natives {
+namespace {
+using Args = const std::shared_ptr<Object>*;
+
+std::shared_ptr<Object> number(double value) {
+    return std::make_shared<NumberObject>(value);
+}
+
+// Wraps a function of numbers, the result is nullptr unless all arguments are numbers.
+template<double (*k_function)(double)>
+std::shared_ptr<Object> unary_math(Args args, u8) {
+    if (args[0]->type != ObjectType::OBJ_NUMBER) {
+        return nullptr;
+    }
+    return number(k_function(static_cast<const NumberObject&>(*args[0]).value));
+}
+
+template<double (*k_function)(double, double)>
+std::shared_ptr<Object> binary_math(Args args, u8) {
+    if (args[0]->type != ObjectType::OBJ_NUMBER || args[1]->type != ObjectType::OBJ_NUMBER) {
+        return nullptr;
+    }
+    return number(k_function(static_cast<const NumberObject&>(*args[0]).value, static_cast<const NumberObject&>(*args[1]).value));
+}
+
+double sqrt(double x) {
+    return std::sqrt(x);
+}
+
+double abs(double x) {
+    return std::fabs(x);
+}
+
+double floor(double x) {
+    return std::floor(x);
+}
+
+double ceil(double x) {
+    return std::ceil(x);
+}
+
+double pow(double x, double y) {
+    return std::pow(x, y);
+}
+
+double min(double x, double y) {
+    return std::fmin(x, y);
+}
+
+double max(double x, double y) {
+    return std::fmax(x, y);
+}
+
+std::shared_ptr<Object> clock(Args, u8) {
+    return number(static_cast<double>(std::clock()) / CLOCKS_PER_SEC);
+}
+
+std::shared_ptr<Object> nanotime(Args, u8) {
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return number(static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(now).count()));
+}
+
+std::shared_ptr<Object> len(Args args, u8) {
+    if (args[0]->type == ObjectType::OBJ_STRING) {
+        return number(static_cast<double>(static_cast<const StringObject&>(*args[0]).value.size()));
+    }
+    if (args[0]->type == ObjectType::OBJ_LIST) {
+        return number(static_cast<double>(static_cast<const ListObject&>(*args[0]).size()));
+    }
+    return nullptr;
+}
+
+std::shared_ptr<Object> append(Args args, u8) {
+    if (args[0]->type != ObjectType::OBJ_LIST) {
+        return nullptr;
+    }
+    static_cast<ListObject&>(*args[0]).append(args[1]);
+    return std::make_shared<NullObject>();
+}
+
+constexpr std::array k_builtins{
+    Native{"clock", 0, &clock},
+    Native{"nanotime", 0, &nanotime},
+    Native{"sqrt", 1, &unary_math<sqrt>},
+    Native{"abs", 1, &unary_math<abs>},
+    Native{"floor", 1, &unary_math<floor>},
+    Native{"ceil", 1, &unary_math<ceil>},
+    Native{"pow", 2, &binary_math<pow>},
+    Native{"min", 2, &binary_math<min>},
+    Native{"max", 2, &binary_math<max>},
+    Native{"len", 1, &len},
+    Native{"append", 2, &append},
+};
+} // namespace
+
+std::span<const Native> builtins() {
+    return k_builtins;
+}
+
+} // namespace natives
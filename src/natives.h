@@ -0,0 +1,29 @@
+#pragma once
+
+#include "common.h"
+#include "object.h"
+#include <span>
+#include <string_view>
+
+namespace natives {
+
+struct Native {
+    std::string_view name;
+    u8 arity;
+    object::NativeFn function;
+};
+
+/*
+ * The natives every virtual machine defines as globals:
+ *
+ *   clock()                             processor time used so far, in seconds
+ *   nanotime()                          monotonic wall clock, in nanoseconds
+ *   sqrt(x), abs(x), floor(x), ceil(x)  math on numbers, pow(x, y) is x to
+ *   pow(x, y), min(x, y), max(x, y)     the power of y
+ *   len(s)                              number of bytes of a string or
+ *                                       elements of a list
+ *   append(list, value)                 adds value at the end of the list
+ */
+[[nodiscard]] std::span<const Native> builtins();
+
+} // namespace natives
@@ -1,6 +1,11 @@
 #include "object.h"
 #include "common.h"
+#include "output.h"
+#include <algorithm>
+#include <memory>
+#include <optional>
 #include <string>
+#include <utility>
 
 using namespace object;
 
@@ -20,7 +25,7 @@ bool Object::is_truthy() const {
     return false;
 }
 
-bool Object::is_equal(const Object& other) const {
+bool Object::is_equal(const Object&) const {
     return true;
 }
 
@@ -61,8 +66,11 @@ bool NullObject::is_equal(const Object& other) const {
 
 NumberObject::NumberObject(double v) : Object{ObjectType::OBJ_NUMBER}, value{v} {}
 
+// Integral numbers below 1e21 with all their digits, any other number in the
+// shortest form that reads back as the same number.
 std::string NumberObject::to_string() const {
-    return std::to_string(value);
+    char buffer[output::k_max_number_length];
+    return std::string{buffer, output::format_number(buffer, buffer + sizeof(buffer), value)};
 }
 
 bool NumberObject::is_falsey() const {
@@ -125,6 +133,252 @@ bool StringObject::is_equal(const Object& other) const {
     return false;
 }
 
+FunctionObject::FunctionObject(std::string name, u8 arity, std::shared_ptr<chunk::Chunk> chunk)
+    : Object{ObjectType::OBJ_FUNCTION}, name{std::move(name)}, arity{arity}, chunk{std::move(chunk)} {}
+
+std::string FunctionObject::to_string() const {
+    return "<fn " + name + ">";
+}
+
+bool FunctionObject::is_falsey() const {
+    return false;
+}
+
+bool FunctionObject::is_truthy() const {
+    return true;
+}
+
+bool FunctionObject::is_equal(const Object& other) const {
+    return this == &other;
+}
+
+NativeObject::NativeObject(std::string name, u8 arity, NativeFn function)
+    : Object{ObjectType::OBJ_NATIVE}, name{std::move(name)}, arity{arity}, function{function} {}
+
+std::string NativeObject::to_string() const {
+    return "<native fn>";
+}
+
+bool NativeObject::is_falsey() const {
+    return false;
+}
+
+bool NativeObject::is_truthy() const {
+    return true;
+}
+
+bool NativeObject::is_equal(const Object& other) const {
+    return this == &other;
+}
+
+Upvalue::Upvalue(usize slot)
+    : slot{slot} {}
+
+ClosureObject::ClosureObject(std::shared_ptr<FunctionObject> function)
+    : Object{ObjectType::OBJ_CLOSURE}, function{std::move(function)} {}
+
+std::string ClosureObject::to_string() const {
+    return function->to_string();
+}
+
+bool ClosureObject::is_falsey() const {
+    return false;
+}
+
+bool ClosureObject::is_truthy() const {
+    return true;
+}
+
+bool ClosureObject::is_equal(const Object& other) const {
+    return this == &other;
+}
+
+std::optional<u32> Shape::find_slot(const StringObject& name) const {
+    for (usize i = 0; i < fields.size(); i++) {
+        if (fields[i]->hash == name.hash && fields[i]->value == name.value) {
+            return static_cast<u32>(i);
+        }
+    }
+    return std::nullopt;
+}
+
+std::shared_ptr<Shape> Shape::transition(const std::shared_ptr<StringObject>& name) {
+    for (const auto& next : transitions) {
+        const StringObject& added = *next->fields.back();
+        if (added.hash == name->hash && added.value == name->value) {
+            return next;
+        }
+    }
+
+    auto next = std::make_shared<Shape>();
+    next->fields.reserve(fields.size() + 1);
+    next->fields = fields;
+    next->fields.emplace_back(name);
+    transitions.emplace_back(next);
+    return next;
+}
+
+ClassObject::ClassObject(std::string name)
+    : Object{ObjectType::OBJ_CLASS}, name{std::move(name)}, shape{std::make_shared<Shape>()} {}
+
+std::string ClassObject::to_string() const {
+    return name;
+}
+
+bool ClassObject::is_falsey() const {
+    return false;
+}
+
+bool ClassObject::is_truthy() const {
+    return true;
+}
+
+bool ClassObject::is_equal(const Object& other) const {
+    return this == &other;
+}
+
+InstanceObject::InstanceObject(std::shared_ptr<ClassObject> klass)
+    : Object{ObjectType::OBJ_INSTANCE}, klass{std::move(klass)}, shape{this->klass->shape} {
+    fields.reserve(this->klass->field_capacity);
+}
+
+std::string InstanceObject::to_string() const {
+    return klass->name + " instance";
+}
+
+bool InstanceObject::is_falsey() const {
+    return false;
+}
+
+bool InstanceObject::is_truthy() const {
+    return true;
+}
+
+bool InstanceObject::is_equal(const Object& other) const {
+    return this == &other;
+}
+
+void InstanceObject::set_field(const std::shared_ptr<StringObject>& name, std::shared_ptr<Object> value) {
+    if (std::optional<u32> slot = shape->find_slot(*name)) {
+        fields[slot.value()] = std::move(value);
+        return;
+    }
+
+    add_field(shape->transition(name), std::move(value));
+}
+
+void InstanceObject::add_field(std::shared_ptr<Shape> next, std::shared_ptr<Object> value) {
+    shape = std::move(next);
+    fields.emplace_back(std::move(value));
+    klass->field_capacity = std::max(klass->field_capacity, fields.size());
+}
+
+BoundMethodObject::BoundMethodObject(std::shared_ptr<Object> receiver, std::shared_ptr<Object> method)
+    : Object{ObjectType::OBJ_BOUND_METHOD}, receiver{std::move(receiver)}, method{std::move(method)} {}
+
+std::string BoundMethodObject::to_string() const {
+    return method->to_string();
+}
+
+bool BoundMethodObject::is_falsey() const {
+    return false;
+}
+
+bool BoundMethodObject::is_truthy() const {
+    return true;
+}
+
+bool BoundMethodObject::is_equal(const Object& other) const {
+    return this == &other;
+}
+
+ListObject::ListObject()
+    : Object{ObjectType::OBJ_LIST} {}
+
+ListObject::ListObject(std::vector<std::shared_ptr<Object>> elements)
+    : Object{ObjectType::OBJ_LIST} {
+    packed = std::all_of(elements.begin(), elements.end(), [](const std::shared_ptr<Object>& element) {
+        return element->type == ObjectType::OBJ_NUMBER;
+    });
+    if (!packed) {
+        values = std::move(elements);
+        return;
+    }
+    numbers.reserve(elements.size());
+    for (const auto& element : elements) {
+        numbers.emplace_back(static_cast<const NumberObject&>(*element).value);
+    }
+}
+
+std::string ListObject::to_string() const {
+    if (m_printing) {
+        return "[...]";
+    }
+    m_printing = true;
+    std::string result = "[";
+    for (usize i = 0; i < size(); i++) {
+        if (i > 0) {
+            result += ", ";
+        }
+        result += get(i)->to_string();
+    }
+    m_printing = false;
+    return result + "]";
+}
+
+bool ListObject::is_falsey() const {
+    return false;
+}
+
+bool ListObject::is_truthy() const {
+    return true;
+}
+
+bool ListObject::is_equal(const Object& other) const {
+    return this == &other;
+}
+
+usize ListObject::size() const {
+    return packed ? numbers.size() : values.size();
+}
+
+std::shared_ptr<Object> ListObject::get(usize index) const {
+    if (packed) {
+        return std::make_shared<NumberObject>(numbers[index]);
+    }
+    return values[index];
+}
+
+void ListObject::set(usize index, std::shared_ptr<Object> value) {
+    if (packed && value->type == ObjectType::OBJ_NUMBER) {
+        numbers[index] = static_cast<const NumberObject&>(*value).value;
+        return;
+    }
+    unpack();
+    values[index] = std::move(value);
+}
+
+void ListObject::append(std::shared_ptr<Object> value) {
+    if (packed && value->type == ObjectType::OBJ_NUMBER) {
+        numbers.emplace_back(static_cast<const NumberObject&>(*value).value);
+        return;
+    }
+    unpack();
+    values.emplace_back(std::move(value));
+}
+
+void ListObject::unpack() {
+    if (!packed) {
+        return;
+    }
+    values.reserve(numbers.size() + 1);
+    for (double number : numbers) {
+        values.emplace_back(std::make_shared<NumberObject>(number));
+    }
+    numbers = {};
+    packed = false;
+}
+
 /*
  * For our hashing function we want three properties:
  *  - uniformity = the hashing function will spread resulting hash
@@ -1,7 +1,15 @@
 #pragma once
 
 #include "common.h"
+#include "table.h"
+#include <memory>
+#include <optional>
 #include <string>
+#include <vector>
+
+namespace chunk {
+class Chunk;
+} // namespace chunk
 
 namespace object {
 
@@ -10,7 +18,14 @@ enum class ObjectType {
     OBJ_NULL,
     OBJ_NUMBER,
     OBJ_BOOLEAN,
-    OBJ_STRING
+    OBJ_STRING,
+    OBJ_FUNCTION,
+    OBJ_CLOSURE,
+    OBJ_CLASS,
+    OBJ_INSTANCE,
+    OBJ_BOUND_METHOD,
+    OBJ_NATIVE,
+    OBJ_LIST
 };
 
 struct Object {
@@ -81,6 +96,181 @@ struct StringObject : public Object {
     u32 hash;
 };
 
+/*
+ * A function compiled into its own chunk. Functions are constants of the
+ * chunk that declares them and are compared by identity.
+ */
+struct FunctionObject : public Object {
+    FunctionObject(std::string name, u8 arity, std::shared_ptr<chunk::Chunk> chunk);
+
+    std::string to_string() const override;
+    bool is_falsey() const override;
+    bool is_truthy() const override;
+    bool is_equal(const Object& other) const override;
+
+    std::string name;
+    u8 arity;
+    std::shared_ptr<chunk::Chunk> chunk;
+    // Stack slots a call needs from the callee's slot on: the callee, its
+    // arguments and the deepest stack of its code. Set by the virtual
+    // machine when it loads the chunk declaring the function.
+    usize frame_size{0};
+};
+
+/*
+ * A local variable captured by a closure. While the variable is still on the
+ * stack the upvalue is open and refers to its slot, by index since the stack
+ * moves when it grows. Once the variable goes out of scope the upvalue is
+ * closed and holds the value itself.
+ */
+struct Upvalue {
+    explicit Upvalue(usize slot);
+
+    usize slot;
+    bool is_open{true};
+    std::shared_ptr<Object> closed;
+};
+
+/*
+ * Natives get their arguments where the caller pushed them on the stack,
+ * nothing is copied. They return the result, or nullptr when an argument
+ * has a type they cannot handle.
+ */
+using NativeFn = std::shared_ptr<Object> (*)(const std::shared_ptr<Object>* args, u8 arg_count);
+
+// A function implemented in C++, called with exactly `arity` arguments.
+struct NativeObject : public Object {
+    NativeObject(std::string name, u8 arity, NativeFn function);
+
+    std::string to_string() const override;
+    bool is_falsey() const override;
+    bool is_truthy() const override;
+    bool is_equal(const Object& other) const override;
+
+    std::string name;
+    u8 arity;
+    NativeFn function;
+};
+
+/*
+ * A function together with the variables it captured. Functions that
+ * capture nothing are called as they are and never wrapped in a closure.
+ */
+struct ClosureObject : public Object {
+    explicit ClosureObject(std::shared_ptr<FunctionObject> function);
+
+    std::string to_string() const override;
+    bool is_falsey() const override;
+    bool is_truthy() const override;
+    bool is_equal(const Object& other) const override;
+
+    std::shared_ptr<FunctionObject> function;
+    std::vector<std::shared_ptr<Upvalue>> upvalues;
+};
+
+/*
+ * Hidden class of instances. A shape lists the names of the fields an
+ * instance has in the order they were added, the index of a name is the
+ * slot of the field's value in the instance. Adding a field moves the
+ * instance to the shape reached from its current one by that name, so all
+ * instances that got the same fields in the same order share one shape and
+ * store nothing but the values.
+ */
+struct Shape {
+    [[nodiscard]] std::optional<u32> find_slot(const StringObject& name) const;
+    // The shape with `name` added to the fields of this one, created the
+    // first time an instance takes that transition.
+    std::shared_ptr<Shape> transition(const std::shared_ptr<StringObject>& name);
+
+    std::vector<std::shared_ptr<StringObject>> fields;
+    // each adds a different name after the fields of this shape
+    std::vector<std::shared_ptr<Shape>> transitions;
+};
+
+struct ClassObject : public Object {
+    explicit ClassObject(std::string name);
+
+    std::string to_string() const override;
+    bool is_falsey() const override;
+    bool is_truthy() const override;
+    bool is_equal(const Object& other) const override;
+
+    std::string name;
+    table::Table methods;
+    // root of the shapes of the class's instances, without any fields
+    std::shared_ptr<Shape> shape;
+    // most fields an instance of the class has had, new instances reserve
+    // room for as many so their fields are usually allocated once
+    usize field_capacity{0};
+};
+
+struct InstanceObject : public Object {
+    explicit InstanceObject(std::shared_ptr<ClassObject> klass);
+
+    std::string to_string() const override;
+    bool is_falsey() const override;
+    bool is_truthy() const override;
+    bool is_equal(const Object& other) const override;
+
+    // Adds the field if the instance doesn't have it yet.
+    void set_field(const std::shared_ptr<StringObject>& name, std::shared_ptr<Object> value);
+    // Adds a field, `next` is the transition of the current shape by its name.
+    void add_field(std::shared_ptr<Shape> next, std::shared_ptr<Object> value);
+
+    std::shared_ptr<ClassObject> klass;
+    std::shared_ptr<Shape> shape;
+    // values in the order of the names in the shape
+    std::vector<std::shared_ptr<Object>> fields;
+};
+
+// A method read off an instance, calling it calls the method on the instance.
+struct BoundMethodObject : public Object {
+    BoundMethodObject(std::shared_ptr<Object> receiver, std::shared_ptr<Object> method);
+
+    std::string to_string() const override;
+    bool is_falsey() const override;
+    bool is_truthy() const override;
+    bool is_equal(const Object& other) const override;
+
+    std::shared_ptr<Object> receiver;
+    // a function or a closure
+    std::shared_ptr<Object> method;
+};
+
+/*
+ * A growable array of values. As long as every element is a number the list
+ * is packed: it keeps the doubles themselves next to each other, nothing is
+ * allocated per element and reading one only boxes it. Storing anything but
+ * a number unpacks the list into boxed values for good.
+ */
+struct ListObject : public Object {
+    ListObject();
+    // Packed if all the values are numbers.
+    explicit ListObject(std::vector<std::shared_ptr<Object>> elements);
+
+    std::string to_string() const override;
+    bool is_falsey() const override;
+    bool is_truthy() const override;
+    bool is_equal(const Object& other) const override;
+
+    [[nodiscard]] usize size() const;
+    // The element at an index below size(), a new number if the list is packed.
+    [[nodiscard]] std::shared_ptr<Object> get(usize index) const;
+    void set(usize index, std::shared_ptr<Object> value);
+    void append(std::shared_ptr<Object> value);
+
+    bool packed{true};
+    // the elements while the list is packed
+    std::vector<double> numbers;
+    // the elements once it is not
+    std::vector<std::shared_ptr<Object>> values;
+
+private:
+    void unpack();
+    // set while the list is printed, so a list containing itself prints as [...]
+    mutable bool m_printing{false};
+};
+
 /*
  * TODO(zafergoksu):
  *  - make sure to implement these functions
@@ -0,0 +1,481 @@
+#include "optimizer.h"
+#include "chunk.h"
+#include "common.h"
+#include "debug.h"
+#include "ir.h"
+#include "object.h"
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+using namespace ir;
+using namespace object;
+
+namespace optimizer {
+namespace {
+template<typename F>
+void for_each_instr(Function& function, F&& f) {
+    for (Block* block : function.get_blocks()) {
+        for (Instr* instr = block->first; instr != nullptr;) {
+            // f may unlink the instruction
+            Instr* next = instr->next;
+            f(block, instr);
+            instr = next;
+        }
+    }
+}
+
+const std::shared_ptr<Object>& constant_of(const Function& function, const Instr& instr) {
+    return function.get_chunk().get_constants().get_values().at(instr.operand);
+}
+
+Type meet(Type lhs, Type rhs) {
+    if (lhs == Type::TYPE_UNKNOWN) {
+        return rhs;
+    }
+    if (rhs == Type::TYPE_UNKNOWN || lhs == rhs) {
+        return lhs;
+    }
+    return Type::TYPE_DYNAMIC;
+}
+
+Type type_of(const Function& function, const Instr& instr) {
+    auto both = [&instr](Type type) {
+        return instr.arg(0)->type == type && instr.arg(1)->type == type;
+    };
+    auto any_unknown = [&instr]() {
+        for (u32 i = 0; i < instr.arg_count; i++) {
+            if (instr.arg(i)->type == Type::TYPE_UNKNOWN) {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    switch (instr.op) {
+    case Op::IR_CONSTANT:
+        switch (constant_of(function, instr)->type) {
+        case ObjectType::OBJ_NUMBER:
+            return Type::TYPE_NUMBER;
+        case ObjectType::OBJ_STRING:
+            return Type::TYPE_STRING;
+        default:
+            // functions
+            return Type::TYPE_DYNAMIC;
+        }
+    case Op::IR_NIL:
+        return Type::TYPE_NIL;
+    case Op::IR_TRUE:
+    case Op::IR_FALSE:
+    case Op::IR_EQUAL:
+    case Op::IR_NOT:
+        return Type::TYPE_BOOLEAN;
+    case Op::IR_COPY:
+        return instr.arg(0)->type;
+    case Op::IR_PHI: {
+        Type type = Type::TYPE_UNKNOWN;
+        for (u32 i = 0; i < instr.arg_count; i++) {
+            type = meet(type, instr.arg(i)->type);
+        }
+        return type;
+    }
+    case Op::IR_GREATER:
+    case Op::IR_LESS:
+        if (any_unknown()) {
+            return Type::TYPE_UNKNOWN;
+        }
+        return both(Type::TYPE_NUMBER) ? Type::TYPE_BOOLEAN : Type::TYPE_DYNAMIC;
+    case Op::IR_ADD:
+        if (any_unknown()) {
+            return Type::TYPE_UNKNOWN;
+        }
+        if (both(Type::TYPE_STRING)) {
+            return Type::TYPE_STRING;
+        }
+        return both(Type::TYPE_NUMBER) ? Type::TYPE_NUMBER : Type::TYPE_DYNAMIC;
+    case Op::IR_SUBTRACT:
+    case Op::IR_MULTIPLY:
+    case Op::IR_DIVIDE:
+        if (any_unknown()) {
+            return Type::TYPE_UNKNOWN;
+        }
+        return both(Type::TYPE_NUMBER) ? Type::TYPE_NUMBER : Type::TYPE_DYNAMIC;
+    case Op::IR_NEGATE:
+        if (any_unknown()) {
+            return Type::TYPE_UNKNOWN;
+        }
+        return instr.arg(0)->type == Type::TYPE_NUMBER ? Type::TYPE_NUMBER : Type::TYPE_DYNAMIC;
+    default:
+        return Type::TYPE_DYNAMIC;
+    }
+}
+
+bool is_commutative(const Instr& instr) {
+    return instr.op == Op::IR_EQUAL || instr.op == Op::IR_MULTIPLY || (instr.op == Op::IR_ADD && instr.type == Type::TYPE_NUMBER);
+}
+} // namespace
+
+bool is_pure(const Instr& instr) {
+    auto numbers = [&instr]() {
+        for (u32 i = 0; i < instr.arg_count; i++) {
+            if (instr.arg(i)->type != Type::TYPE_NUMBER) {
+                return false;
+            }
+        }
+        return true;
+    };
+
+    switch (instr.op) {
+    case Op::IR_CONSTANT:
+    case Op::IR_NIL:
+    case Op::IR_TRUE:
+    case Op::IR_FALSE:
+    case Op::IR_COPY:
+    case Op::IR_PHI:
+    case Op::IR_EQUAL:
+    case Op::IR_NOT:
+        return true;
+    case Op::IR_GREATER:
+    case Op::IR_LESS:
+    case Op::IR_SUBTRACT:
+    case Op::IR_MULTIPLY:
+    case Op::IR_DIVIDE:
+    case Op::IR_NEGATE:
+        return numbers();
+    case Op::IR_ADD:
+        return numbers() || (instr.arg(0)->type == Type::TYPE_STRING && instr.arg(1)->type == Type::TYPE_STRING);
+    default:
+        // global accesses can fail and printing is observable
+        return false;
+    }
+}
+
+void propagate_copies(Function& function) {
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for_each_instr(function, [&](Block*, Instr* instr) {
+            if (instr->op == Op::IR_COPY) {
+                function.replace(instr, instr->arg(0));
+                changed = true;
+                return;
+            }
+            if (instr->op != Op::IR_PHI) {
+                return;
+            }
+
+            Instr* unique = nullptr;
+            for (u32 i = 0; i < instr->arg_count; i++) {
+                Instr* value = instr->arg(i);
+                if (value == instr || value == unique) {
+                    continue;
+                }
+                if (unique != nullptr) {
+                    return;
+                }
+                unique = value;
+            }
+            if (unique != nullptr) {
+                function.replace(instr, unique);
+                changed = true;
+            }
+        });
+    }
+}
+
+void fold_branches(Function& function) {
+    bool changed = false;
+    for (Block* block : function.get_blocks()) {
+        if (block->terminator != Terminator::TERM_BRANCH) {
+            continue;
+        }
+
+        const Instr* condition = resolve(block->condition);
+        bool falsey = false;
+        switch (condition->op) {
+        case Op::IR_NIL:
+        case Op::IR_FALSE:
+            falsey = true;
+            break;
+        case Op::IR_TRUE:
+            falsey = false;
+            break;
+        case Op::IR_CONSTANT:
+            falsey = constant_of(function, *condition)->is_falsey();
+            break;
+        default:
+            continue;
+        }
+
+        Block* taken = block->targets[falsey ? 1 : 0];
+        function.remove_predecessor(block->targets[falsey ? 0 : 1], block);
+        block->terminator = Terminator::TERM_JUMP;
+        block->targets[0] = taken;
+        block->targets[1] = nullptr;
+        changed = true;
+    }
+
+    if (changed) {
+        function.compute_order();
+        propagate_copies(function);
+    }
+}
+
+/*
+ * Optimistic: every value starts out as TYPE_UNKNOWN and only moves up
+ * the lattice, so loop phis whose back edge operand has not been visited
+ * yet still get a precise type.
+ */
+void infer_types(Function& function) {
+    for_each_instr(function, [](Block*, Instr* instr) {
+        instr->type = Type::TYPE_UNKNOWN;
+    });
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for_each_instr(function, [&](Block*, Instr* instr) {
+            Type type = type_of(function, *instr);
+            if (type != instr->type) {
+                instr->type = type;
+                changed = true;
+            }
+        });
+    }
+}
+
+void hoist_loop_invariants(Function& function) {
+    function.compute_dominators();
+
+    // natural loops, keyed by header, found from their back edges
+    std::vector<std::pair<Block*, std::vector<Block*>>> loops;
+    std::vector<Block*> found_by(function.block_count(), nullptr);
+    for (Block* header : function.get_blocks()) {
+        std::vector<Block*> work;
+        for (u32 i = 0; i < header->pred_count; i++) {
+            Block* latch = header->preds[i];
+            if (function.dominates(header, latch)) {
+                work.emplace_back(latch);
+            }
+        }
+        if (work.empty()) {
+            continue;
+        }
+
+        std::vector<Block*> body{header};
+        found_by[header->id] = header;
+        while (!work.empty()) {
+            Block* block = work.back();
+            work.pop_back();
+            if (found_by[block->id] == header) {
+                continue;
+            }
+            found_by[block->id] = header;
+            body.emplace_back(block);
+            for (u32 i = 0; i < block->pred_count; i++) {
+                work.emplace_back(block->preds[i]);
+            }
+        }
+        // hoisted instructions keep their order, definitions before uses
+        std::sort(body.begin(), body.end(), [](const Block* lhs, const Block* rhs) {
+            return lhs->rpo_index < rhs->rpo_index;
+        });
+        loops.emplace_back(header, std::move(body));
+    }
+
+    // inner loops first, so invariants can keep moving outwards
+    std::stable_sort(loops.begin(), loops.end(), [](const auto& lhs, const auto& rhs) {
+        return lhs.second.size() < rhs.second.size();
+    });
+
+    std::vector<const Block*> in_loop(function.block_count(), nullptr);
+    for (const auto& [header, body] : loops) {
+        for (Block* block : body) {
+            in_loop[block->id] = header;
+        }
+        auto in_body = [&in_loop, header](const Block* block) {
+            return in_loop[block->id] == header;
+        };
+
+        Block* preheader = nullptr;
+        u32 entries = 0;
+        for (u32 i = 0; i < header->pred_count; i++) {
+            if (!in_body(header->preds[i])) {
+                preheader = header->preds[i];
+                entries++;
+            }
+        }
+        if (entries != 1 || preheader->terminator != Terminator::TERM_JUMP) {
+            continue;
+        }
+
+        auto is_invariant = [&in_body](const Instr* instr) {
+            for (u32 i = 0; i < instr->arg_count; i++) {
+                if (in_body(instr->arg(i)->block)) {
+                    return false;
+                }
+            }
+            return true;
+        };
+
+        for (Block* block : body) {
+            for (Instr* instr = block->first; instr != nullptr;) {
+                Instr* next = instr->next;
+                if (instr->op != Op::IR_PHI && !instr->is_rematerializable() && is_pure(*instr) && is_invariant(instr)) {
+                    block->unlink(instr);
+                    preheader->append(instr);
+                }
+                instr = next;
+            }
+        }
+    }
+}
+
+/*
+ * Walks the dominator tree keeping a scoped table of the pure expressions
+ * available on entry to each block. Global loads are only reused within a
+ * block, up to the next store of the same name, since a store in another
+ * block could run between two loads in different blocks.
+ */
+void eliminate_common_subexpressions(Function& function) {
+    using Key = std::tuple<Op, u32, u32>;
+
+    function.compute_dominators();
+    std::vector<std::vector<Block*>> children(function.block_count());
+    for (Block* block : function.get_blocks()) {
+        if (block != function.get_entry()) {
+            children[block->idom->id].emplace_back(block);
+        }
+    }
+
+    std::map<Key, Instr*> available;
+    auto visit = [&](Block* block) {
+        std::vector<Key> scope;
+        std::unordered_map<std::string, Instr*> globals;
+        for (Instr* instr = block->first; instr != nullptr;) {
+            Instr* next = instr->next;
+            switch (instr->op) {
+            case Op::IR_DEFINE_GLOBAL:
+            case Op::IR_SET_GLOBAL:
+                globals[constant_of(function, *instr)->to_string()] = instr->arg(0);
+                break;
+            case Op::IR_GET_GLOBAL: {
+                auto [it, inserted] = globals.try_emplace(constant_of(function, *instr)->to_string(), instr);
+                if (!inserted) {
+                    function.replace(instr, it->second);
+                }
+                break;
+            }
+            default: {
+                if (instr->op == Op::IR_PHI || instr->arg_count == 0 || !is_pure(*instr)) {
+                    break;
+                }
+                u32 lhs = instr->arg(0)->id;
+                u32 rhs = instr->arg_count > 1 ? instr->arg(1)->id : UINT32_MAX;
+                if (is_commutative(*instr) && rhs < lhs) {
+                    std::swap(lhs, rhs);
+                }
+                Key key{instr->op, lhs, rhs};
+                auto [it, inserted] = available.try_emplace(key, instr);
+                if (inserted) {
+                    scope.emplace_back(key);
+                } else {
+                    function.replace(instr, it->second);
+                }
+                break;
+            }
+            }
+            instr = next;
+        }
+        return scope;
+    };
+
+    struct Frame {
+        Block* block;
+        usize next_child;
+        std::vector<Key> scope;
+    };
+    std::vector<Frame> frames;
+    frames.push_back({function.get_entry(), 0, visit(function.get_entry())});
+    while (!frames.empty()) {
+        Frame& frame = frames.back();
+        const std::vector<Block*>& kids = children[frame.block->id];
+        if (frame.next_child < kids.size()) {
+            Block* child = kids[frame.next_child++];
+            frames.push_back({child, 0, visit(child)});
+            continue;
+        }
+        for (const Key& key : frame.scope) {
+            available.erase(key);
+        }
+        frames.pop_back();
+    }
+}
+
+void eliminate_dead_code(Function& function) {
+    std::vector<bool> live(function.instr_count(), false);
+    std::vector<Instr*> work;
+    auto mark = [&](Instr* instr) {
+        if (!live[instr->id]) {
+            live[instr->id] = true;
+            work.emplace_back(instr);
+        }
+    };
+
+    for_each_instr(function, [&](Block*, Instr* instr) {
+        if (!is_pure(*instr)) {
+            mark(instr);
+        }
+    });
+    for (Block* block : function.get_blocks()) {
+        if (block->terminator == Terminator::TERM_BRANCH) {
+            mark(resolve(block->condition));
+        }
+    }
+    while (!work.empty()) {
+        Instr* instr = work.back();
+        work.pop_back();
+        for (u32 i = 0; i < instr->arg_count; i++) {
+            mark(instr->arg(i));
+        }
+    }
+
+    for_each_instr(function, [&](Block*, Instr* instr) {
+        if (!live[instr->id]) {
+            function.remove(instr);
+        }
+    });
+}
+
+bool optimize(chunk::Chunk& chunk) {
+    std::unique_ptr<Function> function = build(chunk);
+    if (function == nullptr) {
+        return false;
+    }
+
+    propagate_copies(*function);
+    fold_branches(*function);
+    infer_types(*function);
+    // hoisting first lets one copy of an invariant cover the uses after the loop
+    hoist_loop_invariants(*function);
+    eliminate_common_subexpressions(*function);
+    eliminate_dead_code(*function);
+
+    chunk::Chunk optimized;
+    if (!emit(*function, optimized)) {
+        return false;
+    }
+
+#ifdef DEBUG_PRINT_CODE
+    disassemble_chunk(optimized, "optimized code");
+#endif
+    chunk = std::move(optimized);
+    return true;
+}
+
+} // namespace optimizer
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "chunk.h"
+#include "ir.h"
+
+namespace optimizer {
+
+/*
+ * Passes over the SSA form of a chunk. Each pass leaves the function in a
+ * state the next one and `ir::emit` accept, the order used by `optimize`
+ * is the one they are written in.
+ */
+
+// Removes copies and phis whose operands are all the same value.
+void propagate_copies(ir::Function& function);
+// Turns branches on a constant condition into jumps.
+void fold_branches(ir::Function& function);
+// Computes the runtime type of every value where it is known statically.
+void infer_types(ir::Function& function);
+// Moves pure instructions whose operands do not change in a loop in front of it.
+void hoist_loop_invariants(ir::Function& function);
+// Reuses the result of a pure instruction computed earlier on every path.
+void eliminate_common_subexpressions(ir::Function& function);
+// Removes pure instructions whose results are never used.
+void eliminate_dead_code(ir::Function& function);
+
+// Returns true when an instruction can be removed, reordered or executed
+// speculatively without changing the output of the program.
+[[nodiscard]] bool is_pure(const ir::Instr& instr);
+
+// Replaces the chunk with optimized bytecode, returns false and leaves it
+// untouched when the chunk could not be optimized.
+bool optimize(chunk::Chunk& chunk);
+
+} // namespace optimizer
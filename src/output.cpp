@@ -0,0 +1,111 @@
+#include "output.h"
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string_view>
+#include <unistd.h>
+
+namespace output {
+
+Sink::Sink(int fd, FlushPolicy policy, usize capacity)
+    : m_fd{fd},
+      m_buffer{std::make_unique_for_overwrite<char[]>(std::max<usize>(capacity, 64))},
+      m_capacity{std::max<usize>(capacity, 64)} {
+    set_policy(policy);
+}
+
+Sink::~Sink() {
+    flush();
+}
+
+void Sink::set_policy(FlushPolicy policy) {
+    switch (policy) {
+    case FlushPolicy::FLUSH_AUTO:
+        m_line_buffered = isatty(m_fd) != 0;
+        break;
+    case FlushPolicy::FLUSH_LINE:
+        m_line_buffered = true;
+        break;
+    case FlushPolicy::FLUSH_FULL:
+        m_line_buffered = false;
+        break;
+    }
+}
+
+void Sink::write(std::string_view text) {
+    if (text.size() > m_capacity - m_size) {
+        flush();
+        if (text.size() >= m_capacity) {
+            write_all(text.data(), text.size());
+            return;
+        }
+    }
+    std::memcpy(m_buffer.get() + m_size, text.data(), text.size());
+    m_size += text.size();
+
+    if (m_line_buffered && text.find('\n') != std::string_view::npos) {
+        flush();
+    }
+}
+
+/*
+ * Integers that doubles hold exactly are written as integers, which is much
+ * cheaper than formatting the double. Other integral numbers below 1e21 are
+ * written with all their digits too, anything else in the shortest form that
+ * reads back as the same number.
+ */
+char* format_number(char* first, char* last, double value) {
+    // 2^53, every integer up to it is exact
+    constexpr double k_max_exact = 9007199254740992.0;
+    if (value >= -k_max_exact && value <= k_max_exact && !(value == 0 && std::signbit(value))) {
+        auto integer = static_cast<i64>(value);
+        if (static_cast<double>(integer) == value) {
+            return std::to_chars(first, last, integer).ptr;
+        }
+    }
+    if (std::fabs(value) < 1e21 && std::trunc(value) == value) {
+        return std::to_chars(first, last, value, std::chars_format::fixed).ptr;
+    }
+    return std::to_chars(first, last, value).ptr;
+}
+
+void Sink::write_number(double value) {
+    if (m_capacity - m_size < k_max_number_length) {
+        flush();
+    }
+    char* end = format_number(m_buffer.get() + m_size, m_buffer.get() + m_capacity, value);
+    m_size = static_cast<usize>(end - m_buffer.get());
+}
+
+void Sink::flush() {
+    if (m_size == 0) {
+        return;
+    }
+    if (m_fd == STDOUT_FILENO) {
+        // keep the order of anything printed through std::cout before
+        std::cout.flush();
+    }
+    write_all(m_buffer.get(), m_size);
+    m_size = 0;
+}
+
+void Sink::write_all(const char* data, usize size) {
+    while (size > 0) {
+        isize count = ::write(m_fd, data, size);
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            // like a closed stream, output that cannot be written is dropped
+            return;
+        }
+        data += count;
+        size -= static_cast<usize>(count);
+    }
+}
+
+} // namespace output
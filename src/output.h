@@ -0,0 +1,57 @@
+#pragma once
+
+#include "common.h"
+#include <memory>
+#include <string_view>
+#include <unistd.h>
+
+namespace output {
+
+enum class FlushPolicy {
+    // line buffered when writing to a terminal, fully buffered otherwise
+    FLUSH_AUTO,
+    // complete lines are written as soon as they are printed
+    FLUSH_LINE,
+    // written when the buffer fills up and on `flush`
+    FLUSH_FULL
+};
+
+constexpr usize k_default_capacity = 64 * 1024;
+// Longer than any text `format_number` writes.
+constexpr usize k_max_number_length = 32;
+
+// Writes `value` as `NumberObject::to_string` prints it and returns its end.
+char* format_number(char* first, char* last, double value);
+
+/*
+ * Buffer for the output of a running program, written to a file descriptor
+ * with write(2) in large blocks instead of going through iostreams for
+ * every print. Whatever is still buffered is written by `flush` and when
+ * the sink is destroyed, code that leaves without unwinding (exit) or that
+ * writes elsewhere (errors on stderr) has to flush first.
+ */
+class Sink {
+public:
+    explicit Sink(int fd = STDOUT_FILENO, FlushPolicy policy = FlushPolicy::FLUSH_AUTO, usize capacity = k_default_capacity);
+    ~Sink();
+
+    Sink(const Sink&) = delete;
+    Sink& operator=(const Sink&) = delete;
+
+    void set_policy(FlushPolicy policy);
+    void write(std::string_view text);
+    // Shortest text that reads back as `value`, like NumberObject::to_string.
+    void write_number(double value);
+    void flush();
+
+private:
+    void write_all(const char* data, usize size);
+
+    int m_fd;
+    bool m_line_buffered{false};
+    std::unique_ptr<char[]> m_buffer;
+    usize m_capacity;
+    usize m_size{0};
+};
+
+} // namespace output
@@ -1,50 +1,41 @@
 #include "scanner.h"
+#include "scanner_simd.h"
+#include "source_buffer.h"
 #include "token.h"
 #include <string>
-#include <unordered_map>
+#include <string_view>
 #include <utility>
 
 using namespace token;
 
 namespace scanner {
 
-/*
- * We could use a trie for mapping keywords as we can disregard any keyword
- * searches that do not begin with a beginning character in this list.
- * However, std::unordered_map is fast enough for retrieving token types.
-*/
-static std::unordered_map<std::string, TokenType> token_mapping{
-    {"and", TokenType::TOKEN_AND},
-    {"class", TokenType::TOKEN_CLASS},
-    {"else", TokenType::TOKEN_ELSE},
-    {"if", TokenType::TOKEN_IF},
-    {"nil", TokenType::TOKEN_NIL},
-    {"or", TokenType::TOKEN_OR},
-    {"print", TokenType::TOKEN_PRINT},
-    {"return", TokenType::TOKEN_RETURN},
-    {"super", TokenType::TOKEN_SUPER},
-    {"var", TokenType::TOKEN_VAR},
-    {"while", TokenType::TOKEN_WHILE},
-    {"false", TokenType::TOKEN_FALSE},
-    {"for", TokenType::TOKEN_FOR},
-    {"fun", TokenType::TOKEN_FUN},
-    {"this", TokenType::TOKEN_THIS},
-    {"true", TokenType::TOKEN_TRUE},
-};
-
 Scanner::Scanner()
-    : m_start{0},
+    : m_mark{0},
+      m_start{0},
       m_current{0},
       m_line{1} {}
 
 Scanner::Scanner(std::string source)
-    : m_source{std::move(source)},
+    : Scanner{SourceBuffer{std::move(source)}} {}
+
+Scanner::Scanner(SourceBuffer source)
+    : m_buffer{std::move(source)},
+      m_source{m_buffer.view()},
+      m_mark{0},
       m_start{0},
       m_current{0},
       m_line{1} {}
 
 void Scanner::load_source(std::string source) {
-    m_source = std::move(source);
+    m_buffer = SourceBuffer{std::move(source)};
+    m_source = m_buffer.view();
+    m_mark = 0;
+}
+
+void Scanner::release() {
+    m_mark = m_start;
+    m_buffer.release();
 }
 
 Token Scanner::scan_token() {
@@ -73,6 +64,10 @@ Token Scanner::scan_token() {
         return make_token(TokenType::TOKEN_LEFT_BRACE);
     case '}':
         return make_token(TokenType::TOKEN_RIGHT_BRACE);
+    case '[':
+        return make_token(TokenType::TOKEN_LEFT_BRACKET);
+    case ']':
+        return make_token(TokenType::TOKEN_RIGHT_BRACKET);
     case ';':
         return make_token(TokenType::TOKEN_SEMICOLON);
     case ',':
@@ -106,49 +101,96 @@ Token Scanner::make_token(TokenType token_type) {
     return Token{token_type, m_source.substr(m_start, m_current - m_start), m_line};
 }
 
-Token Scanner::make_error_token(std::string error_message) {
-    return Token{TokenType::TOKEN_ERROR, std::move(error_message), m_line};
+Token Scanner::make_error_token(std::string_view error_message) {
+    return Token{TokenType::TOKEN_ERROR, error_message, m_line};
 }
 
 Token Scanner::number() {
-    while (is_digit(peek())) {
-        advance();
-    }
+    scan_run(simd::skip_digits);
 
     // Look for fractional part
     if (peek() == '.' && is_digit(peek_next())) {
         advance();
-
-        while (is_digit(peek())) {
-            advance();
-        }
+        scan_run(simd::skip_digits);
     }
 
     return make_token(TokenType::TOKEN_NUMBER);
 }
 
 Token Scanner::identifier() {
-    while (is_alpha(peek()) || is_digit(peek())) {
-        advance();
-    }
+    scan_run(simd::skip_identifier);
 
-    std::string lexeme = m_source.substr(m_start, m_current - m_start);
+    return make_token(identifier_type());
+}
 
-    auto iter = token_mapping.find(lexeme);
-    if (iter != token_mapping.end()) {
-        return make_token(iter->second);
+/*
+ * Keywords are recognized with a trie hardcoded as a switch on the first
+ * (and for some, the second) character, so most identifiers are ruled out
+ * after looking at one or two bytes of the source without hashing them.
+ */
+TokenType Scanner::identifier_type() const {
+    usize length = m_current - m_start;
+    switch (m_source[m_start]) {
+    case 'a':
+        return check_keyword(1, "nd", TokenType::TOKEN_AND);
+    case 'c':
+        return check_keyword(1, "lass", TokenType::TOKEN_CLASS);
+    case 'e':
+        return check_keyword(1, "lse", TokenType::TOKEN_ELSE);
+    case 'f':
+        if (length > 1) {
+            switch (m_source[m_start + 1]) {
+            case 'a':
+                return check_keyword(2, "lse", TokenType::TOKEN_FALSE);
+            case 'o':
+                return check_keyword(2, "r", TokenType::TOKEN_FOR);
+            case 'u':
+                return check_keyword(2, "n", TokenType::TOKEN_FUN);
+            }
+        }
+        break;
+    case 'i':
+        return check_keyword(1, "f", TokenType::TOKEN_IF);
+    case 'n':
+        return check_keyword(1, "il", TokenType::TOKEN_NIL);
+    case 'o':
+        return check_keyword(1, "r", TokenType::TOKEN_OR);
+    case 'p':
+        return check_keyword(1, "rint", TokenType::TOKEN_PRINT);
+    case 'r':
+        return check_keyword(1, "eturn", TokenType::TOKEN_RETURN);
+    case 's':
+        return check_keyword(1, "uper", TokenType::TOKEN_SUPER);
+    case 't':
+        if (length > 1) {
+            switch (m_source[m_start + 1]) {
+            case 'h':
+                return check_keyword(2, "is", TokenType::TOKEN_THIS);
+            case 'r':
+                return check_keyword(2, "ue", TokenType::TOKEN_TRUE);
+            }
+        }
+        break;
+    case 'v':
+        return check_keyword(1, "ar", TokenType::TOKEN_VAR);
+    case 'w':
+        return check_keyword(1, "hile", TokenType::TOKEN_WHILE);
     }
 
-    return make_token(TokenType::TOKEN_IDENTIFIER);
+    return TokenType::TOKEN_IDENTIFIER;
 }
 
-Token Scanner::string() {
-    while (!is_at_end() && peek() != '"') {
-        if (peek() == '\n') {
-            m_line++;
-        }
-        advance();
+TokenType Scanner::check_keyword(usize offset, std::string_view rest, TokenType token_type) const {
+    if (m_current - m_start == offset + rest.size() && m_source.substr(m_start + offset, rest.size()) == rest) {
+        return token_type;
     }
+    return TokenType::TOKEN_IDENTIFIER;
+}
+
+Token Scanner::string() {
+    scan_run([this](std::string_view source, usize position) {
+        return simd::find_string_end(source, position, m_line);
+    });
 
     if (is_at_end()) {
         return make_error_token("Unterminated string.");
@@ -161,52 +203,64 @@ Token Scanner::string() {
 
 void Scanner::skip_whitespace() {
     while (true) {
-        char c = peek();
-        switch (c) {
-        case ' ':
-        case '\r':
-        case '\t':
-            advance();
-            break;
-        case '\n': {
-            m_line++;
-            advance();
-        } break;
-        case '/': {
-            if (peek_next() == '/') {
-                while (!is_at_end() && peek() != '\n') {
-                    advance();
-                }
-            } else {
-                return;
-            }
-        }
-        default:
+        scan_run([this](std::string_view source, usize position) {
+            return simd::skip_whitespace(source, position, m_line);
+        });
+        if (peek() != '/' || peek_next() != '/') {
             return;
         }
+        scan_run(simd::find_line_end);
+    }
+}
+
+/*
+ * Only streamed sources can be refilled. The text from the mark on is kept,
+ * it may move to new storage, positions are shifted by what was dropped.
+ */
+bool Scanner::refill() {
+    if (!m_buffer.is_stream()) {
+        return false;
     }
+
+    usize dropped = 0;
+    bool refilled = m_buffer.refill(m_mark, dropped);
+    m_source = m_buffer.view();
+    m_mark -= dropped;
+    m_start -= dropped;
+    m_current -= dropped;
+    return refilled;
+}
+
+// Advances over a run that may continue past the part of the source read so far.
+template<typename ScanRun>
+void Scanner::scan_run(ScanRun scan) {
+    do {
+        m_current = scan(m_source, m_current);
+    } while (m_current == m_source.size() && refill());
 }
 
 bool Scanner::is_at_end() {
-    return m_current >= m_source.size();
+    return m_current >= m_source.size() && !refill();
 }
 
 char Scanner::advance() {
-    return m_source.at(m_current++);
+    return m_source[m_current++];
 }
 
 char Scanner::peek() {
     if (is_at_end()) {
         return '\0';
     }
-    return m_source.at(m_current);
+    return m_source[m_current];
 }
 
 char Scanner::peek_next() {
-    if (m_current > m_source.size() - 2) {
-        return '\0';
+    while (m_current + 1 >= m_source.size()) {
+        if (!refill()) {
+            return '\0';
+        }
     }
-    return m_source.at(m_current + 1);
+    return m_source[m_current + 1];
 }
 
 bool Scanner::is_alpha(char c) {
@@ -222,7 +276,7 @@ bool Scanner::match(char expected) {
         return false;
     }
 
-    if (m_source.at(m_current) != expected) {
+    if (m_source[m_current] != expected) {
         return false;
     }
 
@@ -1,9 +1,11 @@
 #pragma once
 
 #include "common.h"
+#include "source_buffer.h"
 #include "token.h"
 
 #include <string>
+#include <string_view>
 
 namespace scanner {
 
@@ -11,11 +13,22 @@ class Scanner {
 public:
     Scanner();
     explicit Scanner(std::string source);
+    explicit Scanner(SourceBuffer source);
+
+    // tokens are views into the source, a scanner stays where it was created
+    Scanner(const Scanner&) = delete;
+    Scanner& operator=(const Scanner&) = delete;
 
     void load_source(std::string source);
     token::Token scan_token();
+    // Lets a streamed source drop the text before the last scanned token,
+    // tokens scanned before it must no longer be used.
+    void release();
 
 private:
+    bool refill();
+    template<typename ScanRun>
+    void scan_run(ScanRun scan);
     bool is_at_end();
     char advance();
     char peek();
@@ -26,13 +39,18 @@ private:
     void skip_whitespace();
 
     token::Token make_token(token::TokenType token_type);
-    token::Token make_error_token(std::string error_message);
+    token::Token make_error_token(std::string_view error_message);
 
     token::Token string();
     token::Token number();
     token::Token identifier();
+    [[nodiscard]] token::TokenType identifier_type() const;
+    [[nodiscard]] token::TokenType check_keyword(usize offset, std::string_view rest, token::TokenType token_type) const;
 
-    std::string m_source;
+    SourceBuffer m_buffer;
+    std::string_view m_source;
+    // start of the text a streamed source has to keep
+    usize m_mark;
     usize m_start;
     usize m_current;
     usize m_line;
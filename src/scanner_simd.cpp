@@ -0,0 +1,180 @@
+#include "scanner_simd.h"
+#include <bit>
+#include <string_view>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define LOX_SCANNER_BATCH_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define LOX_SCANNER_BATCH_SSE2
+#endif
+
+namespace scanner::simd {
+
+namespace {
+
+/*
+ * A batch of source bytes, every classification returns a bit mask with bit i
+ * set when byte i of the batch is in the class. Ranges are tested with an
+ * unsigned `min`, `c - low <= high - low` holds exactly for bytes in
+ * [low, high] once the subtraction wraps around.
+ */
+#if defined(LOX_SCANNER_BATCH_AVX2)
+struct Batch {
+    static constexpr usize k_width = 32;
+    static constexpr u32 k_all = 0xFFFFFFFF;
+
+    static Batch load(const char* bytes) {
+        return {_mm256_loadu_si256(reinterpret_cast<const __m256i*>(bytes))};
+    }
+
+    [[nodiscard]] u32 equal(char c) const {
+        return static_cast<u32>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(m_bytes, _mm256_set1_epi8(c))));
+    }
+
+    [[nodiscard]] u32 in_range(char low, char high) const {
+        return in_range(m_bytes, low, high);
+    }
+
+    [[nodiscard]] u32 letter() const {
+        return in_range(_mm256_or_si256(m_bytes, _mm256_set1_epi8(0x20)), 'a', 'z');
+    }
+
+    static u32 in_range(__m256i bytes, char low, char high) {
+        __m256i offset = _mm256_sub_epi8(bytes, _mm256_set1_epi8(low));
+        __m256i inside = _mm256_cmpeq_epi8(_mm256_min_epu8(offset, _mm256_set1_epi8(static_cast<char>(high - low))), offset);
+        return static_cast<u32>(_mm256_movemask_epi8(inside));
+    }
+
+    __m256i m_bytes;
+};
+#elif defined(LOX_SCANNER_BATCH_SSE2)
+struct Batch {
+    static constexpr usize k_width = 16;
+    static constexpr u32 k_all = 0xFFFF;
+
+    static Batch load(const char* bytes) {
+        return {_mm_loadu_si128(reinterpret_cast<const __m128i*>(bytes))};
+    }
+
+    [[nodiscard]] u32 equal(char c) const {
+        return static_cast<u32>(_mm_movemask_epi8(_mm_cmpeq_epi8(m_bytes, _mm_set1_epi8(c))));
+    }
+
+    [[nodiscard]] u32 in_range(char low, char high) const {
+        return in_range(m_bytes, low, high);
+    }
+
+    [[nodiscard]] u32 letter() const {
+        return in_range(_mm_or_si128(m_bytes, _mm_set1_epi8(0x20)), 'a', 'z');
+    }
+
+    static u32 in_range(__m128i bytes, char low, char high) {
+        __m128i offset = _mm_sub_epi8(bytes, _mm_set1_epi8(low));
+        __m128i inside = _mm_cmpeq_epi8(_mm_min_epu8(offset, _mm_set1_epi8(static_cast<char>(high - low))), offset);
+        return static_cast<u32>(_mm_movemask_epi8(inside));
+    }
+
+    __m128i m_bytes;
+};
+#endif
+
+/*
+ * Advances over the bytes in a class, `in_batch` classifies a whole batch and
+ * `in_byte` a single byte, both have to agree. When `lines` is given the
+ * newlines passed over are counted, newlines after the end of the run in the
+ * last batch are masked out.
+ */
+template<typename InBatch, typename InByte>
+usize skip_run(std::string_view source, usize position, InBatch in_batch, InByte in_byte, usize* lines) {
+    const char* bytes = source.data();
+    usize size = source.size();
+
+#if defined(LOX_SCANNER_BATCH_AVX2) || defined(LOX_SCANNER_BATCH_SSE2)
+    while (position + Batch::k_width <= size) {
+        Batch batch = Batch::load(bytes + position);
+        u32 outside = ~in_batch(batch) & Batch::k_all;
+        if (lines != nullptr) {
+            u32 newlines = batch.equal('\n');
+            if (outside != 0) {
+                newlines &= (1u << std::countr_zero(outside)) - 1;
+            }
+            *lines += std::popcount(newlines);
+        }
+        if (outside != 0) {
+            return position + std::countr_zero(outside);
+        }
+        position += Batch::k_width;
+    }
+#endif
+
+    while (position < size && in_byte(bytes[position])) {
+        if (lines != nullptr && bytes[position] == '\n') {
+            (*lines)++;
+        }
+        position++;
+    }
+    return position;
+}
+
+bool is_whitespace(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+bool is_identifier(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_';
+}
+
+bool is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+} // namespace
+
+usize skip_whitespace(std::string_view source, usize position, usize& lines) {
+    return skip_run(
+        source, position,
+        [](const auto& batch) {
+            return batch.equal(' ') | batch.equal('\t') | batch.equal('\r') | batch.equal('\n');
+        },
+        is_whitespace, &lines);
+}
+
+usize skip_identifier(std::string_view source, usize position) {
+    return skip_run(
+        source, position,
+        [](const auto& batch) {
+            return batch.letter() | batch.in_range('0', '9') | batch.equal('_');
+        },
+        is_identifier, nullptr);
+}
+
+usize skip_digits(std::string_view source, usize position) {
+    return skip_run(
+        source, position,
+        [](const auto& batch) {
+            return batch.in_range('0', '9');
+        },
+        is_digit, nullptr);
+}
+
+usize find_line_end(std::string_view source, usize position) {
+    return skip_run(
+        source, position,
+        [](const auto& batch) {
+            return ~batch.equal('\n');
+        },
+        [](char c) { return c != '\n'; }, nullptr);
+}
+
+usize find_string_end(std::string_view source, usize position, usize& lines) {
+    return skip_run(
+        source, position,
+        [](const auto& batch) {
+            return ~batch.equal('"');
+        },
+        [](char c) { return c != '"'; }, &lines);
+}
+
+} // namespace scanner::simd
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "common.h"
+
+#include <string_view>
+
+namespace scanner::simd {
+
+/*
+ * Scanning of the runs of bytes that make up most of a source file. Each
+ * function starts at `position` and returns the index of the first byte that
+ * does not belong to the run, or the size of the source when the run reaches
+ * the end. Whole 16 (SSE2) or 32 (AVX2) byte batches are classified at once
+ * while they fit in the source, the remainder is scanned byte by byte, which
+ * is also the only path on targets without SSE2.
+ */
+
+// Skips spaces, tabs, carriage returns and newlines, adding the newlines to `lines`.
+[[nodiscard]] usize skip_whitespace(std::string_view source, usize position, usize& lines);
+// Skips letters, digits and underscores.
+[[nodiscard]] usize skip_identifier(std::string_view source, usize position);
+// Skips decimal digits.
+[[nodiscard]] usize skip_digits(std::string_view source, usize position);
+// Finds the newline ending a line comment.
+[[nodiscard]] usize find_line_end(std::string_view source, usize position);
+// Finds the quote closing a string literal, adding the newlines in its body to `lines`.
+[[nodiscard]] usize find_string_end(std::string_view source, usize position, usize& lines);
+
+} // namespace scanner::simd
@@ -0,0 +1,164 @@
+#include "source_buffer.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+
+namespace scanner {
+
+SourceBuffer::SourceBuffer(std::string text)
+    : m_text{std::move(text)} {}
+
+SourceBuffer::~SourceBuffer() {
+    unmap();
+    close_stream();
+}
+
+SourceBuffer::SourceBuffer(SourceBuffer&& other) noexcept
+    : m_text{std::move(other.m_text)},
+      m_mapping{std::exchange(other.m_mapping, nullptr)},
+      m_mapping_size{std::exchange(other.m_mapping_size, 0)},
+      m_fd{std::exchange(other.m_fd, -1)},
+      m_chunk_size{other.m_chunk_size},
+      m_storage{std::move(other.m_storage)},
+      m_capacity{std::exchange(other.m_capacity, 0)},
+      m_size{std::exchange(other.m_size, 0)},
+      m_retired{std::move(other.m_retired)} {}
+
+SourceBuffer& SourceBuffer::operator=(SourceBuffer&& other) noexcept {
+    if (this != &other) {
+        unmap();
+        close_stream();
+        m_text = std::move(other.m_text);
+        m_mapping = std::exchange(other.m_mapping, nullptr);
+        m_mapping_size = std::exchange(other.m_mapping_size, 0);
+        m_fd = std::exchange(other.m_fd, -1);
+        m_chunk_size = other.m_chunk_size;
+        m_storage = std::move(other.m_storage);
+        m_capacity = std::exchange(other.m_capacity, 0);
+        m_size = std::exchange(other.m_size, 0);
+        m_retired = std::move(other.m_retired);
+    }
+    return *this;
+}
+
+std::optional<SourceBuffer> SourceBuffer::open(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return std::nullopt;
+    }
+
+    struct stat status{};
+    if (fstat(fd, &status) == 0 && S_ISREG(status.st_mode) && status.st_size > 0) {
+        void* mapping = mmap(nullptr, static_cast<usize>(status.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping != MAP_FAILED) {
+            // the scanner reads the source front to back exactly once
+            madvise(mapping, static_cast<usize>(status.st_size), MADV_SEQUENTIAL);
+            close(fd);
+            SourceBuffer buffer;
+            buffer.m_mapping = static_cast<const char*>(mapping);
+            buffer.m_mapping_size = static_cast<usize>(status.st_size);
+            return buffer;
+        }
+    }
+
+    // pipes and other streams have no size up front, read them as needed
+    return stream(fd);
+}
+
+SourceBuffer SourceBuffer::stream(int fd, usize chunk_size) {
+    SourceBuffer buffer;
+    buffer.m_fd = fd;
+    buffer.m_chunk_size = std::max<usize>(chunk_size, 1);
+    return buffer;
+}
+
+std::string_view SourceBuffer::view() const {
+    if (m_mapping != nullptr) {
+        return {m_mapping, m_mapping_size};
+    }
+    if (m_storage != nullptr) {
+        return {m_storage.get(), m_size};
+    }
+    return m_text;
+}
+
+bool SourceBuffer::is_mapped() const {
+    return m_mapping != nullptr;
+}
+
+bool SourceBuffer::is_stream() const {
+    return m_fd >= 0 || m_storage != nullptr;
+}
+
+/*
+ * Full storage is never grown in place, the bytes still needed are copied to
+ * new storage and the old one is retired. Tokens of the statement being
+ * compiled point into it and must stay readable until the compiler is done
+ * with them and calls `release`.
+ */
+bool SourceBuffer::refill(usize keep_from, usize& dropped) {
+    dropped = 0;
+    if (m_fd < 0) {
+        return false;
+    }
+
+    if (m_size == m_capacity) {
+        usize kept = m_size - keep_from;
+        usize capacity = std::max(kept * 2, m_chunk_size);
+        auto storage = std::make_unique_for_overwrite<char[]>(capacity);
+        if (kept > 0) {
+            std::memcpy(storage.get(), m_storage.get() + keep_from, kept);
+        }
+        if (m_storage != nullptr) {
+            m_retired.emplace_back(std::move(m_storage));
+        }
+        m_storage = std::move(storage);
+        m_capacity = capacity;
+        m_size = kept;
+        dropped = keep_from;
+    }
+
+    while (true) {
+        isize count = read(m_fd, m_storage.get() + m_size, std::min(m_capacity - m_size, m_chunk_size));
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            // read errors end the source like the end of the stream does
+            close_stream();
+            return false;
+        }
+        m_size += static_cast<usize>(count);
+        return true;
+    }
+}
+
+void SourceBuffer::release() {
+    m_retired.clear();
+}
+
+void SourceBuffer::unmap() {
+    if (m_mapping != nullptr) {
+        munmap(const_cast<char*>(m_mapping), m_mapping_size);
+        m_mapping = nullptr;
+        m_mapping_size = 0;
+    }
+}
+
+void SourceBuffer::close_stream() {
+    if (m_fd >= 0) {
+        close(m_fd);
+        m_fd = -1;
+    }
+}
+
+} // namespace scanner
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "common.h"
+
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace scanner {
+
+/*
+ * The text of a script, either owned, mapped read-only from a file or read
+ * incrementally from a stream. Regular files are mapped so the scanner reads
+ * the page cache directly instead of a private copy. Pipes and terminals are
+ * streamed, only the part of the input the scanner still needs is buffered
+ * and `refill` reads more of it on demand. Views taken from a buffer stay
+ * valid until it is moved, destroyed or assigned to, views into a stream also
+ * until the `release` after the text they point to was dropped.
+ */
+class SourceBuffer {
+public:
+    static constexpr usize k_stream_chunk_size = 64 * 1024;
+
+    SourceBuffer() = default;
+    explicit SourceBuffer(std::string text);
+    ~SourceBuffer();
+
+    SourceBuffer(const SourceBuffer&) = delete;
+    SourceBuffer& operator=(const SourceBuffer&) = delete;
+    SourceBuffer(SourceBuffer&& other) noexcept;
+    SourceBuffer& operator=(SourceBuffer&& other) noexcept;
+
+    // Maps the file at `path`, or streams it when it cannot be mapped. Returns
+    // nothing when it cannot be opened.
+    static std::optional<SourceBuffer> open(const std::string& path);
+    // Streams from `fd` reading at most `chunk_size` bytes at a time, the
+    // buffer takes ownership of the descriptor.
+    static SourceBuffer stream(int fd, usize chunk_size = k_stream_chunk_size);
+
+    // Text read so far, for streams the bytes before the last `keep_from`
+    // passed to `refill` may have been dropped.
+    [[nodiscard]] std::string_view view() const;
+    [[nodiscard]] bool is_mapped() const;
+    [[nodiscard]] bool is_stream() const;
+
+    // Appends more of a stream to the view and returns false at its end.
+    // Bytes before `keep_from` may be dropped to make room, `dropped` is set
+    // to how many so positions into the view can be adjusted. Bytes that are
+    // moved stay readable at their old address until `release`.
+    bool refill(usize keep_from, usize& dropped);
+    // Frees text retired by `refill`, views into it become invalid.
+    void release();
+
+private:
+    void unmap();
+    void close_stream();
+
+    std::string m_text;
+    const char* m_mapping{nullptr};
+    usize m_mapping_size{0};
+
+    int m_fd{-1};
+    usize m_chunk_size{k_stream_chunk_size};
+    std::unique_ptr<char[]> m_storage;
+    usize m_capacity{0};
+    usize m_size{0};
+    std::vector<std::unique_ptr<char[]>> m_retired;
+};
+
+} // namespace scanner
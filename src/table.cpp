@@ -4,6 +4,8 @@
 #include "value.h"
 #include <memory>
 #include <string>
+#include <utility>
+#include <vector>
 
 using namespace value;
 using namespace object;
@@ -12,8 +14,17 @@ namespace table {
 Table::Table() : m_entries{k_initial_capacity} {}
 
 bool Table::set(std::shared_ptr<StringObject> key, std::shared_ptr<Object> value) {
+    // probing only ends at an empty entry, the table must never fill up
+    if (m_count + 1 > m_entries.size() * k_max_load) {
+        adjust_capacity(static_cast<u32>(m_entries.size()) * 2);
+    }
+
     Entry* entry = find_entry(key);
     bool is_new_key = entry->key == nullptr;
+    if (is_new_key && (entry->value == nullptr || entry->value->type == ObjectType::OBJ_NULL)) {
+        // reusing a tombstone doesn't take up another entry
+        m_count++;
+    }
     entry->key = key;
     entry->value = value;
     return is_new_key;
@@ -53,8 +64,26 @@ bool Table::del(std::shared_ptr<StringObject> key) {
     return true;
 }
 
+/*
+ * Entries are inserted again since their index depends on the capacity.
+ * Tombstones are dropped, so the count is taken again as well.
+ */
+void Table::adjust_capacity(u32 capacity) {
+    std::vector<Entry> entries = std::exchange(m_entries, std::vector<Entry>(capacity));
+    m_count = 0;
+    for (Entry& entry : entries) {
+        if (entry.key == nullptr) {
+            continue;
+        }
+        Entry* destination = find_entry(entry.key);
+        destination->key = std::move(entry.key);
+        destination->value = std::move(entry.value);
+        m_count++;
+    }
+}
+
 void Table::add_all(Table& to) {
-    for (u32 i = 0; i < m_entries.capacity(); i++) {
+    for (u32 i = 0; i < m_entries.size(); i++) {
         Entry& entry = m_entries[i];
         if (entry.key != nullptr) {
             to.set(entry.key, entry.value);
@@ -63,7 +92,7 @@ void Table::add_all(Table& to) {
 }
 
 Entry* Table::find_entry(std::shared_ptr<StringObject> key) {
-    auto capacity = m_entries.capacity();
+    auto capacity = m_entries.size();
     u32 index = key->hash % capacity;
     Entry* tombstone = nullptr;
     while (true) {
@@ -93,7 +122,7 @@ std::shared_ptr<StringObject> Table::find_string(const std::string& value, u32 h
         return nullptr;
     }
 
-    u32 index = hash % m_entries.capacity();
+    u32 index = hash % m_entries.size();
 
     while (true) {
         Entry& entry = m_entries[index];
@@ -106,7 +135,7 @@ std::shared_ptr<StringObject> Table::find_string(const std::string& value, u32 h
             return entry.key;
         }
 
-        index = (index + 1) % m_entries.capacity();
+        index = (index + 1) % m_entries.size();
     }
 }
 } // namespace table
@@ -1,12 +1,17 @@
 #pragma once
 
 #include "common.h"
-#include "object.h"
 #include "value.h"
 #include <memory>
 #include <string>
 #include <vector>
 
+// object.h includes this header for the methods of classes
+namespace object {
+struct Object;
+struct StringObject;
+} // namespace object
+
 namespace table {
 
 struct Entry {
@@ -32,5 +37,7 @@ private:
     void adjust_capacity(u32 capacity);
 
     std::vector<Entry> m_entries;
+    // entries in use, tombstones included
+    u32 m_count{0};
 };
 } // namespace table
@@ -1,19 +1,19 @@
 #include "token.h"
 #include "common.h"
 
-#include <string>
+#include <string_view>
 
 namespace token {
-Token::Token(token::TokenType type, std::string lexeme, usize line)
+Token::Token(token::TokenType type, std::string_view lexeme, usize line)
     : m_type{type},
-      m_lexeme{std::move(lexeme)},
+      m_lexeme{lexeme},
       m_line{line} {}
 
 TokenType Token::get_type() const {
     return m_type;
 }
 
-const std::string& Token::get_lexeme() const {
+std::string_view Token::get_lexeme() const {
     return m_lexeme;
 }
 
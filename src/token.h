@@ -1,7 +1,7 @@
 #pragma once
 
 #include "common.h"
-#include <string>
+#include <string_view>
 namespace token {
 
 enum class TokenType {
@@ -10,6 +10,8 @@ enum class TokenType {
     TOKEN_RIGHT_PAREN,
     TOKEN_LEFT_BRACE,
     TOKEN_RIGHT_BRACE,
+    TOKEN_LEFT_BRACKET,
+    TOKEN_RIGHT_BRACKET,
     TOKEN_COMMA,
     TOKEN_DOT,
     TOKEN_MINUS,
@@ -56,19 +58,26 @@ enum class TokenType {
     TOKEN_EOF
 };
 
+constexpr usize k_token_type_count = static_cast<usize>(TokenType::TOKEN_EOF) + 1;
+
+/*
+ * A token does not own its lexeme, it views the scanner's source buffer
+ * (or a static error message), so tokens are cheap to copy around and
+ * only outlive that buffer if their lexeme is never read.
+ */
 class Token {
 public:
-    Token(TokenType type, std::string lexeme, usize line);
+    Token(TokenType type, std::string_view lexeme, usize line);
 
     [[nodiscard]] TokenType get_type() const;
-    [[nodiscard]] const std::string& get_lexeme() const;
+    [[nodiscard]] std::string_view get_lexeme() const;
     [[nodiscard]] usize get_line() const;
 
     bool operator==(const Token& other) const;
 
 private:
     TokenType m_type;
-    std::string m_lexeme;
+    std::string_view m_lexeme;
     usize m_line;
 };
 
@@ -2,10 +2,15 @@
 #include "chunk.h"
 #include "common.h"
 #include "debug.h"
+#include "natives.h"
 #include "object.h"
 #include "utility.h"
 #include "value.h"
+#include <algorithm>
+#include <cmath>
+#include <iterator>
 #include <memory>
+#include <optional>
 #include <string>
 #include <utility>
 #include <vector>
@@ -15,206 +20,935 @@ using namespace value;
 using namespace object;
 
 namespace vm {
+namespace {
+// The condition of a counting loop, negated comparisons compare like OP_NOT after them.
+bool for_condition(u8 flags, double counter, double bound) {
+    switch (flags & ForLoopFlags::FOR_COMPARISON) {
+    case ForLoopFlags::FOR_LESS:
+        return counter < bound;
+    case ForLoopFlags::FOR_LESS_EQUAL:
+        return !(counter > bound);
+    case ForLoopFlags::FOR_GREATER:
+        return counter > bound;
+    default:
+        return !(counter < bound);
+    }
+}
+
+// Why `target[index]` names no element, nullptr when it does.
+const char* index_error(const Object& target, const Object& index) {
+    if (target.type != ObjectType::OBJ_LIST) {
+        return "Only lists can be indexed.";
+    }
+    if (index.type != ObjectType::OBJ_NUMBER) {
+        return "List index must be a number.";
+    }
+    double value = static_cast<const NumberObject&>(index).value;
+    if (value != std::floor(value)) {
+        return "List index must be a whole number.";
+    }
+    if (value < 0 || value >= static_cast<double>(static_cast<const ListObject&>(target).size())) {
+        return "List index out of range.";
+    }
+    return nullptr;
+}
+} // namespace
+
+VirtualMachine::VirtualMachine()
+    : m_init_string{std::make_shared<StringObject>("init")} {
+    define_builtins();
+}
 
 VirtualMachine::VirtualMachine(std::unique_ptr<chunk::Chunk> chunk)
-    : m_chunk{std::move(chunk)},
-      m_ip{0},
-      m_strings{},
-      m_globals{},
-      m_stack_top{0},
-      m_stack{} {}
+    : VirtualMachine() {
+    if (chunk != nullptr) {
+        load_new_chunk(std::move(chunk));
+    }
+}
 
 void VirtualMachine::reset() {
+    // closures that outlive the stack keep the values they captured
+    close_upvalues(0);
     m_chunk = nullptr;
-    m_ip = 0;
+    m_frame_count = 0;
     m_strings = {};
     m_globals = {};
     m_stack_top = 0;
-    m_stack = {};
+    m_stack.clear();
+    m_stack_overflow = false;
+    m_inline_cache_stats = {};
+    define_builtins();
+}
+
+output::Sink& VirtualMachine::get_output() {
+    return m_output;
+}
+
+void VirtualMachine::set_max_stack(usize slots) {
+    m_max_stack = slots;
+}
+
+void VirtualMachine::set_tail_calls(bool enabled) {
+    m_tail_calls = enabled;
+}
+
+const InlineCacheStats& VirtualMachine::get_inline_cache_stats() const {
+    return m_inline_cache_stats;
+}
+
+void VirtualMachine::define_native(std::string_view name, u8 arity, NativeFn function) {
+    auto key = std::make_shared<StringObject>(std::string{name});
+    m_globals.set(key, std::make_shared<NativeObject>(key->value, arity, function));
+}
+
+/*
+ * The callee and the arguments are pushed like a script would. A call of a
+ * script function runs until its frame returns, the frames that were there
+ * before are not touched, so C++ can call into a script that has finished.
+ */
+std::shared_ptr<Object> VirtualMachine::call_global(std::string_view name, std::span<const std::shared_ptr<Object>> args) {
+    std::shared_ptr<Object> callee;
+    if (!m_globals.get(std::make_shared<StringObject>(std::string{name}), callee)) {
+        runtime_error("Undefined variable '" + std::string{name} + "'.");
+        return nullptr;
+    }
+    if (args.size() > UINT8_MAX) {
+        runtime_error("Can't have more than 255 arguments.");
+        return nullptr;
+    }
+    if (m_frame_count == k_max_frames || !reserve_stack(m_stack_top + args.size() + 1)) {
+        runtime_error("Stack overflow.");
+        return nullptr;
+    }
+
+    push(callee);
+    for (const auto& arg : args) {
+        push(arg);
+    }
+    usize host_frames = std::exchange(m_host_frames, m_frame_count);
+    bool called = call_value(*callee, static_cast<u8>(args.size()));
+    InterpretResult result = INTERPRET_OK;
+    if (called && m_frame_count > m_host_frames) {
+        result = execute<false>();
+    }
+    m_host_frames = host_frames;
+
+    if (!called) {
+        reset_stack();
+        return nullptr;
+    }
+    if (result != INTERPRET_OK) {
+        return nullptr;
+    }
+    return pop();
+}
+
+void VirtualMachine::define_builtins() {
+    for (const natives::Native& native : natives::builtins()) {
+        define_native(native.name, native.arity, native.function);
+    }
 }
 
 void VirtualMachine::load_new_chunk(std::shared_ptr<chunk::Chunk> chunk) {
     m_chunk = std::move(chunk);
-    m_ip = 0;
+    prepare_functions(*m_chunk);
+    m_frames[0] = CallFrame{nullptr, nullptr, m_chunk.get(), m_chunk->code().data(), 0};
+    m_frame_count = 1;
+    // code whose depth cannot be worked out may use the whole stack
+    m_stack_overflow = !reserve_stack(m_stack_top + m_chunk->max_stack_depth().value_or(m_max_stack));
 }
 
-InterpretResult VirtualMachine::run() {
-    InterpretResult result = INTERPRET_RUNTIME_ERROR;
-    while (m_ip < m_chunk->size()) {
-#ifdef DEBUG_TRACE_EXECUTION
-        for (u8 i = 0; i < m_stack_top; i++) {
-            println("\t[ {} ]", m_stack[i]->to_string());
-        }
-        disassemble_instruction(*m_chunk, m_ip);
-#endif
-        result = run_step();
-        if (result != INTERPRET_OK) {
-            return result;
+/*
+ * Works out once how many stack slots a call of each function declared in
+ * the chunk needs, so calls only compare that with the size of the stack.
+ */
+void VirtualMachine::prepare_functions(const chunk::Chunk& chunk) {
+    for (const auto& constant : chunk.get_constants().get_values()) {
+        if (constant == nullptr || constant->type != ObjectType::OBJ_FUNCTION) {
+            continue;
         }
+        auto& function = static_cast<FunctionObject&>(*constant);
+        function.frame_size = 1 + function.arity + function.chunk->max_stack_depth().value_or(m_max_stack);
+        prepare_functions(*function.chunk);
     }
-    return result;
 }
 
-InterpretResult VirtualMachine::run_step() {
-    u8 instruction = read_byte();
-    switch (instruction) {
-    case OpCode::OP_CONSTANT: {
-        std::shared_ptr<Object> constant = read_constant();
-        push(constant);
-        break;
+bool VirtualMachine::reserve_stack(usize depth) {
+    if (depth > m_max_stack) {
+        return false;
     }
-    case OpCode::OP_NIL:
-        push(std::make_shared<NullObject>());
-        break;
-    case OpCode::OP_TRUE:
-        push(std::make_shared<BooleanObject>(true));
-        break;
-    case OpCode::OP_FALSE:
-        push(std::make_shared<BooleanObject>(false));
-        break;
-    case OpCode::OP_POP:
-        pop();
+    if (depth > m_stack.size()) {
+        m_stack.resize(std::max(depth, m_stack.size() * 2));
+    }
+    return true;
+}
+
+InterpretResult VirtualMachine::run() {
+    if (m_stack_overflow) {
+        runtime_error("Stack overflow.");
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    return execute<false>();
+}
+
+InterpretResult VirtualMachine::run_step() {
+    return execute<true>();
+}
+
+/*
+ * The callee and its arguments stay where the caller pushed them and become
+ * the slots of the new frame, a call only fills in a preallocated frame.
+ */
+inline bool VirtualMachine::call_value(const Object& callee, u8 arg_count) {
+    const ClosureObject* closure = nullptr;
+    const FunctionObject* callee_function = nullptr;
+    switch (callee.type) {
+    case ObjectType::OBJ_FUNCTION:
+        callee_function = &static_cast<const FunctionObject&>(callee);
         break;
-    case OpCode::OP_GET_LOCAL: {
-        u8 slot = read_byte();
-        // get the index to the local variable slot (compiler and vm local var stacks match)
-        // and push it back on top as we require other instructions to look at top of stack
-        push(m_stack[slot]);
+    case ObjectType::OBJ_CLOSURE:
+        closure = &static_cast<const ClosureObject&>(callee);
+        callee_function = closure->function.get();
         break;
+    case ObjectType::OBJ_NATIVE:
+        return call_native(static_cast<const NativeObject&>(callee), arg_count);
+    case ObjectType::OBJ_CLASS:
+        return call_class(arg_count);
+    case ObjectType::OBJ_BOUND_METHOD: {
+        const auto& bound = static_cast<const BoundMethodObject&>(callee);
+        // the receiver takes the place of the callee as `this`
+        m_stack[m_stack_top - arg_count - 1] = bound.receiver;
+        return call_value(*bound.method, arg_count);
     }
-    case OpCode::OP_SET_LOCAL: {
-        u8 slot = read_byte();
-        m_stack[slot] = peek_stack_top();
-        break;
+    default:
+        runtime_error("Can only call functions and classes.");
+        return false;
     }
-    case OpCode::OP_GET_GLOBAL: {
-        std::shared_ptr<StringObject> name = std::static_pointer_cast<StringObject>(read_constant());
-        std::shared_ptr<Object> value;
-        if (!m_globals.get(name, value)) {
-            runtime_error("Undefined variable '" + name->to_string() + "'.");
-            return INTERPRET_RUNTIME_ERROR;
-        }
-        push(value);
-        break;
+
+    const FunctionObject& function = *callee_function;
+    if (arg_count != function.arity) {
+        runtime_error("Expected " + std::to_string(function.arity) + " arguments but got " + std::to_string(arg_count) + ".");
+        return false;
     }
-    case OpCode::OP_DEFINE_GLOBAL: {
-        std::shared_ptr<StringObject> name = std::static_pointer_cast<StringObject>(read_constant());
-        m_globals.set(name, peek_stack_top());
-        pop();
-        break;
+
+    usize slots = m_stack_top - arg_count - 1;
+    if (m_frame_count == k_max_frames || (slots + function.frame_size > m_stack.size() && !reserve_stack(slots + function.frame_size))) {
+        runtime_error("Stack overflow.");
+        return false;
     }
-    case OpCode::OP_SET_GLOBAL: {
-        std::shared_ptr<StringObject> name = std::static_pointer_cast<StringObject>(read_constant());
-        // when we set, we haven't defined it before
-        if (m_globals.set(name, peek_stack_top())) {
-            // delete old value for continuous use in repl
-            m_globals.del(name);
-            runtime_error("Undefined variable '" + name->to_string() + "'.");
-            return INTERPRET_RUNTIME_ERROR;
-        }
-        break;
+
+    m_frames[m_frame_count++] = CallFrame{&function, closure, function.chunk.get(), function.chunk->code().data(), slots};
+    return true;
+}
+
+/*
+ * Natives run without a frame of their own. They read the arguments in place
+ * and the result replaces the callee and the arguments.
+ */
+bool VirtualMachine::call_native(const NativeObject& native, u8 arg_count) {
+    if (arg_count != native.arity) {
+        runtime_error("Expected " + std::to_string(native.arity) + " arguments but got " + std::to_string(arg_count) + ".");
+        return false;
     }
-    case OpCode::OP_EQUAL: {
-        std::shared_ptr<Object> rhs = pop();
-        std::shared_ptr<Object> lhs = pop();
-        bool result = lhs->is_equal(*rhs);
-        push(std::make_shared<BooleanObject>(result));
-        break;
+
+    std::shared_ptr<Object> result = native.function(m_stack.data() + m_stack_top - arg_count, arg_count);
+    if (result == nullptr) {
+        runtime_error("Invalid argument to native function '" + native.name + "'.");
+        return false;
     }
-    case OpCode::OP_GREATER:
-        binary_greater_op();
-        break;
-    case OpCode::OP_LESS:
-        binary_less_op();
-        break;
-    case OpCode::OP_ADD: {
-        std::shared_ptr<Object> stack_top = peek_stack_top();
-        std::shared_ptr<Object> stack_top_prev = peek(1);
-        if (stack_top == nullptr || stack_top_prev == nullptr) {
-            runtime_error("Operands are nil.");
-            return INTERPRET_RUNTIME_ERROR;
-        }
-        if (stack_top->type == ObjectType::OBJ_STRING && stack_top_prev->type == ObjectType::OBJ_STRING) {
-            concatenate();
-        } else if (stack_top->type == ObjectType::OBJ_NUMBER && stack_top_prev->type == ObjectType::OBJ_NUMBER) {
-            binary_add_op();
-        } else {
-            runtime_error("Operands must be two numbers or two strings.");
-            return INTERPRET_RUNTIME_ERROR;
-        }
-        break;
+    m_stack_top -= arg_count;
+    m_stack[m_stack_top - 1] = std::move(result);
+    return true;
+}
+
+/*
+ * The new instance replaces the class below the arguments and is `this` for
+ * the initializer, which gets the arguments.
+ */
+bool VirtualMachine::call_class(u8 arg_count) {
+    std::shared_ptr<Object>& slot = m_stack[m_stack_top - arg_count - 1];
+    auto klass = std::static_pointer_cast<ClassObject>(slot);
+    slot = std::make_shared<InstanceObject>(klass);
+
+    std::shared_ptr<Object> initializer;
+    if (klass->methods.get(m_init_string, initializer)) {
+        return call_value(*initializer, arg_count);
     }
-    case OpCode::OP_SUBTRACT:
-        binary_subtract_op();
-        break;
-    case OpCode::OP_MULTIPLY:
-        binary_multiply_op();
-        break;
-    case OpCode::OP_DIVIDE:
-        binary_divide_op();
-        break;
-    case OpCode::OP_NOT:
-        push(std::make_shared<BooleanObject>(pop()->is_falsey()));
-        break;
-    case OpCode::OP_NEGATE: {
-        std::shared_ptr<Object> stack_top = peek_stack_top();
-        if (stack_top != nullptr && stack_top->type != ObjectType::OBJ_NUMBER) {
-            runtime_error("Operand must be a number.");
-            return INTERPRET_RUNTIME_ERROR;
-        }
-        auto value = std::static_pointer_cast<NumberObject>(pop());
-        auto negated_value = std::make_shared<NumberObject>(-value->value);
-        push(negated_value);
-        break;
+    if (arg_count != 0) {
+        runtime_error("Expected 0 arguments but got " + std::to_string(arg_count) + ".");
+        return false;
     }
-    case OpCode::OP_PRINT: {
-        std::shared_ptr<StringObject> value = std::static_pointer_cast<StringObject>(pop());
-        println("{}", value->to_string());
-        println("");
-        break;
+    return true;
+}
+
+void VirtualMachine::count_miss(const InlineCache& cache) {
+    if (cache.megamorphic) {
+        m_inline_cache_stats.megamorphic++;
+    } else {
+        m_inline_cache_stats.misses++;
     }
-    case OpCode::OP_JUMP: {
-        u16 offset = read_short();
-        m_ip += offset;
-        break;
+}
+
+/*
+ * Reads the property of the instance on top of the stack by name, for reads
+ * whose inline cache has no entry for the instance's shape. What the lookup
+ * found is added to the cache.
+ */
+bool VirtualMachine::get_property(InlineCache& cache, const std::shared_ptr<StringObject>& name) {
+    count_miss(cache);
+    std::shared_ptr<Object>& receiver = m_stack[m_stack_top - 1];
+    auto& instance = static_cast<InstanceObject&>(*receiver);
+
+    // fields shadow methods
+    if (std::optional<u32> slot = instance.shape->find_slot(*name)) {
+        cache.add(InlineCacheEntry{instance.shape, slot.value(), nullptr, nullptr});
+        std::shared_ptr<Object> value = instance.fields[slot.value()];
+        receiver = std::move(value);
+        return true;
     }
-    case OpCode::OP_JUMP_IF_FALSE: {
-        u16 offset = read_short();
-        if (peek_stack_top()->is_falsey()) {
-            m_ip += offset;
-        }
-        break;
+
+    std::shared_ptr<Object> method;
+    if (!instance.klass->methods.get(name, method)) {
+        runtime_error("Undefined property '" + name->value + "'.");
+        return false;
     }
-    case OpCode::OP_LOOP: {
-        u16 offset = read_short();
-        m_ip -= offset;
-        break;
+    cache.add(InlineCacheEntry{instance.shape, 0, nullptr, method});
+    receiver = std::make_shared<BoundMethodObject>(receiver, std::move(method));
+    return true;
+}
+
+// Like get_property for the value on top of the stack and the instance below.
+void VirtualMachine::set_property(InlineCache& cache, const std::shared_ptr<StringObject>& name) {
+    count_miss(cache);
+    auto& instance = static_cast<InstanceObject&>(*m_stack[m_stack_top - 2]);
+    std::shared_ptr<Shape> shape = instance.shape;
+
+    if (std::optional<u32> slot = shape->find_slot(*name)) {
+        cache.add(InlineCacheEntry{std::move(shape), slot.value(), nullptr, nullptr});
+        instance.fields[slot.value()] = peek_stack_top();
+        return;
     }
-    case OpCode::OP_RETURN: {
-        // Exit virtual machine
-        return INTERPRET_OK;
+
+    std::shared_ptr<Shape> next = shape->transition(name);
+    instance.add_field(next, peek_stack_top());
+    cache.add(InlineCacheEntry{std::move(shape), static_cast<u32>(instance.fields.size() - 1), std::move(next), nullptr});
+}
+
+/*
+ * Calls the property of the instance below the arguments, for calls whose
+ * inline cache has no entry for the instance's shape. A method is called
+ * with the instance as `this`, a field holding a function replaces the
+ * instance and is called like any other value.
+ */
+bool VirtualMachine::invoke(InlineCache& cache, const std::shared_ptr<StringObject>& name, u8 arg_count) {
+    count_miss(cache);
+    std::shared_ptr<Object>& receiver = m_stack[m_stack_top - arg_count - 1];
+    auto& instance = static_cast<InstanceObject&>(*receiver);
+
+    if (std::optional<u32> slot = instance.shape->find_slot(*name)) {
+        cache.add(InlineCacheEntry{instance.shape, slot.value(), nullptr, nullptr});
+        std::shared_ptr<Object> callee = instance.fields[slot.value()];
+        receiver = callee;
+        return call_value(*callee, arg_count);
     }
-    default:
-        return INTERPRET_RUNTIME_ERROR;
+
+    std::shared_ptr<Object> method;
+    if (!instance.klass->methods.get(name, method)) {
+        runtime_error("Undefined property '" + name->value + "'.");
+        return false;
     }
-    return INTERPRET_OK;
+    cache.add(InlineCacheEntry{instance.shape, 0, nullptr, method});
+    return call_value(*method, arg_count);
 }
 
-usize VirtualMachine::get_ip() const {
-    return m_ip;
+// Calls a method of `klass` on the receiver below the arguments.
+bool VirtualMachine::invoke_from_class(ClassObject& klass, const std::shared_ptr<StringObject>& name, u8 arg_count) {
+    std::shared_ptr<Object> method;
+    if (!klass.methods.get(name, method)) {
+        runtime_error("Undefined property '" + name->value + "'.");
+        return false;
+    }
+    return call_value(*method, arg_count);
 }
 
-u8 VirtualMachine::read_byte() {
-    return m_chunk->get_code().at(m_ip++);
+/*
+ * Two closures capturing the same variable share its upvalue, so an open
+ * upvalue is reused if the slot already has one.
+ */
+std::shared_ptr<Upvalue> VirtualMachine::capture_upvalue(usize slot) {
+    auto it = m_open_upvalues.end();
+    while (it != m_open_upvalues.begin() && (*std::prev(it))->slot > slot) {
+        --it;
+    }
+    if (it != m_open_upvalues.begin() && (*std::prev(it))->slot == slot) {
+        return *std::prev(it);
+    }
+    return *m_open_upvalues.insert(it, std::make_shared<Upvalue>(slot));
 }
 
-u16 VirtualMachine::read_short() {
-    m_ip += 2;
-    return (m_chunk->get_code().at(m_ip - 2) << 8) | (m_chunk->get_code().at(m_ip - 1));
+// Moves the values of the slots from `last` up into their upvalues.
+void VirtualMachine::close_upvalues(usize last) {
+    while (!m_open_upvalues.empty() && m_open_upvalues.back()->slot >= last) {
+        Upvalue& upvalue = *m_open_upvalues.back();
+        upvalue.closed = m_stack[upvalue.slot];
+        upvalue.is_open = false;
+        m_open_upvalues.pop_back();
+    }
 }
 
-std::shared_ptr<Object> VirtualMachine::read_constant() {
-    return m_chunk->get_constants().get_values().at(read_byte());
+/*
+ * The dispatch loop. The state of the running frame is kept in locals and
+ * only written back to the frame when it calls, returns, fails or stops,
+ * a single step runs one instruction.
+ */
+template<bool k_single_step>
+InterpretResult VirtualMachine::execute() {
+    if (m_frame_count == 0) {
+        return INTERPRET_OK;
+    }
+
+    CallFrame* frame = nullptr;
+    const u8* ip = nullptr;
+    const u8* end = nullptr;
+    std::shared_ptr<Object>* slots = nullptr;
+    const std::shared_ptr<Object>* constants = nullptr;
+    InlineCache* caches = nullptr;
+    auto enter_frame = [&] {
+        frame = &m_frames[m_frame_count - 1];
+        ip = frame->ip;
+        end = frame->chunk->code().data() + frame->chunk->size();
+        slots = m_stack.data() + frame->slots;
+        constants = frame->chunk->get_constants().get_values().data();
+        caches = frame->chunk->inline_caches();
+    };
+    auto read_short = [&ip] {
+        ip += 2;
+        return static_cast<u16>((ip[-2] << 8) | ip[-1]);
+    };
+    // errors report the line of the instruction the frame is at
+    auto error = [&](const std::string& message) {
+        frame->ip = ip;
+        runtime_error(message);
+        reset_stack();
+        return INTERPRET_RUNTIME_ERROR;
+    };
+    // the handlers report type errors themselves, like `error` the stack is reset after them
+    auto binary_op = [&](InterpretResult (VirtualMachine::*op)()) {
+        frame->ip = ip;
+        if ((this->*op)() != INTERPRET_OK) {
+            reset_stack();
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        return INTERPRET_OK;
+    };
+    auto for_bound = [&](u8 flags, u8 bound) -> const std::shared_ptr<Object>& {
+        return (flags & ForLoopFlags::FOR_BOUND_CONSTANT) != 0 ? constants[bound] : slots[bound];
+    };
+    // a counting loop whose variable or bound is not a number evaluates its
+    // condition with the instructions it was compiled from, nothing after
+    // they failed
+    auto for_condition_slow = [&](u8 slot, u8 flags, u8 bound) -> std::optional<bool> {
+        push(slots[slot]);
+        push(for_bound(flags, bound));
+        u8 comparison = flags & ForLoopFlags::FOR_COMPARISON;
+        bool less = comparison == ForLoopFlags::FOR_LESS || comparison == ForLoopFlags::FOR_GREATER_EQUAL;
+        if (binary_op(less ? &VirtualMachine::binary_less_op : &VirtualMachine::binary_greater_op) != INTERPRET_OK) {
+            return std::nullopt;
+        }
+        if (comparison == ForLoopFlags::FOR_LESS_EQUAL || comparison == ForLoopFlags::FOR_GREATER_EQUAL) {
+            push(boolean(pop()->is_falsey()));
+        }
+        bool truthy = !peek_stack_top()->is_falsey();
+        pop();
+        return truthy;
+    };
+    enter_frame();
+
+    while (ip != end) {
+#ifdef DEBUG_TRACE_EXECUTION
+        // only `run` traces, as before frames: run_step is used on hand-built
+        // chunks whose constants and stack slots may be nullptr
+        if constexpr (!k_single_step) {
+            // the trace goes through std::cout, keep prints in between in order
+            m_output.flush();
+            for (usize i = 0; i < m_stack_top; i++) {
+                println("\t[ {} ]", m_stack[i]->to_string());
+            }
+            disassemble_instruction(*frame->chunk, static_cast<usize>(ip - frame->chunk->code().data()));
+        }
+#endif
+        switch (*ip++) {
+        case OpCode::OP_CONSTANT:
+            push(constants[*ip++]);
+            break;
+        case OpCode::OP_NIL:
+            push(std::make_shared<NullObject>());
+            break;
+        case OpCode::OP_TRUE:
+            push(m_true);
+            break;
+        case OpCode::OP_FALSE:
+            push(m_false);
+            break;
+        case OpCode::OP_POP:
+            pop();
+            break;
+        case OpCode::OP_GET_LOCAL:
+            // locals are the frame's stack slots, in the order the compiler declared them
+            push(slots[*ip++]);
+            break;
+        case OpCode::OP_SET_LOCAL:
+            slots[*ip++] = peek_stack_top();
+            break;
+        case OpCode::OP_GET_GLOBAL: {
+            std::shared_ptr<StringObject> name = std::static_pointer_cast<StringObject>(constants[*ip++]);
+            std::shared_ptr<Object> value;
+            if (!m_globals.get(name, value)) {
+                return error("Undefined variable '" + name->to_string() + "'.");
+            }
+            push(std::move(value));
+            break;
+        }
+        case OpCode::OP_DEFINE_GLOBAL: {
+            std::shared_ptr<StringObject> name = std::static_pointer_cast<StringObject>(constants[*ip++]);
+            m_globals.set(name, peek_stack_top());
+            pop();
+            break;
+        }
+        case OpCode::OP_SET_GLOBAL: {
+            std::shared_ptr<StringObject> name = std::static_pointer_cast<StringObject>(constants[*ip++]);
+            // when we set, we haven't defined it before
+            if (m_globals.set(name, peek_stack_top())) {
+                // delete old value for continuous use in repl
+                m_globals.del(name);
+                return error("Undefined variable '" + name->to_string() + "'.");
+            }
+            break;
+        }
+        case OpCode::OP_EQUAL: {
+            std::shared_ptr<Object> rhs = pop();
+            std::shared_ptr<Object> lhs = pop();
+            bool result = lhs->is_equal(*rhs);
+            push(boolean(result));
+            break;
+        }
+        case OpCode::OP_GREATER:
+            if (binary_op(&VirtualMachine::binary_greater_op) != INTERPRET_OK) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            break;
+        case OpCode::OP_LESS:
+            if (binary_op(&VirtualMachine::binary_less_op) != INTERPRET_OK) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            break;
+        case OpCode::OP_ADD: {
+            std::shared_ptr<Object> stack_top = peek_stack_top();
+            std::shared_ptr<Object> stack_top_prev = peek(1);
+            if (stack_top == nullptr || stack_top_prev == nullptr) {
+                return error("Operands are nil.");
+            }
+            if (stack_top->type == ObjectType::OBJ_STRING && stack_top_prev->type == ObjectType::OBJ_STRING) {
+                concatenate();
+            } else if (stack_top->type == ObjectType::OBJ_NUMBER && stack_top_prev->type == ObjectType::OBJ_NUMBER) {
+                if (binary_op(&VirtualMachine::binary_add_op) != INTERPRET_OK) {
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+            } else {
+                return error("Operands must be two numbers or two strings.");
+            }
+            break;
+        }
+        case OpCode::OP_SUBTRACT:
+            if (binary_op(&VirtualMachine::binary_subtract_op) != INTERPRET_OK) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            break;
+        case OpCode::OP_MULTIPLY:
+            if (binary_op(&VirtualMachine::binary_multiply_op) != INTERPRET_OK) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            break;
+        case OpCode::OP_DIVIDE:
+            if (binary_op(&VirtualMachine::binary_divide_op) != INTERPRET_OK) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            break;
+        case OpCode::OP_NOT:
+            push(boolean(pop()->is_falsey()));
+            break;
+        case OpCode::OP_NEGATE: {
+            std::shared_ptr<Object> stack_top = peek_stack_top();
+            if (stack_top != nullptr && stack_top->type != ObjectType::OBJ_NUMBER) {
+                return error("Operand must be a number.");
+            }
+            auto value = std::static_pointer_cast<NumberObject>(pop());
+            push(number(-value->value));
+            break;
+        }
+        case OpCode::OP_PRINT: {
+            std::shared_ptr<Object> value = pop();
+            if (value->type == ObjectType::OBJ_NUMBER) {
+                m_output.write_number(static_cast<const NumberObject&>(*value).value);
+            } else if (value->type == ObjectType::OBJ_STRING) {
+                m_output.write(static_cast<const StringObject&>(*value).value);
+            } else {
+                m_output.write(value->to_string());
+            }
+            m_output.write("\n\n");
+            break;
+        }
+        case OpCode::OP_JUMP: {
+            u16 offset = read_short();
+            ip += offset;
+            break;
+        }
+        case OpCode::OP_JUMP_IF_FALSE: {
+            u16 offset = read_short();
+            if (peek_stack_top()->is_falsey()) {
+                ip += offset;
+            }
+            break;
+        }
+        case OpCode::OP_LOOP: {
+            u16 offset = read_short();
+            ip -= offset;
+            break;
+        }
+        case OpCode::OP_FOR_PREP: {
+            u8 slot = *ip++;
+            u8 flags = *ip++;
+            u8 bound_index = *ip++;
+            u16 offset = read_short();
+            const Object& counter = *slots[slot];
+            const Object& bound = *for_bound(flags, bound_index);
+            bool enter = false;
+            if (counter.type == ObjectType::OBJ_NUMBER && bound.type == ObjectType::OBJ_NUMBER) {
+                enter = for_condition(flags, static_cast<const NumberObject&>(counter).value, static_cast<const NumberObject&>(bound).value);
+            } else if (std::optional<bool> condition = for_condition_slow(slot, flags, bound_index)) {
+                enter = condition.value();
+            } else {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            if (!enter) {
+                ip += offset;
+            }
+            break;
+        }
+        case OpCode::OP_FOR_LOOP: {
+            u8 slot = *ip++;
+            u8 flags = *ip++;
+            u8 bound_index = *ip++;
+            const std::shared_ptr<Object>& step = constants[*ip++];
+            u16 offset = read_short();
+            std::shared_ptr<Object>& counter = slots[slot];
+            const Object& bound = *for_bound(flags, bound_index);
+            if (counter->type == ObjectType::OBJ_NUMBER && bound.type == ObjectType::OBJ_NUMBER) {
+                double value = static_cast<const NumberObject&>(*counter).value;
+                double step_value = static_cast<const NumberObject&>(*step).value;
+                value = (flags & ForLoopFlags::FOR_SUBTRACT) != 0 ? value - step_value : value + step_value;
+                // nothing else can see a number only the loop variable holds
+                if (counter.use_count() == 1) {
+                    static_cast<NumberObject&>(*counter).value = value;
+                } else {
+                    counter = number(value);
+                }
+                if (for_condition(flags, value, static_cast<const NumberObject&>(bound).value)) {
+                    ip -= offset;
+                }
+                break;
+            }
+
+            // `i = i + step;` as compiled, then the condition
+            push(counter);
+            push(step);
+            if (counter->type != ObjectType::OBJ_NUMBER && (flags & ForLoopFlags::FOR_SUBTRACT) == 0) {
+                return error("Operands must be two numbers or two strings.");
+            }
+            if (binary_op((flags & ForLoopFlags::FOR_SUBTRACT) != 0 ? &VirtualMachine::binary_subtract_op : &VirtualMachine::binary_add_op) != INTERPRET_OK) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            slots[slot] = peek_stack_top();
+            pop();
+            std::optional<bool> condition = for_condition_slow(slot, flags, bound_index);
+            if (!condition) {
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            if (condition.value()) {
+                ip -= offset;
+            }
+            break;
+        }
+        case OpCode::OP_GET_UPVALUE: {
+            const Upvalue& upvalue = *frame->closure->upvalues[*ip++];
+            push(upvalue.is_open ? m_stack[upvalue.slot] : upvalue.closed);
+            break;
+        }
+        case OpCode::OP_SET_UPVALUE: {
+            Upvalue& upvalue = *frame->closure->upvalues[*ip++];
+            (upvalue.is_open ? m_stack[upvalue.slot] : upvalue.closed) = peek_stack_top();
+            break;
+        }
+        case OpCode::OP_CLOSURE: {
+            auto closure = std::make_shared<ClosureObject>(std::static_pointer_cast<FunctionObject>(constants[*ip++]));
+            u8 upvalue_count = *ip++;
+            closure->upvalues.reserve(upvalue_count);
+            for (u8 i = 0; i < upvalue_count; i++) {
+                u8 is_local = *ip++;
+                u8 index = *ip++;
+                if (is_local != 0) {
+                    closure->upvalues.emplace_back(capture_upvalue(frame->slots + index));
+                } else {
+                    closure->upvalues.emplace_back(frame->closure->upvalues[index]);
+                }
+            }
+            push(std::move(closure));
+            break;
+        }
+        case OpCode::OP_CLOSE_UPVALUE:
+            close_upvalues(m_stack_top - 1);
+            pop();
+            break;
+        case OpCode::OP_CLASS:
+            push(std::make_shared<ClassObject>(static_cast<const StringObject&>(*constants[*ip++]).value));
+            break;
+        case OpCode::OP_METHOD: {
+            auto& klass = static_cast<ClassObject&>(*peek(1));
+            klass.methods.set(std::static_pointer_cast<StringObject>(constants[*ip++]), peek_stack_top());
+            pop();
+            break;
+        }
+        case OpCode::OP_GET_PROPERTY: {
+            const std::shared_ptr<Object>& name = constants[*ip++];
+            InlineCache& cache = caches[read_short()];
+            std::shared_ptr<Object>& receiver = m_stack[m_stack_top - 1];
+            if (receiver->type != ObjectType::OBJ_INSTANCE) {
+                return error("Only instances have properties.");
+            }
+
+            const auto& instance = static_cast<const InstanceObject&>(*receiver);
+            if (const InlineCacheEntry* entry = cache.find(instance.shape.get())) {
+                m_inline_cache_stats.hits++;
+                if (entry->method == nullptr) {
+                    std::shared_ptr<Object> value = instance.fields[entry->slot];
+                    receiver = std::move(value);
+                } else {
+                    receiver = std::make_shared<BoundMethodObject>(receiver, entry->method);
+                }
+                break;
+            }
+            frame->ip = ip;
+            if (!get_property(cache, std::static_pointer_cast<StringObject>(name))) {
+                reset_stack();
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            break;
+        }
+        case OpCode::OP_SET_PROPERTY: {
+            const std::shared_ptr<Object>& name = constants[*ip++];
+            InlineCache& cache = caches[read_short()];
+            std::shared_ptr<Object>& target = m_stack[m_stack_top - 2];
+            if (target->type != ObjectType::OBJ_INSTANCE) {
+                return error("Only instances have fields.");
+            }
+
+            auto& instance = static_cast<InstanceObject&>(*target);
+            if (const InlineCacheEntry* entry = cache.find(instance.shape.get())) {
+                m_inline_cache_stats.hits++;
+                if (entry->transition == nullptr) {
+                    instance.fields[entry->slot] = peek_stack_top();
+                } else {
+                    instance.add_field(entry->transition, peek_stack_top());
+                }
+            } else {
+                set_property(cache, std::static_pointer_cast<StringObject>(name));
+            }
+            // the assigned value is the result
+            target = pop();
+            break;
+        }
+        case OpCode::OP_INVOKE: {
+            const std::shared_ptr<Object>& name = constants[*ip++];
+            InlineCache& cache = caches[read_short()];
+            u8 arg_count = *ip++;
+            std::shared_ptr<Object>& receiver = m_stack[m_stack_top - arg_count - 1];
+            if (receiver->type != ObjectType::OBJ_INSTANCE) {
+                return error("Only instances have methods.");
+            }
+
+            frame->ip = ip;
+            const auto& instance = static_cast<const InstanceObject&>(*receiver);
+            bool called = false;
+            if (const InlineCacheEntry* entry = cache.find(instance.shape.get())) {
+                m_inline_cache_stats.hits++;
+                if (entry->method != nullptr) {
+                    called = call_value(*entry->method, arg_count);
+                } else {
+                    std::shared_ptr<Object> callee = instance.fields[entry->slot];
+                    receiver = callee;
+                    called = call_value(*callee, arg_count);
+                }
+            } else {
+                called = invoke(cache, std::static_pointer_cast<StringObject>(name), arg_count);
+            }
+            if (!called) {
+                reset_stack();
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            enter_frame();
+            break;
+        }
+        case OpCode::OP_BUILD_LIST: {
+            u8 count = *ip++;
+            auto first = std::make_move_iterator(m_stack.begin() + static_cast<std::ptrdiff_t>(m_stack_top - count));
+            auto list = std::make_shared<ListObject>(std::vector<std::shared_ptr<Object>>(first, first + count));
+            m_stack_top -= count;
+            push(std::move(list));
+            break;
+        }
+        case OpCode::OP_GET_INDEX: {
+            std::shared_ptr<Object>& target = m_stack[m_stack_top - 2];
+            const Object& index = *m_stack[m_stack_top - 1];
+            if (const char* message = index_error(*target, index)) {
+                return error(message);
+            }
+
+            const auto& list = static_cast<const ListObject&>(*target);
+            auto element = static_cast<usize>(static_cast<const NumberObject&>(index).value);
+            // packed elements are boxed like any other arithmetic result
+            std::shared_ptr<Object> value = list.packed ? number(list.numbers[element]) : list.values[element];
+            m_stack_top--;
+            target = std::move(value);
+            break;
+        }
+        case OpCode::OP_SET_INDEX: {
+            std::shared_ptr<Object>& target = m_stack[m_stack_top - 3];
+            const Object& index = *m_stack[m_stack_top - 2];
+            std::shared_ptr<Object>& value = m_stack[m_stack_top - 1];
+            if (const char* message = index_error(*target, index)) {
+                return error(message);
+            }
+
+            auto& list = static_cast<ListObject&>(*target);
+            auto element = static_cast<usize>(static_cast<const NumberObject&>(index).value);
+            list.set(element, value);
+            // the assigned value is the result
+            m_stack_top -= 2;
+            target = std::move(value);
+            break;
+        }
+        case OpCode::OP_INHERIT: {
+            std::shared_ptr<Object> superclass = peek(1);
+            if (superclass->type != ObjectType::OBJ_CLASS) {
+                return error("Superclass must be a class.");
+            }
+
+            auto& subclass = static_cast<ClassObject&>(*peek_stack_top());
+            static_cast<ClassObject&>(*superclass).methods.add_all(subclass.methods);
+            // instances of both are likely to get the same fields
+            subclass.field_capacity = static_cast<ClassObject&>(*superclass).field_capacity;
+            pop();
+            break;
+        }
+        case OpCode::OP_GET_SUPER: {
+            auto name = std::static_pointer_cast<StringObject>(constants[*ip++]);
+            std::shared_ptr<Object> superclass = pop();
+            std::shared_ptr<Object> method;
+            if (!static_cast<ClassObject&>(*superclass).methods.get(name, method)) {
+                return error("Undefined property '" + name->value + "'.");
+            }
+
+            std::shared_ptr<Object>& receiver = m_stack[m_stack_top - 1];
+            receiver = std::make_shared<BoundMethodObject>(receiver, std::move(method));
+            break;
+        }
+        case OpCode::OP_SUPER_INVOKE: {
+            auto name = std::static_pointer_cast<StringObject>(constants[*ip++]);
+            u8 arg_count = *ip++;
+            std::shared_ptr<Object> superclass = pop();
+            frame->ip = ip;
+            if (!invoke_from_class(static_cast<ClassObject&>(*superclass), name, arg_count)) {
+                reset_stack();
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            enter_frame();
+            break;
+        }
+        case OpCode::OP_CALL: {
+            u8 arg_count = *ip++;
+            frame->ip = ip;
+            if (!call_value(*peek(arg_count), arg_count)) {
+                reset_stack();
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            enter_frame();
+            break;
+        }
+        /*
+         * The returning frame is gone before the call: the callee and its
+         * arguments are moved down into its window and the new frame takes
+         * its place, so recursion through tail calls runs in constant frame
+         * space. A call that pushes no frame leaves its result right where
+         * the caller expects the returned value.
+         */
+        case OpCode::OP_TAIL_CALL: {
+            u8 arg_count = *ip++;
+            frame->ip = ip;
+            if (m_tail_calls && frame->function != nullptr) {
+                close_upvalues(frame->slots);
+                usize callee = m_stack_top - arg_count - 1;
+                std::move(m_stack.begin() + callee, m_stack.begin() + m_stack_top, m_stack.begin() + frame->slots);
+                m_stack_top = frame->slots + arg_count + 1;
+                m_frame_count--;
+            }
+            if (!call_value(*peek(arg_count), arg_count)) {
+                reset_stack();
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            if (m_frame_count == m_host_frames) {
+                return INTERPRET_OK;
+            }
+            enter_frame();
+            break;
+        }
+        case OpCode::OP_RETURN: {
+            if (frame->function == nullptr) {
+                // Exit virtual machine
+                frame->ip = ip;
+                return INTERPRET_OK;
+            }
+            // the result replaces the callee, its arguments and locals
+            std::shared_ptr<Object> result = pop();
+            close_upvalues(frame->slots);
+            m_stack_top = frame->slots;
+            push(std::move(result));
+            m_frame_count--;
+            if (m_frame_count == m_host_frames) {
+                return INTERPRET_OK;
+            }
+            enter_frame();
+            break;
+        }
+        default:
+            frame->ip = ip;
+            return INTERPRET_RUNTIME_ERROR;
+        }
+
+        if constexpr (k_single_step) {
+            break;
+        }
+    }
+
+    frame->ip = ip;
+    return INTERPRET_OK;
+}
+
+usize VirtualMachine::get_ip() const {
+    if (m_frame_count == 0) {
+        return 0;
+    }
+    const CallFrame& frame = m_frames[m_frame_count - 1];
+    return static_cast<usize>(frame.ip - frame.chunk->code().data());
 }
 
 void VirtualMachine::push(std::shared_ptr<Object> value) {
@@ -235,10 +969,51 @@ std::shared_ptr<Object> VirtualMachine::pop() {
     return m_stack[m_stack_top];
 }
 
+// Reports the error with a trace of the active calls, innermost first.
 void VirtualMachine::runtime_error(const std::string& message) {
+    m_output.flush();
     print_err("{}", message);
-    usize line = m_chunk->get_lines().at(m_ip);
-    println_err("[line {}] in script", line);
+    for (usize i = m_frame_count; i-- > 0;) {
+        const CallFrame& frame = m_frames[i];
+        // the instruction that failed or called is the one before ip
+        usize offset = static_cast<usize>(frame.ip - frame.chunk->code().data());
+        usize line = frame.chunk->line_at(offset == 0 ? 0 : offset - 1);
+        if (frame.function == nullptr) {
+            println_err("[line {}] in script", line);
+        } else {
+            println_err("[line {}] in {}()", line, frame.function->name);
+        }
+    }
+}
+
+// Abandons the active calls after a runtime error.
+void VirtualMachine::reset_stack() {
+    close_upvalues(0);
+    m_frame_count = 0;
+    m_stack_top = 0;
+}
+
+/*
+ * Loop counters, indexes and most other arithmetic produce small integers,
+ * which are looked up instead of allocated. -0 is not an integer here, it
+ * prints differently from 0.
+ */
+inline std::shared_ptr<Object> VirtualMachine::number(double value) {
+    if (value >= k_min_small_integer && value <= k_max_small_integer) {
+        auto integer = static_cast<i64>(value);
+        if (static_cast<double>(integer) == value && !(value == 0 && std::signbit(value))) {
+            std::shared_ptr<Object>& shared = m_small_integers[integer - k_min_small_integer];
+            if (shared == nullptr) {
+                shared = std::make_shared<NumberObject>(value);
+            }
+            return shared;
+        }
+    }
+    return std::make_shared<NumberObject>(value);
+}
+
+inline const std::shared_ptr<Object>& VirtualMachine::boolean(bool value) const {
+    return value ? m_true : m_false;
 }
 
 inline void VirtualMachine::concatenate() {
@@ -251,11 +1026,7 @@ inline void VirtualMachine::concatenate() {
 inline InterpretResult VirtualMachine::pop_binary_operands(double& out_lhs, double& out_rhs) {
     const auto rhs = pop();
     const auto lhs = pop();
-    if (lhs == nullptr || rhs == nullptr) {
-        return INTERPRET_RUNTIME_ERROR;
-    }
-
-    if (!(lhs->type == ObjectType::OBJ_NUMBER) || !(rhs->type == ObjectType::OBJ_NUMBER)) {
+    if (lhs == nullptr || rhs == nullptr || lhs->type != ObjectType::OBJ_NUMBER || rhs->type != ObjectType::OBJ_NUMBER) {
         runtime_error("Operands must be numbers.");
         return INTERPRET_RUNTIME_ERROR;
     }
@@ -272,7 +1043,7 @@ inline InterpretResult VirtualMachine::binary_add_op() {
     if (result != INTERPRET_OK) {
         return result;
     }
-    push(std::make_shared<NumberObject>(lhs + rhs));
+    push(number(lhs + rhs));
     return INTERPRET_OK;
 }
 
@@ -283,7 +1054,7 @@ inline InterpretResult VirtualMachine::binary_subtract_op() {
     if (result != INTERPRET_OK) {
         return result;
     }
-    push(std::make_shared<NumberObject>(lhs - rhs));
+    push(number(lhs - rhs));
     return INTERPRET_OK;
 }
 
@@ -294,7 +1065,7 @@ inline InterpretResult VirtualMachine::binary_multiply_op() {
     if (result != INTERPRET_OK) {
         return result;
     }
-    push(std::make_shared<NumberObject>(lhs * rhs));
+    push(number(lhs * rhs));
     return INTERPRET_OK;
 }
 
@@ -305,7 +1076,7 @@ inline InterpretResult VirtualMachine::binary_divide_op() {
     if (result != INTERPRET_OK) {
         return result;
     }
-    push(std::make_shared<NumberObject>(lhs / rhs));
+    push(number(lhs / rhs));
     return INTERPRET_OK;
 }
 
@@ -316,7 +1087,7 @@ inline InterpretResult VirtualMachine::binary_greater_op() {
     if (result != INTERPRET_OK) {
         return result;
     }
-    push(std::make_shared<BooleanObject>(lhs > rhs));
+    push(boolean(lhs > rhs));
     return INTERPRET_OK;
 }
 
@@ -327,7 +1098,7 @@ inline InterpretResult VirtualMachine::binary_less_op() {
     if (result != INTERPRET_OK) {
         return result;
     }
-    push(std::make_shared<BooleanObject>(lhs < rhs));
+    push(boolean(lhs < rhs));
     return INTERPRET_OK;
 }
 
@@ -1,31 +1,67 @@
 #pragma once
 
+#include "binding.h"
 #include "common.h"
+#include "object.h"
+#include "output.h"
 #include "table.h"
 #include "value.h"
 
 #include <array>
 #include <memory>
-
-namespace object {
-class Object;
-} // namespace object
+#include <optional>
+#include <span>
+#include <string_view>
+#include <vector>
 
 namespace chunk {
 class Chunk;
+struct InlineCache;
 } // namespace chunk
 
 namespace vm {
 
+// Stack slots a virtual machine may use unless configured otherwise.
+constexpr usize k_default_max_stack = 1 << 20;
+// Calls that may be active at once, the frames are allocated up front.
+constexpr usize k_max_frames = 1024;
+// Integral results in this range are shared instead of allocated, see VirtualMachine::number.
+constexpr i64 k_min_small_integer = -1024;
+constexpr i64 k_max_small_integer = 16383;
+
+// Counters of the inline caches of property instructions, see chunk::InlineCache.
+struct InlineCacheStats {
+    u64 hits{0};
+    u64 misses{0};
+    // lookups of instructions that saw too many shapes to cache them
+    u64 megamorphic{0};
+};
+
 enum InterpretResult {
     INTERPRET_OK,
     INTERPRET_COMPILE_ERROR,
     INTERPRET_RUNTIME_ERROR
 };
 
+/*
+ * A running function. Its slots start at the callee, followed by the
+ * arguments and the locals, all in place on the value stack. `slots` is an
+ * index rather than a pointer since the stack moves when it grows, the
+ * dispatch loop keeps the pointer and `ip` in locals while it runs.
+ */
+struct CallFrame {
+    // nullptr for the script
+    const object::FunctionObject* function;
+    // nullptr unless the function captured variables
+    const object::ClosureObject* closure;
+    const chunk::Chunk* chunk;
+    const u8* ip;
+    usize slots;
+};
+
 class VirtualMachine {
 public:
-    VirtualMachine() = default;
+    VirtualMachine();
     explicit VirtualMachine(std::unique_ptr<chunk::Chunk> chunk);
     InterpretResult run();
     InterpretResult run_step();
@@ -34,14 +70,49 @@ public:
     std::shared_ptr<object::Object> peek_stack_top() const;
     std::shared_ptr<object::Object> peek(usize n) const;
     void reset();
+    // What scripts print, flush it before leaving through exit().
+    [[nodiscard]] output::Sink& get_output();
+    // Running code that needs more stack slots fails with "Stack overflow".
+    void set_max_stack(usize slots);
+    // Without tail calls OP_TAIL_CALL keeps the returning frame, so it shows
+    // up in stack traces, and runs like OP_CALL followed by OP_RETURN.
+    void set_tail_calls(bool enabled);
+    [[nodiscard]] const InlineCacheStats& get_inline_cache_stats() const;
+    // Makes a C++ function callable from scripts as the global `name`.
+    void define_native(std::string_view name, u8 arity, object::NativeFn function);
+    // Like define_native for a plain C++ function, `vm.bind<&f>("f")`. The
+    // argument and result types are taken from its signature, see binding.h.
+    template<auto k_function>
+    void bind(std::string_view name);
+    // Calls the global function `name` of a loaded script, `vm.call<double>("f", 1, 2)`.
+    // Nothing after a runtime error or when the result is not an R.
+    template<typename R = std::shared_ptr<object::Object>, typename... Args>
+    std::optional<R> call(std::string_view name, const Args&... args);
+    // Like call with boxed arguments, nullptr after a runtime error.
+    std::shared_ptr<object::Object> call_global(std::string_view name, std::span<const std::shared_ptr<object::Object>> args);
 
 private:
-    u8 read_byte();
-    u16 read_short();
-    std::shared_ptr<object::Object> read_constant();
+    template<bool k_single_step>
+    InterpretResult execute();
+    bool call_value(const object::Object& callee, u8 arg_count);
+    bool call_class(u8 arg_count);
+    bool call_native(const object::NativeObject& native, u8 arg_count);
+    bool get_property(chunk::InlineCache& cache, const std::shared_ptr<object::StringObject>& name);
+    void set_property(chunk::InlineCache& cache, const std::shared_ptr<object::StringObject>& name);
+    bool invoke(chunk::InlineCache& cache, const std::shared_ptr<object::StringObject>& name, u8 arg_count);
+    bool invoke_from_class(object::ClassObject& klass, const std::shared_ptr<object::StringObject>& name, u8 arg_count);
+    void count_miss(const chunk::InlineCache& cache);
+    std::shared_ptr<object::Upvalue> capture_upvalue(usize slot);
+    void close_upvalues(usize last);
+    void prepare_functions(const chunk::Chunk& chunk);
+    void define_builtins();
     void push(std::shared_ptr<object::Object> value);
     std::shared_ptr<object::Object> pop();
     void runtime_error(const std::string& message);
+    void reset_stack();
+    bool reserve_stack(usize depth);
+    inline std::shared_ptr<object::Object> number(double value);
+    [[nodiscard]] inline const std::shared_ptr<object::Object>& boolean(bool value) const;
 
     inline void concatenate();
     inline InterpretResult pop_binary_operands(double& lhs, double& rhs);
@@ -53,11 +124,51 @@ private:
     inline InterpretResult binary_less_op();
 
     std::shared_ptr<const chunk::Chunk> m_chunk;
-    usize m_ip;
+    std::vector<CallFrame> m_frames = std::vector<CallFrame>(k_max_frames);
+    usize m_frame_count{0};
+    // upvalues still referring to a stack slot, sorted by slot with the
+    // highest last, where locals go out of scope first
+    std::vector<std::shared_ptr<object::Upvalue>> m_open_upvalues;
     table::Table m_strings;
     table::Table m_globals;
-    u8 m_stack_top;
-    std::array<std::shared_ptr<object::Object>, UINT8_COUNT> m_stack;
+    // name of the method called on new instances
+    std::shared_ptr<object::StringObject> m_init_string;
+    // created on first use, numbers are never changed while they are shared
+    std::vector<std::shared_ptr<object::Object>> m_small_integers = std::vector<std::shared_ptr<object::Object>>(k_max_small_integer - k_min_small_integer + 1);
+    std::shared_ptr<object::Object> m_true = std::make_shared<object::BooleanObject>(true);
+    std::shared_ptr<object::Object> m_false = std::make_shared<object::BooleanObject>(false);
+    /*
+     * Pushes do not check the stack size. Instead the stack is grown before a
+     * chunk runs and on every call to hold the deepest stack the code can
+     * reach, see Chunk::max_stack_depth.
+     */
+    usize m_stack_top{0};
+    std::vector<std::shared_ptr<object::Object>> m_stack;
+    usize m_max_stack{k_default_max_stack};
+    bool m_stack_overflow{false};
+    bool m_tail_calls{true};
+    // frames active when C++ called into a script, execution returns to it
+    // when only these are left, see call_global
+    usize m_host_frames{0};
+    output::Sink m_output;
+    InlineCacheStats m_inline_cache_stats;
 };
 
+template<auto k_function>
+void VirtualMachine::bind(std::string_view name) {
+    static_assert(binding::arity(k_function) <= UINT8_MAX, "natives take at most 255 arguments");
+    define_native(name, static_cast<u8>(binding::arity(k_function)), &binding::native<k_function>);
+}
+
+template<typename R, typename... Args>
+std::optional<R> VirtualMachine::call(std::string_view name, const Args&... args) {
+    static_assert(!std::is_same_v<R, std::string_view>, "the result does not outlive the call, use std::string");
+    std::array<std::shared_ptr<object::Object>, sizeof...(Args)> values{binding::ConverterFor<const Args&>::to(args)...};
+    std::shared_ptr<object::Object> result = call_global(name, values);
+    if (result == nullptr || !binding::ConverterFor<R>::is(result)) {
+        return std::nullopt;
+    }
+    return binding::ConverterFor<R>::from(result);
+}
+
 } // namespace vm
@@ -0,0 +1,19 @@
+# Runs SCRIPT through the interpreter and through its ahead-of-time compiled
+# executable, failing if stdout or the exit code differ.
+#
+# usage: cmake -DINTERPRETER=... -DAOT_EXECUTABLE=... -DSCRIPT=... -P aot_diff.cmake
+
+execute_process(COMMAND ${INTERPRETER} ${SCRIPT}
+        OUTPUT_VARIABLE interpreter_output
+        RESULT_VARIABLE interpreter_result)
+execute_process(COMMAND ${AOT_EXECUTABLE}
+        OUTPUT_VARIABLE aot_output
+        RESULT_VARIABLE aot_result)
+
+if (NOT interpreter_result STREQUAL aot_result)
+    message(FATAL_ERROR "Exit code mismatch for ${SCRIPT}: interpreter ${interpreter_result}, aot ${aot_result}")
+endif ()
+
+if (NOT interpreter_output STREQUAL aot_output)
+    message(FATAL_ERROR "Output mismatch for ${SCRIPT}\n--- interpreter\n${interpreter_output}\n--- aot\n${aot_output}")
+endif ()
@@ -0,0 +1,114 @@
+#include "cache.h"
+#include "chunk.h"
+#include "common.h"
+#include "object.h"
+#include <algorithm>
+#include <cstdio>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <memory>
+#include <string>
+
+using namespace chunk;
+using namespace object;
+
+class CacheTest : public ::testing::Test {
+protected:
+    static Chunk sample_chunk() {
+        Chunk chunk;
+        std::shared_ptr<Object> constants[] = {
+            std::make_shared<NumberObject>(1.5),
+            std::make_shared<StringObject>("hello"),
+            std::make_shared<BooleanObject>(true),
+            std::make_shared<NullObject>()};
+        for (usize i = 0; i < 4; i++) {
+            usize constant_idx = chunk.write_constant(constants[i]);
+            chunk.write_byte(OpCode::OP_CONSTANT, 1);
+            chunk.write_byte(constant_idx, 1);
+            chunk.write_byte(OpCode::OP_PRINT, i + 2);
+        }
+        chunk.write_byte(OpCode::OP_RETURN, 300);
+        return chunk;
+    }
+
+    static void expect_equal(const Chunk& lhs, const Chunk& rhs) {
+        EXPECT_EQ(lhs.get_code(), rhs.get_code());
+        EXPECT_TRUE(std::ranges::equal(lhs.get_line_runs(), rhs.get_line_runs()));
+        ASSERT_EQ(lhs.get_constants().size(), rhs.get_constants().size());
+        for (usize i = 0; i < lhs.get_constants().size(); i++) {
+            const Object& expected = *lhs.get_constants().get_values()[i];
+            const Object& actual = *rhs.get_constants().get_values()[i];
+            EXPECT_EQ(expected.type, actual.type);
+            EXPECT_TRUE(expected.is_equal(actual));
+        }
+        EXPECT_EQ(lhs.inline_cache_count(), rhs.inline_cache_count());
+    }
+
+    const cache::Key m_key = cache::make_key("print 1.5;", true);
+};
+
+TEST_F(CacheTest, test_round_trip) {
+    Chunk chunk = sample_chunk();
+    std::shared_ptr<Chunk> loaded = cache::deserialize(cache::serialize(chunk, m_key), m_key);
+    ASSERT_NE(loaded, nullptr);
+    expect_equal(chunk, *loaded);
+}
+
+TEST_F(CacheTest, test_functions) {
+    auto body = std::make_shared<Chunk>(sample_chunk());
+    auto inner = std::make_shared<Chunk>(sample_chunk());
+    inner->add_inline_cache();
+    inner->add_inline_cache();
+    (void)body->write_constant(std::make_shared<FunctionObject>("inner", 0, inner));
+    Chunk chunk = sample_chunk();
+    (void)chunk.write_constant(std::make_shared<FunctionObject>("outer", 3, body));
+
+    std::shared_ptr<Chunk> loaded = cache::deserialize(cache::serialize(chunk, m_key), m_key);
+    ASSERT_NE(loaded, nullptr);
+    const auto& outer = static_cast<const FunctionObject&>(*loaded->get_constants().get_values().back());
+    ASSERT_EQ(outer.type, ObjectType::OBJ_FUNCTION);
+    EXPECT_EQ(outer.name, "outer");
+    EXPECT_EQ(outer.arity, 3);
+    const auto& loaded_inner = static_cast<const FunctionObject&>(*outer.chunk->get_constants().get_values().back());
+    ASSERT_EQ(loaded_inner.type, ObjectType::OBJ_FUNCTION);
+    EXPECT_EQ(loaded_inner.name, "inner");
+    expect_equal(*inner, *loaded_inner.chunk);
+}
+
+TEST_F(CacheTest, test_key_mismatch) {
+    std::string data = cache::serialize(sample_chunk(), m_key);
+    EXPECT_EQ(cache::deserialize(data, cache::make_key("print 2.5;", true)), nullptr);
+    EXPECT_EQ(cache::deserialize(data, cache::make_key("print 1.5;", false)), nullptr);
+}
+
+TEST_F(CacheTest, test_corrupt_data) {
+    std::string data = cache::serialize(sample_chunk(), m_key);
+    for (usize size = 0; size < data.size(); size++) {
+        EXPECT_EQ(cache::deserialize(data.substr(0, size), m_key), nullptr);
+    }
+    EXPECT_EQ(cache::deserialize(data + "x", m_key), nullptr);
+}
+
+TEST_F(CacheTest, test_store_and_load) {
+    std::string path = testing::TempDir() + "cache_test/script.loxc";
+    Chunk chunk = sample_chunk();
+    ASSERT_TRUE(cache::store(path, chunk, m_key));
+
+    std::shared_ptr<Chunk> loaded = cache::load(path, m_key);
+    std::remove(path.c_str());
+    ASSERT_NE(loaded, nullptr);
+    expect_equal(chunk, *loaded);
+}
+
+TEST_F(CacheTest, test_cache_path) {
+    EXPECT_EQ(cache::cache_path("scripts/main.lox", ""), "scripts/main.loxc");
+    std::string in_dir = cache::cache_path("scripts/main.lox", "/tmp/lox");
+    EXPECT_TRUE(in_dir.starts_with("/tmp/lox/"));
+    EXPECT_TRUE(in_dir.ends_with(".loxc"));
+    EXPECT_NE(in_dir, cache::cache_path("scripts/other.lox", "/tmp/lox"));
+}
+
+int main(int argc, char* argv[]) {
+    ::testing::InitGoogleMock(&argc, argv);
+    return RUN_ALL_TESTS();
+}
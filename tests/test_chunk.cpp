@@ -4,8 +4,11 @@
 #include "value.h"
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
+#include <iterator>
 #include <memory>
+#include <optional>
 #include <variant>
+#include <vector>
 
 using ::testing::ContainerEq;
 
@@ -16,11 +19,23 @@ TEST(Chunk, test_write_byte) {
     std::vector<u8> code{
         chunk::OpCode::OP_RETURN,
         chunk::OpCode::OP_RETURN};
-    std::vector<usize> lines{
-        123,
-        321};
     EXPECT_THAT(chunk.get_code(), ContainerEq(code));
-    EXPECT_THAT(chunk.get_lines(), ContainerEq(lines));
+    EXPECT_EQ(chunk.line_at(0), 123);
+    EXPECT_EQ(chunk.line_at(1), 321);
+}
+
+TEST(Chunk, test_line_runs) {
+    chunk::Chunk chunk;
+    usize lines[] = {1, 1, 1, 2, 2, 5, 1, 1};
+    for (usize line : lines) {
+        chunk.write_byte(chunk::OpCode::OP_POP, line);
+    }
+
+    std::vector<chunk::LineRun> runs{{0, 1}, {3, 2}, {5, 5}, {6, 1}};
+    EXPECT_THAT(std::vector<chunk::LineRun>(chunk.get_line_runs().begin(), chunk.get_line_runs().end()), ContainerEq(runs));
+    for (usize offset = 0; offset < std::size(lines); offset++) {
+        EXPECT_EQ(chunk.line_at(offset), lines[offset]);
+    }
 }
 
 TEST(Chunk, test_write_constant) {
@@ -36,6 +51,49 @@ TEST(Chunk, test_write_constant) {
     EXPECT_EQ(result->value, constant_value);
 }
 
+TEST(Chunk, test_max_stack_depth) {
+    chunk::Chunk chunk;
+    // true and (nil == nil), both paths reach the end with one value
+    chunk.write_byte(chunk::OpCode::OP_TRUE, 1);
+    chunk.write_byte(chunk::OpCode::OP_JUMP_IF_FALSE, 1);
+    chunk.write_byte(0, 1);
+    chunk.write_byte(4, 1);
+    chunk.write_byte(chunk::OpCode::OP_POP, 1);
+    chunk.write_byte(chunk::OpCode::OP_NIL, 1);
+    chunk.write_byte(chunk::OpCode::OP_NIL, 1);
+    chunk.write_byte(chunk::OpCode::OP_EQUAL, 1);
+    chunk.write_byte(chunk::OpCode::OP_RETURN, 1);
+    EXPECT_EQ(chunk.max_stack_depth(), 2);
+
+    chunk::Chunk call;
+    // the callee and its two arguments are replaced by the result
+    call.write_byte(chunk::OpCode::OP_NIL, 1);
+    call.write_byte(chunk::OpCode::OP_TRUE, 1);
+    call.write_byte(chunk::OpCode::OP_TRUE, 1);
+    call.write_byte(chunk::OpCode::OP_CALL, 1);
+    call.write_byte(2, 1);
+    call.write_byte(chunk::OpCode::OP_POP, 1);
+    call.write_byte(chunk::OpCode::OP_RETURN, 1);
+    EXPECT_EQ(call.max_stack_depth(), 3);
+
+    chunk::Chunk list;
+    // [nil, true, true][nil], the elements are replaced by the list
+    list.write_byte(chunk::OpCode::OP_NIL, 1);
+    list.write_byte(chunk::OpCode::OP_TRUE, 1);
+    list.write_byte(chunk::OpCode::OP_TRUE, 1);
+    list.write_byte(chunk::OpCode::OP_BUILD_LIST, 1);
+    list.write_byte(3, 1);
+    list.write_byte(chunk::OpCode::OP_NIL, 1);
+    list.write_byte(chunk::OpCode::OP_GET_INDEX, 1);
+    list.write_byte(chunk::OpCode::OP_POP, 1);
+    list.write_byte(chunk::OpCode::OP_RETURN, 1);
+    EXPECT_EQ(list.max_stack_depth(), 3);
+
+    chunk::Chunk underflow;
+    underflow.write_byte(chunk::OpCode::OP_POP, 1);
+    EXPECT_EQ(underflow.max_stack_depth(), std::nullopt);
+}
+
 int main(int ac, char* av[]) {
     testing::InitGoogleTest(&ac, av);
     return RUN_ALL_TESTS();
@@ -0,0 +1,132 @@
+#include "chunk.h"
+#include "common.h"
+#include "compiler.h"
+#include "image.h"
+#include "object.h"
+#include "scanner.h"
+#include "source_buffer.h"
+#include "vm.h"
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace chunk;
+using namespace object;
+
+class ImageTest : public ::testing::Test {
+protected:
+    static Chunk sample_chunk() {
+        Chunk chunk;
+        std::shared_ptr<Object> constants[] = {
+            std::make_shared<NumberObject>(1.5),
+            std::make_shared<StringObject>("hello"),
+            std::make_shared<BooleanObject>(true),
+            std::make_shared<NullObject>(),
+            std::make_shared<StringObject>("")};
+        for (usize i = 0; i < 5; i++) {
+            usize constant_idx = chunk.write_constant(constants[i]);
+            chunk.write_byte(OpCode::OP_CONSTANT, 1);
+            chunk.write_byte(constant_idx, 1);
+            chunk.write_byte(OpCode::OP_POP, i + 2);
+        }
+        chunk.write_byte(OpCode::OP_RETURN, 300);
+        return chunk;
+    }
+
+    static std::shared_ptr<Chunk> load(std::string data) {
+        return image::load(scanner::SourceBuffer{std::move(data)});
+    }
+};
+
+TEST_F(ImageTest, test_round_trip) {
+    Chunk chunk = sample_chunk();
+    chunk.add_inline_cache();
+    std::shared_ptr<Chunk> loaded = load(image::serialize(chunk));
+    ASSERT_NE(loaded, nullptr);
+    EXPECT_EQ(loaded->inline_cache_count(), 1);
+
+    EXPECT_THAT(std::vector<u8>(loaded->code().begin(), loaded->code().end()), ::testing::ContainerEq(chunk.get_code()));
+    for (usize offset = 0; offset < chunk.size(); offset++) {
+        EXPECT_EQ(loaded->line_at(offset), chunk.line_at(offset));
+    }
+    ASSERT_EQ(loaded->get_constants().size(), chunk.get_constants().size());
+    for (usize i = 0; i < chunk.get_constants().size(); i++) {
+        const Object& expected = *chunk.get_constants().get_values()[i];
+        const Object& actual = *loaded->get_constants().get_values()[i];
+        EXPECT_EQ(expected.type, actual.type);
+        EXPECT_TRUE(expected.is_equal(actual));
+    }
+}
+
+TEST_F(ImageTest, test_corrupt_data) {
+    std::string data = image::serialize(sample_chunk());
+    for (usize size = 0; size < data.size(); size++) {
+        EXPECT_EQ(load(data.substr(0, size)), nullptr);
+    }
+
+    std::string other_version = data;
+    other_version[8] ^= 1;
+    EXPECT_EQ(load(other_version), nullptr);
+    EXPECT_EQ(load("print 1;"), nullptr);
+}
+
+TEST_F(ImageTest, test_run_mapped_image) {
+    auto chunk = std::make_shared<Chunk>();
+    compiler::Compiler compiler{std::make_shared<scanner::Scanner>("var a = \"lox\"; var b = a + a; b = !(1 < 2);"), chunk};
+    ASSERT_TRUE(compiler.compile());
+
+    std::string path = testing::TempDir() + "image_test.loxi";
+    {
+        std::string data = image::serialize(*chunk);
+        std::ofstream output_file{path, std::ios::binary};
+        output_file.write(data.data(), static_cast<std::streamsize>(data.size()));
+    }
+    std::shared_ptr<Chunk> loaded = image::load(path);
+    std::remove(path.c_str());
+    ASSERT_NE(loaded, nullptr);
+
+    vm::VirtualMachine vm;
+    vm.load_new_chunk(loaded);
+    EXPECT_EQ(vm.run(), vm::InterpretResult::INTERPRET_OK);
+}
+
+TEST_F(ImageTest, test_functions) {
+    auto chunk = std::make_shared<Chunk>();
+    const char* source = "fun outer(a, b) { fun inner(c) { return c * 2; } return inner(a) + b; } var r = outer(1, 2);";
+    compiler::Compiler compiler{std::make_shared<scanner::Scanner>(source), chunk};
+    ASSERT_TRUE(compiler.compile());
+
+    std::string data = image::serialize(*chunk);
+    std::shared_ptr<Chunk> loaded = load(data);
+    ASSERT_NE(loaded, nullptr);
+    auto function = [](const Chunk& chunk, usize index) {
+        return std::static_pointer_cast<FunctionObject>(chunk.get_constants().get_values().at(index));
+    };
+    auto outer = function(*loaded, 1);
+    ASSERT_EQ(outer->type, ObjectType::OBJ_FUNCTION);
+    EXPECT_EQ(outer->name, "outer");
+    EXPECT_EQ(outer->arity, 2);
+    auto inner = function(*outer->chunk, 0);
+    ASSERT_EQ(inner->type, ObjectType::OBJ_FUNCTION);
+    EXPECT_EQ(inner->name, "inner");
+    const Chunk& compiled_inner = *function(*function(*chunk, 1)->chunk, 0)->chunk;
+    EXPECT_TRUE(std::ranges::equal(inner->chunk->code(), compiled_inner.get_code()));
+
+    vm::VirtualMachine vm;
+    vm.load_new_chunk(loaded);
+    EXPECT_EQ(vm.run(), vm::InterpretResult::INTERPRET_OK);
+
+    for (usize size = 0; size < data.size(); size++) {
+        EXPECT_EQ(load(data.substr(0, size)), nullptr);
+    }
+}
+
+int main(int argc, char* argv[]) {
+    ::testing::InitGoogleMock(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,147 @@
+#include "chunk.h"
+#include "common.h"
+#include "compiler.h"
+#include "ir.h"
+#include "optimizer.h"
+#include "scanner.h"
+#include "vm.h"
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+using namespace chunk;
+using namespace compiler;
+using namespace scanner;
+
+class OptimizerTest : public testing::Test {
+protected:
+    static std::shared_ptr<Chunk> compile(std::string source) {
+        auto scanner = std::make_shared<Scanner>(std::move(source));
+        auto chunk = std::make_shared<Chunk>();
+        Compiler compiler{scanner, chunk};
+        EXPECT_TRUE(compiler.compile());
+        return chunk;
+    }
+
+    static std::shared_ptr<Chunk> optimize(std::string source) {
+        auto chunk = compile(std::move(source));
+        EXPECT_TRUE(optimizer::optimize(*chunk));
+        return chunk;
+    }
+
+    // offsets of every instruction with the given op code
+    static std::vector<usize> find(const Chunk& chunk, OpCode op_code) {
+        std::vector<usize> offsets;
+        const auto& code = chunk.get_code();
+        usize offset = 0;
+        while (offset < code.size()) {
+            u8 instruction = code[offset];
+            if (instruction == op_code) {
+                offsets.emplace_back(offset);
+            }
+            switch (instruction) {
+            case OpCode::OP_CONSTANT:
+            case OpCode::OP_GET_LOCAL:
+            case OpCode::OP_SET_LOCAL:
+            case OpCode::OP_GET_GLOBAL:
+            case OpCode::OP_DEFINE_GLOBAL:
+            case OpCode::OP_SET_GLOBAL:
+                offset += 2;
+                break;
+            case OpCode::OP_JUMP:
+            case OpCode::OP_JUMP_IF_FALSE:
+            case OpCode::OP_LOOP:
+                offset += 3;
+                break;
+            case OpCode::OP_FOR_PREP:
+                offset += 6;
+                break;
+            case OpCode::OP_FOR_LOOP:
+                offset += 7;
+                break;
+            default:
+                offset += 1;
+                break;
+            }
+        }
+        return offsets;
+    }
+};
+
+TEST_F(OptimizerTest, test_build_lifts_locals_into_values) {
+    auto chunk = compile("{ var a = 1; var b = a; print b; }");
+    auto function = ir::build(*chunk);
+    ASSERT_NE(function, nullptr);
+    EXPECT_EQ(function->get_blocks().size(), 1);
+
+    optimizer::propagate_copies(*function);
+    const ir::Instr* print = function->get_entry()->last;
+    ASSERT_EQ(print->op, ir::Op::IR_PRINT);
+    EXPECT_EQ(print->arg(0)->op, ir::Op::IR_CONSTANT);
+}
+
+TEST_F(OptimizerTest, test_copy_propagation) {
+    auto chunk = optimize("{ var a = 1; var b = a; var c = b; print c; }");
+    EXPECT_TRUE(find(*chunk, OpCode::OP_GET_LOCAL).empty());
+    EXPECT_TRUE(find(*chunk, OpCode::OP_SET_LOCAL).empty());
+    EXPECT_EQ(find(*chunk, OpCode::OP_PRINT).size(), 1);
+}
+
+TEST_F(OptimizerTest, test_common_subexpression_elimination) {
+    auto chunk = optimize("{ var a = 2; var b = 3; print a * b; print b * a; }");
+    EXPECT_EQ(find(*chunk, OpCode::OP_MULTIPLY).size(), 1);
+    EXPECT_EQ(find(*chunk, OpCode::OP_PRINT).size(), 2);
+}
+
+TEST_F(OptimizerTest, test_global_load_forwarding) {
+    auto chunk = optimize("var x = 1; print x + x;");
+    EXPECT_TRUE(find(*chunk, OpCode::OP_GET_GLOBAL).empty());
+    EXPECT_EQ(find(*chunk, OpCode::OP_ADD).size(), 1);
+}
+
+TEST_F(OptimizerTest, test_loop_invariant_code_motion) {
+    auto chunk = optimize("{ var a = 2; var b = 3; var i = 0; while (i < 3) { print a * b; i = i + 1; } }");
+    std::vector<usize> multiplies = find(*chunk, OpCode::OP_MULTIPLY);
+    std::vector<usize> branches = find(*chunk, OpCode::OP_JUMP_IF_FALSE);
+    ASSERT_EQ(multiplies.size(), 1);
+    ASSERT_EQ(branches.size(), 1);
+    EXPECT_LT(multiplies.front(), branches.front());
+}
+
+TEST_F(OptimizerTest, test_counting_loops_are_kept) {
+    auto chunk = compile("{ var a = 2; for (var i = 0; i < 3; i = i + 1) { print a; } }");
+    EXPECT_FALSE(optimizer::optimize(*chunk));
+    EXPECT_EQ(find(*chunk, OpCode::OP_FOR_PREP).size(), 1);
+    EXPECT_EQ(find(*chunk, OpCode::OP_FOR_LOOP).size(), 1);
+}
+
+TEST_F(OptimizerTest, test_dead_code_elimination) {
+    auto chunk = optimize("{ var a = 1; var unused = a + 2; print a; }");
+    EXPECT_TRUE(find(*chunk, OpCode::OP_ADD).empty());
+}
+
+TEST_F(OptimizerTest, test_operations_that_can_fail_are_kept) {
+    auto chunk = optimize("{ var a = nil; var unused = -a; var b = \"s\" + 1; }");
+    EXPECT_EQ(find(*chunk, OpCode::OP_NEGATE).size(), 1);
+    EXPECT_EQ(find(*chunk, OpCode::OP_ADD).size(), 1);
+}
+
+TEST_F(OptimizerTest, test_constant_branches_are_folded) {
+    auto chunk = optimize("if (true) print 1; else print 2; while (false) print 3;");
+    EXPECT_TRUE(find(*chunk, OpCode::OP_JUMP_IF_FALSE).empty());
+    EXPECT_EQ(find(*chunk, OpCode::OP_PRINT).size(), 1);
+}
+
+TEST_F(OptimizerTest, test_optimized_loop_runs) {
+    auto chunk = optimize("var sum = 0; { var a = 1; var b = 0; while (b < 10) { var t = a; a = b; b = t + b; sum = sum + b; } }");
+    vm::VirtualMachine vm;
+    vm.load_new_chunk(chunk);
+    EXPECT_EQ(vm.run(), vm::InterpretResult::INTERPRET_OK);
+}
+
+int main(int argc, char* argv[]) {
+    ::testing::InitGoogleMock(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,107 @@
+#include "common.h"
+#include "output.h"
+#include <charconv>
+#include <fcntl.h>
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+#include <string>
+#include <unistd.h>
+
+using namespace output;
+
+class OutputTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        ASSERT_EQ(pipe(m_pipe), 0);
+        // reading what has not been written yet must not block
+        fcntl(m_pipe[0], F_SETFL, O_NONBLOCK);
+    }
+
+    void TearDown() override {
+        close(m_pipe[0]);
+        close(m_pipe[1]);
+    }
+
+    std::string written() {
+        std::string text;
+        char buffer[4096];
+        isize count;
+        while ((count = read(m_pipe[0], buffer, sizeof(buffer))) > 0) {
+            text.append(buffer, static_cast<usize>(count));
+        }
+        return text;
+    }
+
+    int m_pipe[2]{-1, -1};
+};
+
+TEST_F(OutputTest, test_full_buffering) {
+    Sink sink{m_pipe[1], FlushPolicy::FLUSH_FULL};
+    sink.write("hello\n");
+    sink.write_number(1.5);
+    EXPECT_EQ(written(), "");
+
+    sink.flush();
+    EXPECT_EQ(written(), "hello\n1.5");
+}
+
+TEST_F(OutputTest, test_line_buffering) {
+    Sink sink{m_pipe[1], FlushPolicy::FLUSH_LINE};
+    sink.write("partial");
+    EXPECT_EQ(written(), "");
+
+    sink.write(" line\n");
+    EXPECT_EQ(written(), "partial line\n");
+}
+
+TEST_F(OutputTest, test_auto_policy_on_pipe) {
+    {
+        Sink sink{m_pipe[1]};
+        sink.write("a pipe is not a terminal\n");
+        EXPECT_EQ(written(), "");
+    }
+    EXPECT_EQ(written(), "a pipe is not a terminal\n");
+}
+
+TEST_F(OutputTest, test_writes_larger_than_buffer) {
+    Sink sink{m_pipe[1], FlushPolicy::FLUSH_FULL, 64};
+    std::string expected;
+    for (int i = 0; i < 40; i++) {
+        sink.write_number(i + 0.5);
+        sink.write(" ");
+        expected += std::to_string(i) + ".5 ";
+    }
+    sink.write(std::string(100, 'x'));
+    sink.flush();
+    EXPECT_EQ(written(), expected + std::string(100, 'x'));
+}
+
+TEST(FormatNumber, test_integers_are_written_in_full) {
+    auto format = [](double value) {
+        char buffer[k_max_number_length];
+        return std::string{buffer, format_number(buffer, buffer + sizeof(buffer), value)};
+    };
+    auto fixed = [](double value) {
+        char buffer[k_max_number_length];
+        return std::string{buffer, std::to_chars(buffer, buffer + sizeof(buffer), value, std::chars_format::fixed).ptr};
+    };
+
+    for (double value = -200000; value <= 200000; value++) {
+        ASSERT_EQ(format(value), fixed(value));
+    }
+    EXPECT_EQ(format(100000), "100000");
+    EXPECT_EQ(format(2e7), "20000000");
+    EXPECT_EQ(format(1e15), "1000000000000000");
+    EXPECT_EQ(format(9007199254740994.0), "9007199254740994");
+    EXPECT_EQ(format(-1e20), "-100000000000000000000");
+    EXPECT_EQ(format(1e21), "1e+21");
+    EXPECT_EQ(format(-0.0), "-0");
+    EXPECT_EQ(format(0.5), "0.5");
+    EXPECT_EQ(format(-2.25), "-2.25");
+    EXPECT_EQ(format(1e-7), "1e-07");
+}
+
+int main(int argc, char* argv[]) {
+    ::testing::InitGoogleMock(&argc, argv);
+    return RUN_ALL_TESTS();
+}
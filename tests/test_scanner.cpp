@@ -1,8 +1,14 @@
 #include "scanner.h"
+#include "source_buffer.h"
 #include "token.h"
 
+#include <cstdio>
+#include <fstream>
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
+#include <memory>
+#include <thread>
+#include <unistd.h>
 
 using namespace token;
 using namespace scanner;
@@ -10,7 +16,7 @@ using namespace scanner;
 class ScannerTest : public ::testing::Test {
 protected:
     static std::string single_character_operators() {
-        return "( ) { } ; , . - + / * ! = < >";
+        return "( ) { } [ ] ; , . - + / * ! = < >";
     }
 
     static std::string two_character_operators() {
@@ -37,6 +43,16 @@ protected:
         return "and class else false for fun if nil or print return super this true var while";
     }
 
+    static std::string test_keyword_prefixes() {
+        return "an classes f fo fort th thi tru variable";
+    }
+
+    static std::string test_long_runs() {
+        return "\t  \r\n      \n   \n  // a comment that is longer than a single batch of bytes\n"
+               "an_identifier_that_is_longer_than_a_single_batch 12345678901234567890123456789012.5\n"
+               "\"a string literal\nthat spans lines and is longer than a batch\" x";
+    }
+
     std::optional<std::vector<Token>> scan_tokens(usize expect_output_size) {
         std::vector<Token> output_tokens;
         while (true) {
@@ -66,6 +82,8 @@ TEST_F(ScannerTest, test_single_character_operator_scanning) {
         {TokenType::TOKEN_RIGHT_PAREN, ")", 1},
         {TokenType::TOKEN_LEFT_BRACE, "{", 1},
         {TokenType::TOKEN_RIGHT_BRACE, "}", 1},
+        {TokenType::TOKEN_LEFT_BRACKET, "[", 1},
+        {TokenType::TOKEN_RIGHT_BRACKET, "]", 1},
         {TokenType::TOKEN_SEMICOLON, ";", 1},
         {TokenType::TOKEN_COMMA, ",", 1},
         {TokenType::TOKEN_DOT, ".", 1},
@@ -211,6 +229,131 @@ TEST_F(ScannerTest, test_special_keywords) {
     EXPECT_THAT(output_tokens.value(), testing::ContainerEq(expected_tokens));
 }
 
+TEST_F(ScannerTest, test_keyword_prefixes) {
+    m_scanner.load_source(test_keyword_prefixes());
+
+    std::vector<Token> expected_tokens{
+        {TokenType::TOKEN_IDENTIFIER, "an", 1},
+        {TokenType::TOKEN_IDENTIFIER, "classes", 1},
+        {TokenType::TOKEN_IDENTIFIER, "f", 1},
+        {TokenType::TOKEN_IDENTIFIER, "fo", 1},
+        {TokenType::TOKEN_IDENTIFIER, "fort", 1},
+        {TokenType::TOKEN_IDENTIFIER, "th", 1},
+        {TokenType::TOKEN_IDENTIFIER, "thi", 1},
+        {TokenType::TOKEN_IDENTIFIER, "tru", 1},
+        {TokenType::TOKEN_IDENTIFIER, "variable", 1},
+        {TokenType::TOKEN_EOF, "", 1}};
+
+    std::optional<std::vector<Token>> output_tokens = scan_tokens(expected_tokens.size());
+
+    if (!output_tokens) {
+        FAIL() << "Output token size exceeded expect output token size.";
+    }
+
+    EXPECT_EQ(output_tokens.value().size(), expected_tokens.size());
+    EXPECT_THAT(output_tokens.value(), testing::ContainerEq(expected_tokens));
+}
+
+TEST_F(ScannerTest, test_comment_followed_by_code) {
+    m_scanner.load_source("print 1; // comment\nprint 2;");
+
+    std::vector<Token> expected_tokens{
+        {TokenType::TOKEN_PRINT, "print", 1},
+        {TokenType::TOKEN_NUMBER, "1", 1},
+        {TokenType::TOKEN_SEMICOLON, ";", 1},
+        {TokenType::TOKEN_PRINT, "print", 2},
+        {TokenType::TOKEN_NUMBER, "2", 2},
+        {TokenType::TOKEN_SEMICOLON, ";", 2},
+        {TokenType::TOKEN_EOF, "", 2}};
+
+    std::optional<std::vector<Token>> output_tokens = scan_tokens(expected_tokens.size());
+
+    if (!output_tokens) {
+        FAIL() << "Output token size exceeded expect output token size.";
+    }
+
+    EXPECT_EQ(output_tokens.value().size(), expected_tokens.size());
+    EXPECT_THAT(output_tokens.value(), testing::ContainerEq(expected_tokens));
+}
+
+TEST_F(ScannerTest, test_long_runs) {
+    m_scanner.load_source(test_long_runs());
+
+    std::vector<Token> expected_tokens{
+        {TokenType::TOKEN_IDENTIFIER, "an_identifier_that_is_longer_than_a_single_batch", 5},
+        {TokenType::TOKEN_NUMBER, "12345678901234567890123456789012.5", 5},
+        {TokenType::TOKEN_STRING, "\"a string literal\nthat spans lines and is longer than a batch\"", 7},
+        {TokenType::TOKEN_IDENTIFIER, "x", 7},
+        {TokenType::TOKEN_EOF, "", 7}};
+
+    std::optional<std::vector<Token>> output_tokens = scan_tokens(expected_tokens.size());
+
+    if (!output_tokens) {
+        FAIL() << "Output token size exceeded expect output token size.";
+    }
+
+    EXPECT_EQ(output_tokens.value().size(), expected_tokens.size());
+    EXPECT_THAT(output_tokens.value(), testing::ContainerEq(expected_tokens));
+}
+
+TEST_F(ScannerTest, test_mapped_source) {
+    std::string path = testing::TempDir() + "scanner_mapped_source.lox";
+    {
+        std::ofstream file{path, std::ios::binary};
+        file << "var a = 1;\nprint a;";
+    }
+
+    std::optional<SourceBuffer> buffer = SourceBuffer::open(path);
+    std::remove(path.c_str());
+    ASSERT_TRUE(buffer.has_value());
+    EXPECT_TRUE(buffer->is_mapped());
+
+    auto scanner = std::make_shared<Scanner>(std::move(buffer.value()));
+    std::vector<Token> expected_tokens{
+        {TokenType::TOKEN_VAR, "var", 1},
+        {TokenType::TOKEN_IDENTIFIER, "a", 1},
+        {TokenType::TOKEN_EQUAL, "=", 1},
+        {TokenType::TOKEN_NUMBER, "1", 1},
+        {TokenType::TOKEN_SEMICOLON, ";", 1},
+        {TokenType::TOKEN_PRINT, "print", 2},
+        {TokenType::TOKEN_IDENTIFIER, "a", 2},
+        {TokenType::TOKEN_SEMICOLON, ";", 2},
+        {TokenType::TOKEN_EOF, "", 2}};
+
+    for (const Token& expected_token : expected_tokens) {
+        EXPECT_EQ(scanner->scan_token(), expected_token);
+    }
+}
+
+TEST_F(ScannerTest, test_missing_source_file) {
+    EXPECT_FALSE(SourceBuffer::open(testing::TempDir() + "scanner_missing_source.lox").has_value());
+}
+
+TEST_F(ScannerTest, test_streamed_source) {
+    // a tiny chunk size makes almost every token straddle a refill
+    std::string source = test_long_runs() + " var a = 1.5; // trailing comment";
+    int fds[2];
+    ASSERT_EQ(pipe(fds), 0);
+    std::thread writer{[&source, fd = fds[1]] {
+        EXPECT_EQ(write(fd, source.data(), source.size()), static_cast<isize>(source.size()));
+        close(fd);
+    }};
+
+    Scanner streamed{SourceBuffer::stream(fds[0], 3)};
+    Scanner whole{source};
+    while (true) {
+        Token expected = whole.scan_token();
+        Token token = streamed.scan_token();
+        EXPECT_EQ(token, expected);
+        // only the last token has to stay valid
+        streamed.release();
+        if (expected.get_type() == TokenType::TOKEN_EOF) {
+            break;
+        }
+    }
+    writer.join();
+}
+
 int main(int argc, char* argv[]) {
     ::testing::InitGoogleMock(&argc, argv);
     return RUN_ALL_TESTS();
@@ -1,8 +1,13 @@
+#include "chunk.h"
+#include "compiler.h"
 #include "object.h"
+#include "scanner.h"
 #include "value.h"
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
 #include <memory>
+#include <optional>
+#include <string>
 
 TEST(ValueArray, test_write_value) {
     value::ValueArray value_array;
@@ -17,6 +22,73 @@ TEST(ValueArray, test_write_value) {
     EXPECT_EQ(result_2->value, 2.1);
 }
 
+TEST(NumberObject, test_to_string_shortest) {
+    EXPECT_EQ(object::NumberObject{1}.to_string(), "1");
+    EXPECT_EQ(object::NumberObject{-2.5}.to_string(), "-2.5");
+    EXPECT_EQ(object::NumberObject{0.1}.to_string(), "0.1");
+    EXPECT_EQ(object::NumberObject{0.1 + 0.2}.to_string(), "0.30000000000000004");
+    EXPECT_EQ(object::NumberObject{123456789012}.to_string(), "123456789012");
+    EXPECT_EQ(object::NumberObject{100000}.to_string(), "100000");
+    EXPECT_EQ(object::NumberObject{2e7}.to_string(), "20000000");
+    EXPECT_EQ(object::NumberObject{1e15}.to_string(), "1000000000000000");
+    EXPECT_EQ(object::NumberObject{1e20}.to_string(), "100000000000000000000");
+    EXPECT_EQ(object::NumberObject{1e21}.to_string(), "1e+21");
+}
+
+TEST(NumberObject, test_number_literals) {
+    auto compile = [](const std::string& source) {
+        auto chunk = std::make_shared<chunk::Chunk>();
+        compiler::Compiler compiler{std::make_shared<scanner::Scanner>(source), chunk};
+        return compiler.compile() ? chunk : nullptr;
+    };
+
+    auto chunk = compile("0.30000000000000004;");
+    ASSERT_NE(chunk, nullptr);
+    auto literal = std::static_pointer_cast<object::NumberObject>(chunk->get_constants().get_values().at(0));
+    EXPECT_EQ(literal->value, 0.1 + 0.2);
+
+    EXPECT_EQ(compile(std::string(400, '9') + ";"), nullptr);
+    EXPECT_EQ(compile("0." + std::string(400, '0') + "1;"), nullptr);
+}
+
+TEST(InstanceObject, test_shapes) {
+    auto klass = std::make_shared<object::ClassObject>("Point");
+    auto x = std::make_shared<object::StringObject>("x");
+    auto y = std::make_shared<object::StringObject>("y");
+
+    object::InstanceObject a{klass};
+    object::InstanceObject b{klass};
+    object::InstanceObject c{klass};
+    EXPECT_EQ(a.shape, klass->shape);
+
+    a.set_field(x, std::make_shared<object::NumberObject>(1));
+    a.set_field(y, std::make_shared<object::NumberObject>(2));
+    // a name equal to one the shape has, not the same string
+    b.set_field(std::make_shared<object::StringObject>("x"), std::make_shared<object::NumberObject>(3));
+    b.set_field(y, std::make_shared<object::NumberObject>(4));
+    c.set_field(y, std::make_shared<object::NumberObject>(5));
+    c.set_field(x, std::make_shared<object::NumberObject>(6));
+
+    // same fields in the same order share the shape
+    EXPECT_EQ(a.shape, b.shape);
+    EXPECT_NE(a.shape, c.shape);
+    EXPECT_EQ(a.shape->find_slot(*y), 1);
+    EXPECT_EQ(c.shape->find_slot(*y), 0);
+    EXPECT_EQ(a.shape->find_slot(object::StringObject{"z"}), std::nullopt);
+    EXPECT_EQ(klass->shape->transitions.size(), 2);
+
+    // updating a field keeps the shape
+    auto shape = a.shape;
+    a.set_field(x, std::make_shared<object::NumberObject>(7));
+    EXPECT_EQ(a.shape, shape);
+    EXPECT_EQ(std::static_pointer_cast<object::NumberObject>(a.fields[0])->value, 7);
+    ASSERT_EQ(a.fields.size(), 2);
+
+    // later instances reserve room for the fields
+    EXPECT_EQ(klass->field_capacity, 2);
+    EXPECT_GE(object::InstanceObject{klass}.fields.capacity(), 2);
+}
+
 int main(int argc, char* argv[]) {
     testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();
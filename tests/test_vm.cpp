@@ -1,11 +1,21 @@
 #include "chunk.h"
 #include "common.h"
+#include "compiler.h"
+#include "lox.h"
 #include "object.h"
+#include "scanner.h"
 #include "value.h"
 #include "vm.h"
 #include <gmock/gmock.h>
 #include <gtest/gtest.h>
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
 #include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
 #include <variant>
 
 using namespace chunk;
@@ -47,6 +57,20 @@ protected:
         return chunk;
     }
 
+    // Compile errors fail the test.
+    static std::shared_ptr<Chunk> compile_source(std::string source) {
+        auto chunk = std::make_shared<Chunk>();
+        compiler::Compiler compiler{std::make_shared<scanner::Scanner>(std::move(source)), chunk};
+        EXPECT_TRUE(compiler.compile());
+        return chunk;
+    }
+
+    // Scripts call the undefined `fail` to end with a runtime error.
+    vm::InterpretResult run_source(std::string source) {
+        m_vm.load_new_chunk(compile_source(std::move(source)));
+        return m_vm.run();
+    }
+
     void run_n_steps(usize n) {
         for (usize i = 0; i < n; i++) {
             m_vm.run_step();
@@ -172,7 +196,7 @@ TEST_F(VirtualMachineTest, test_binary_op_failure) {
     run_n_steps(2);
     auto result = m_vm.run_step();
 
-    EXPECT_EQ(result, vm::InterpretResult::INTERPRET_OK);
+    EXPECT_EQ(result, vm::InterpretResult::INTERPRET_RUNTIME_ERROR);
 }
 
 TEST_F(VirtualMachineTest, test_op_negate_failure) {
@@ -199,6 +223,7 @@ TEST_F(VirtualMachineTest, test_true_bool_op) {
 
     auto result = m_vm.run_step();
 
+    EXPECT_EQ(result, vm::InterpretResult::INTERPRET_OK);
     auto stack_top = std::static_pointer_cast<BooleanObject>(m_vm.peek_stack_top());
     EXPECT_EQ(stack_top->value, true);
 }
@@ -212,6 +237,7 @@ TEST_F(VirtualMachineTest, test_false_bool_op) {
 
     auto result = m_vm.run_step();
 
+    EXPECT_EQ(result, vm::InterpretResult::INTERPRET_OK);
     auto stack_top = std::static_pointer_cast<BooleanObject>(m_vm.peek_stack_top());
     EXPECT_EQ(stack_top->value, false);
 }
@@ -393,6 +419,447 @@ TEST_F(VirtualMachineTest, test_set_local_var) {
     EXPECT_EQ(result, vm::INTERPRET_OK);
 }
 
+TEST_F(VirtualMachineTest, test_deep_stack) {
+    auto chunk = std::make_unique<Chunk>();
+    usize constant_idx = chunk->write_constant(std::make_shared<NumberObject>(1.0));
+    for (usize i = 0; i < 1000; i++) {
+        chunk->write_byte(OpCode::OP_CONSTANT, 123);
+        chunk->write_byte(constant_idx, 123);
+    }
+    for (usize i = 1; i < 1000; i++) {
+        chunk->write_byte(OpCode::OP_ADD, 123);
+    }
+    EXPECT_EQ(chunk->max_stack_depth(), 1000);
+
+    m_vm.load_new_chunk(std::move(chunk));
+    EXPECT_EQ(m_vm.run(), vm::INTERPRET_OK);
+    auto stack_top = std::static_pointer_cast<NumberObject>(m_vm.peek_stack_top());
+    EXPECT_EQ(stack_top->value, 1000.0);
+}
+
+TEST_F(VirtualMachineTest, test_stack_overflow) {
+    m_vm.set_max_stack(1);
+    m_vm.load_new_chunk(binary_op_program(std::make_shared<NumberObject>(1.0), std::make_shared<NumberObject>(2.0), OpCode::OP_ADD));
+    EXPECT_EQ(m_vm.run(), vm::INTERPRET_RUNTIME_ERROR);
+
+    m_vm.set_max_stack(2);
+    m_vm.load_new_chunk(binary_op_program(std::make_shared<NumberObject>(1.0), std::make_shared<NumberObject>(2.0), OpCode::OP_ADD));
+    EXPECT_EQ(m_vm.run(), vm::INTERPRET_OK);
+}
+
+TEST_F(VirtualMachineTest, test_call_and_return) {
+    // fun add(a, b) { return a + b; }
+    auto body = std::make_shared<Chunk>();
+    body->write_byte(OpCode::OP_GET_LOCAL, 1);
+    body->write_byte(1, 1);
+    body->write_byte(OpCode::OP_GET_LOCAL, 1);
+    body->write_byte(2, 1);
+    body->write_byte(OpCode::OP_ADD, 1);
+    body->write_byte(OpCode::OP_RETURN, 1);
+
+    auto chunk = std::make_unique<Chunk>();
+    usize constant_idx = chunk->write_constant(std::make_shared<FunctionObject>("add", 2, body));
+    chunk->write_byte(OpCode::OP_CONSTANT, 2);
+    chunk->write_byte(constant_idx, 2);
+    constant_idx = chunk->write_constant(std::make_shared<NumberObject>(1.0));
+    chunk->write_byte(OpCode::OP_CONSTANT, 2);
+    chunk->write_byte(constant_idx, 2);
+    constant_idx = chunk->write_constant(std::make_shared<NumberObject>(2.0));
+    chunk->write_byte(OpCode::OP_CONSTANT, 2);
+    chunk->write_byte(constant_idx, 2);
+    chunk->write_byte(OpCode::OP_CALL, 2);
+    chunk->write_byte(2, 2);
+    chunk->write_byte(OpCode::OP_RETURN, 2);
+    EXPECT_EQ(chunk->max_stack_depth(), 3);
+
+    m_vm.load_new_chunk(std::move(chunk));
+    run_n_steps(4);
+    // stepping into the call
+    EXPECT_EQ(m_vm.get_ip(), 0);
+    EXPECT_EQ(m_vm.run(), vm::INTERPRET_OK);
+    auto stack_top = std::static_pointer_cast<NumberObject>(m_vm.peek_stack_top());
+    EXPECT_EQ(stack_top->value, 3.0);
+}
+
+TEST_F(VirtualMachineTest, test_call_errors) {
+    EXPECT_EQ(run_source("fun f(a) { return a; } var r = f(1);"), vm::INTERPRET_OK);
+    EXPECT_EQ(run_source("fun f(a) { return a; } f(1, 2);"), vm::INTERPRET_RUNTIME_ERROR);
+    EXPECT_EQ(run_source("var f = 1; f();"), vm::INTERPRET_RUNTIME_ERROR);
+    // not a tail call, every call keeps its frame
+    EXPECT_EQ(run_source("fun f(n) { return f(n + 1) + 1; } f(0);"), vm::INTERPRET_RUNTIME_ERROR);
+    // the failed calls were unwound
+    EXPECT_EQ(run_source("fun g(n) { if (n < 2) return n; return g(n - 1) + g(n - 2); } var r = g(10);"), vm::INTERPRET_OK);
+}
+
+TEST_F(VirtualMachineTest, test_binary_op_errors) {
+    EXPECT_EQ(run_source("fun f(n) { var s = 0; while (s < n) s = s + 1; return s; } var r = f(\"x\");"), vm::INTERPRET_RUNTIME_ERROR);
+    EXPECT_EQ(run_source("{ var i = \"a\"; while (i < 3) i = i + 1; }"), vm::INTERPRET_RUNTIME_ERROR);
+    EXPECT_EQ(run_source("var b = 1 < \"a\";"), vm::INTERPRET_RUNTIME_ERROR);
+    EXPECT_EQ(run_source("var d = nil / 2;"), vm::INTERPRET_RUNTIME_ERROR);
+    // the stack was reset
+    EXPECT_EQ(run_source("fun f(n) { return n * 2; } if (f(2) != 4) fail();"), vm::INTERPRET_OK);
+}
+
+// A type error ends the script, with the interpreter's exit code for runtime errors.
+TEST(VirtualMachineDeathTest, test_binary_op_errors_exit) {
+    std::string path = testing::TempDir() + "vm_binary_op_errors.lox";
+    auto expect_exit = [&path](const char* source) {
+        {
+            std::ofstream file{path, std::ios::binary};
+            file << source;
+        }
+        // the error is the first thing reported, nothing after it ran
+        const char* argv[] = {"cpplox_bytecode", path.c_str()};
+        EXPECT_EXIT(lox::startup(2, argv), testing::ExitedWithCode(70), "^Operands must be numbers\\.");
+        std::remove(path.c_str());
+    };
+
+    expect_exit("fun f(n) { var s = 0; while (s < n) s = s + 1; return s; } print f(\"x\"); fail();");
+    expect_exit("{ var i = \"a\"; while (i < 3) { fail(); i = i + 1; } }");
+    expect_exit("print 1 < \"a\";");
+}
+
+TEST_F(VirtualMachineTest, test_closures) {
+    EXPECT_EQ(run_source("fun make() { var i = 0; fun inc() { i = i + 1; return i; } return inc; }"
+                         "var a = make(); var b = make(); a(); a();"
+                         "if (a() != 3) fail(); if (b() != 1) fail();"),
+              vm::INTERPRET_OK);
+    // both closures share the upvalue
+    EXPECT_EQ(run_source("var get; var set;"
+                         "fun pair() { var v = 1; fun g() { return v; } fun s(n) { v = n; } get = g; set = s; }"
+                         "pair(); set(42); if (get() != 42) fail();"),
+              vm::INTERPRET_OK);
+    // every iteration's local is closed on its own
+    EXPECT_EQ(run_source("var first; var second;"
+                         "{ var i = 1; while (i < 3) { var j = i; fun show() { return j; } if (i == 1) first = show; else second = show; i = i + 1; } }"
+                         "if (first() != 1) fail(); if (second() != 2) fail();"),
+              vm::INTERPRET_OK);
+    // captured through a function that doesn't use the variable itself
+    EXPECT_EQ(run_source("fun outer() { var x = 1; fun middle() { fun inner() { x = x + 1; return x; } return inner; } return middle(); }"
+                         "var f = outer(); f(); if (f() != 3) fail();"),
+              vm::INTERPRET_OK);
+    // the stack grows while the upvalue is open
+    EXPECT_EQ(run_source("fun grow(n) { if (n < 1) return 0; return grow(n - 1) + 0; }"
+                         "fun outer() { var x = 1; fun get() { return x; } grow(1000); x = 2; return get; }"
+                         "if (outer()() != 2) fail();"),
+              vm::INTERPRET_OK);
+    EXPECT_EQ(run_source("if (1 != 2) fail();"), vm::INTERPRET_RUNTIME_ERROR);
+}
+
+TEST_F(VirtualMachineTest, test_closure_only_when_capturing) {
+    auto plain = compile_source("{ var x = 1; fun f(a) { return a; } }");
+    EXPECT_EQ(plain->code()[2], OpCode::OP_CONSTANT);
+    // neither local is captured
+    EXPECT_EQ(plain->code()[4], OpCode::OP_POP);
+    EXPECT_EQ(plain->code()[5], OpCode::OP_POP);
+
+    auto closure = compile_source("{ var x = 1; fun f() { return x; } }");
+    EXPECT_EQ(closure->code()[2], OpCode::OP_CLOSURE);
+    // one upvalue, local slot 0
+    EXPECT_EQ(closure->code()[4], 1);
+    EXPECT_EQ(closure->code()[5], 1);
+    EXPECT_EQ(closure->code()[6], 0);
+    EXPECT_EQ(closure->code()[7], OpCode::OP_POP);
+    EXPECT_EQ(closure->code()[8], OpCode::OP_CLOSE_UPVALUE);
+    EXPECT_EQ(closure->max_stack_depth(), 2);
+}
+
+TEST_F(VirtualMachineTest, test_classes) {
+    EXPECT_EQ(run_source("class P { init(x, y) { this.x = x; this.y = y; } sum() { return this.x + this.y; } }"
+                         "var p = P(1, 2); if (p.sum() != 3) fail();"
+                         "var sum = p.sum; p.x = 10; if (sum() != 12) fail();"),
+              vm::INTERPRET_OK);
+    // fields shadow methods and may hold functions
+    EXPECT_EQ(run_source("class A { f() { return 1; } } fun two() { return 2; }"
+                         "var a = A(); a.f = two; if (a.f() != 2) fail();"),
+              vm::INTERPRET_OK);
+    // initializers return the instance
+    EXPECT_EQ(run_source("class A { init() { this.v = 1; return; } } var a = A(); if (a.init() != a) fail();"), vm::INTERPRET_OK);
+    EXPECT_EQ(run_source("class A {} A().missing;"), vm::INTERPRET_RUNTIME_ERROR);
+    EXPECT_EQ(run_source("class A {} A(1);"), vm::INTERPRET_RUNTIME_ERROR);
+    EXPECT_EQ(run_source("var a = 1; a.x = 2;"), vm::INTERPRET_RUNTIME_ERROR);
+}
+
+TEST_F(VirtualMachineTest, test_inline_caches) {
+    // the first read and the set in the initializer miss, the other reads hit
+    m_vm.reset();
+    EXPECT_EQ(run_source("class P { init(x) { this.x = x; } } var p = P(1); var s = 0; var i = 0;"
+                         "while (i < 10) { s = s + p.x; i = i + 1; } if (s != 10) fail();"),
+              vm::INTERPRET_OK);
+    EXPECT_EQ(m_vm.get_inline_cache_stats().hits, 9);
+    EXPECT_EQ(m_vm.get_inline_cache_stats().misses, 2);
+    EXPECT_EQ(m_vm.get_inline_cache_stats().megamorphic, 0);
+
+    // five shapes at the read in `get`, the sixth call finds it megamorphic
+    m_vm.reset();
+    EXPECT_EQ(run_source("class A {} fun get(o) { return o.v; }"
+                         "var a1 = A(); a1.v = 1; var a2 = A(); a2.w = 1; a2.v = 2; var a3 = A(); a3.x = 1; a3.v = 3;"
+                         "var a4 = A(); a4.y = 1; a4.v = 4; var a5 = A(); a5.z = 1; a5.v = 5;"
+                         "if (get(a1) + get(a2) + get(a3) + get(a4) + get(a5) + get(a1) != 16) fail();"),
+              vm::INTERPRET_OK);
+    EXPECT_EQ(m_vm.get_inline_cache_stats().hits, 0);
+    EXPECT_EQ(m_vm.get_inline_cache_stats().misses, 14);
+    EXPECT_EQ(m_vm.get_inline_cache_stats().megamorphic, 1);
+
+    // a cached method of a class is not found on instances that shadow it with a field
+    EXPECT_EQ(run_source("class A { f() { return 1; } } fun two() { return 2; } fun call(a) { return a.f(); }"
+                         "var a = A(); var b = A(); b.f = two; if (call(a) + call(b) + call(a) != 4) fail();"),
+              vm::INTERPRET_OK);
+}
+
+TEST_F(VirtualMachineTest, test_invoke) {
+    // a method call is a single instruction that hits its cache from the second call on
+    m_vm.reset();
+    EXPECT_EQ(run_source("class A { f(x) { return x + 1; } } var a = A(); var s = 0; var i = 0;"
+                         "while (i < 5) { s = a.f(s); i = i + 1; } if (s != 5) fail();"),
+              vm::INTERPRET_OK);
+    EXPECT_EQ(m_vm.get_inline_cache_stats().hits, 4);
+    EXPECT_EQ(m_vm.get_inline_cache_stats().misses, 1);
+
+    // fields holding functions and closures are called without the instance
+    EXPECT_EQ(run_source("class A { f() { return 1; } } fun make(n) { fun get() { return n; } return get; }"
+                         "var a = A(); a.f = make(3); var b = A(); if (a.f() + b.f() + a.f() != 7) fail();"),
+              vm::INTERPRET_OK);
+    EXPECT_EQ(run_source("class A { init() { this.c = A; } } var a = A(); if (a.c().c == nil) fail();"), vm::INTERPRET_OK);
+    EXPECT_EQ(run_source("class A {} A().missing();"), vm::INTERPRET_RUNTIME_ERROR);
+    EXPECT_EQ(run_source("class A { f(x) {} } A().f();"), vm::INTERPRET_RUNTIME_ERROR);
+    EXPECT_EQ(run_source("var a = 1; a.f();"), vm::INTERPRET_RUNTIME_ERROR);
+}
+
+TEST_F(VirtualMachineTest, test_inheritance) {
+    EXPECT_EQ(run_source("class A { init(n) { this.n = n; } name() { return 1; } both() { return this.name() * 10 + 1; } }"
+                         "class B < A { init(n) { super.init(n * 2); } name() { return 2; } base() { return super.name; } }"
+                         "var b = B(2); if (b.n != 4) fail(); if (b.both() != 21) fail(); if (b.base()() != 1) fail();"),
+              vm::INTERPRET_OK);
+    // methods of nested functions reach `super` through their closure
+    EXPECT_EQ(run_source("class A { f() { return 1; } } class B < A { f() { fun g() { return super.f() + 1; } return g; } }"
+                         "class C < B {} if (C().f()() != 2) fail();"),
+              vm::INTERPRET_OK);
+    EXPECT_EQ(run_source("var x = 1; class A < x {}"), vm::INTERPRET_RUNTIME_ERROR);
+    EXPECT_EQ(run_source("class A {} class B < A { f() { return super.g(); } } B().f();"), vm::INTERPRET_RUNTIME_ERROR);
+}
+
+TEST_F(VirtualMachineTest, test_logical_operators) {
+    EXPECT_EQ(run_source("if ((nil or 1) != 1) fail(); if ((2 or fail()) != 2) fail(); if ((false or nil) != nil) fail();"
+                         "if ((true and nil or 3) != 3) fail(); if ((nil and fail() or 4) != 4) fail();"
+                         "var a; a = nil or 5; if (a != 5) fail();"),
+              vm::INTERPRET_OK);
+}
+
+TEST_F(VirtualMachineTest, test_tail_calls) {
+    // far deeper than the frame limit
+    const char* count_down = "fun sum(n, acc) { if (n == 0) return acc; return sum(n - 1, acc + n); }"
+                             "if (sum(10000, 0) != 50005000) fail();";
+    const char* mutual = "fun even(n) { if (n == 0) return true; return odd(n - 1); }"
+                         "fun odd(n) { if (n == 0) return false; return even(n - 1); }"
+                         "if (!even(5000)) fail(); if (odd(5000)) fail();";
+    // the call on the right of `and` and `or` gives the result as well
+    const char* logical = "fun all(n) { return n == 0 or all(n - 1); }"
+                          "fun any(n) { return n > 0 and any(n - 1); }"
+                          "if (!all(10000)) fail(); if (any(10000)) fail();";
+    EXPECT_EQ(run_source(count_down), vm::INTERPRET_OK);
+    EXPECT_EQ(run_source(mutual), vm::INTERPRET_OK);
+    EXPECT_EQ(run_source(logical), vm::INTERPRET_OK);
+    // captured parameters are closed before the frame is reused, calls without a frame return their result
+    EXPECT_EQ(run_source("fun capture(n) { fun get() { return n; } return get; }"
+                         "fun pass(f, n) { return f(n); } fun four(f) { return f(4); } class A {}"
+                         "if (pass(capture, 3)() != 3) fail(); if (pass(four, capture)() != 4) fail();"
+                         "fun make() { return A(); } if (make() == nil) fail();"),
+              vm::INTERPRET_OK);
+    EXPECT_EQ(run_source("fun f(a) { return a; } fun g() { return f(); } g();"), vm::INTERPRET_RUNTIME_ERROR);
+
+    m_vm.set_tail_calls(false);
+    EXPECT_EQ(run_source(count_down), vm::INTERPRET_RUNTIME_ERROR);
+    EXPECT_EQ(run_source(logical), vm::INTERPRET_RUNTIME_ERROR);
+    EXPECT_EQ(run_source("fun sum(n, acc) { if (n == 0) return acc; return sum(n - 1, acc + n); }"
+                         "if (sum(100, 0) != 5050) fail();"),
+              vm::INTERPRET_OK);
+    m_vm.set_tail_calls(true);
+}
+
+TEST_F(VirtualMachineTest, test_natives) {
+    EXPECT_EQ(run_source("if (sqrt(16) != 4) fail(); if (pow(2, 10) != 1024) fail(); if (min(3, max(1, 2)) != 2) fail();"
+                         "if (floor(-1.5) != -2) fail(); if (ceil(1.5) != 2) fail(); if (abs(-3) != 3) fail();"
+                         "if (len(\"lox\") != 3) fail(); if (clock() < 0) fail(); if (nanotime() < 0) fail();"),
+              vm::INTERPRET_OK);
+    EXPECT_EQ(run_source("sqrt();"), vm::INTERPRET_RUNTIME_ERROR);
+    EXPECT_EQ(run_source("sqrt(\"4\");"), vm::INTERPRET_RUNTIME_ERROR);
+
+    // the arguments are the slots the caller pushed
+    m_vm.define_native("sum3", 3, [](const std::shared_ptr<Object>* args, u8 arg_count) -> std::shared_ptr<Object> {
+        double sum = 0;
+        for (u8 i = 0; i < arg_count; i++) {
+            sum += std::static_pointer_cast<NumberObject>(args[i])->value;
+        }
+        return std::make_shared<NumberObject>(sum);
+    });
+    EXPECT_EQ(run_source("fun f() { return sum3(1, 2, 3) + 1; } if (f() != 7) fail();"), vm::INTERPRET_OK);
+
+    // natives are defined again after a reset
+    m_vm.reset();
+    EXPECT_EQ(run_source("if (len(\"\") != 0) fail();"), vm::INTERPRET_OK);
+}
+
+namespace {
+double add(double lhs, double rhs) {
+    return lhs + rhs;
+}
+
+int count_vowels(std::string_view text) {
+    return static_cast<int>(std::count_if(text.begin(), text.end(), [](char c) { return std::string_view{"aeiou"}.find(c) != std::string_view::npos; }));
+}
+
+std::string shout(const std::string& text) {
+    return text + "!";
+}
+
+bool is_even(int value) {
+    return value % 2 == 0;
+}
+
+int g_touched = 0;
+
+void touch() {
+    g_touched++;
+}
+} // namespace
+
+TEST_F(VirtualMachineTest, test_embedding) {
+    m_vm.bind<&add>("add");
+    m_vm.bind<&count_vowels>("count_vowels");
+    m_vm.bind<&shout>("shout");
+    m_vm.bind<&is_even>("is_even");
+    m_vm.bind<&touch>("touch");
+    EXPECT_EQ(run_source("if (add(1, 2) != 3) fail(); if (count_vowels(\"embedding\") != 3) fail();"
+                         "if (shout(\"lox\") != \"lox!\") fail(); if (!is_even(4)) fail(); if (is_even(3)) fail();"
+                         "if (touch() != nil) fail();"),
+              vm::INTERPRET_OK);
+    EXPECT_EQ(g_touched, 1);
+    EXPECT_EQ(run_source("add(1, \"2\");"), vm::INTERPRET_RUNTIME_ERROR);
+    EXPECT_EQ(run_source("add(1);"), vm::INTERPRET_RUNTIME_ERROR);
+
+    // script functions, closures and classes called from C++ after the script ran
+    EXPECT_EQ(run_source("fun mul(a, b) { return a * b; }"
+                         "fun greet(name) { return \"hello \" + name; }"
+                         "fun counter() { var n = 0; fun next() { n = n + 1; return n; } return next; }"
+                         "var next = counter();"
+                         "fun down(n) { if (n == 0) return 0; return down(n - 1); }"
+                         "fun half(n) { return add(n, 0) / 2; }"
+                         "fun tail_native(n) { return add(n, 1); }"
+                         "fun negate(n) { return -n; }"
+                         "fun twice(n) { return n * 2; }"
+                         "fun count_to(n) { var i = 0; while (i < n) i = i + 1; return i; }"
+                         "class Point { init(x) { this.x = x; } }"),
+              vm::INTERPRET_OK);
+    EXPECT_EQ(m_vm.call<double>("mul", 6, 7), 42);
+    EXPECT_EQ(m_vm.call<std::string>("greet", "lox"), "hello lox");
+    EXPECT_EQ(m_vm.call<int>("next"), 1);
+    EXPECT_EQ(m_vm.call<int>("next"), 2);
+    EXPECT_EQ(m_vm.call<int>("down", 10000), 0);
+    EXPECT_EQ(m_vm.call<double>("half", 5), 2.5);
+    EXPECT_EQ(m_vm.call<double>("tail_native", 1), 2);
+    EXPECT_EQ(m_vm.call<double>("add", 1.5, 2), 3.5);
+    std::optional<std::shared_ptr<Object>> point = m_vm.call("Point", 3);
+    ASSERT_TRUE(point.has_value());
+    EXPECT_EQ((*point)->type, ObjectType::OBJ_INSTANCE);
+
+    // a result of another type, a runtime error and an unknown name give nothing
+    EXPECT_EQ(m_vm.call<double>("greet", "lox"), std::nullopt);
+    EXPECT_EQ(m_vm.call<double>("negate", "a"), std::nullopt);
+    EXPECT_EQ(m_vm.call<double>("twice", std::string{"x"}), std::nullopt);
+    EXPECT_EQ(m_vm.call<double>("count_to", std::string{"x"}), std::nullopt);
+    EXPECT_EQ(m_vm.call<double>("missing"), std::nullopt);
+    EXPECT_EQ(m_vm.call<double>("mul", 1), std::nullopt);
+
+    // the virtual machine is usable after a failed call
+    EXPECT_EQ(m_vm.call<double>("mul", 2, 3), 6);
+    EXPECT_EQ(m_vm.call<double>("count_to", 3), 3);
+    EXPECT_EQ(run_source("if (mul(2, 2) != 4) fail();"), vm::INTERPRET_OK);
+}
+
+TEST_F(VirtualMachineTest, test_counting_loops) {
+
+    // the initializer, then the two loop instructions
+    auto chunk = compile_source("for (var i = 0; i < 3; i = i + 1) {}");
+    EXPECT_EQ(chunk->get_code()[2], OpCode::OP_FOR_PREP);
+    EXPECT_EQ(chunk->get_code()[8], OpCode::OP_FOR_LOOP);
+    EXPECT_EQ(chunk->max_stack_depth(), 3);
+    chunk = compile_source("for (var i = 1; i < 3; i = i * 2) {}");
+    EXPECT_EQ(chunk->get_code()[2], OpCode::OP_GET_LOCAL);
+
+    EXPECT_EQ(run_source("var s = 0; for (var i = 0; i < 10; i = i + 1) s = s + i; if (s != 45) fail();"
+                         "s = 0; for (var i = 1; i <= 10; i = i + 1) s = s + i; if (s != 55) fail();"
+                         "s = 0; for (var i = 10; i > 0; i = i - 1) s = s + i; if (s != 55) fail();"
+                         "s = 0; for (var i = 10; i >= 0; i = i - 2) s = s + 1; if (s != 6) fail();"
+                         "s = 0; for (var i = 0; i < 1; i = i + 0.25) s = s + 1; if (s != 4) fail();"
+                         "for (var i = 5; i < 5; i = i + 1) fail();"),
+              vm::INTERPRET_OK);
+    // the body may change the variable and the bound, or keep the variable's value
+    EXPECT_EQ(run_source("{ var n = 5; var c = 0; for (var i = 0; i < n; i = i + 1) { c = c + 1; if (i == 0) n = 3; } if (c != 3) fail(); }"
+                         "{ var c = 0; for (var i = 0; i < 10; i = i + 1) { c = c + 1; i = i + 1; } if (c != 5) fail(); }"
+                         "{ var saved; for (var i = 0; i < 10; i = i + 1) saved = i; if (saved != 9) fail(); }"),
+              vm::INTERPRET_OK);
+    // closures capture the one variable of the loop
+    EXPECT_EQ(run_source("var f; var c = 0;"
+                         "for (var i = 0; i < 3; i = i + 1) { fun get() { return i; } f = get; } if (f() != 3) fail();"
+                         "for (var i = 0; i < 10; i = i + 1) { fun skip() { i = i + 4; } skip(); c = c + 1; } if (c != 2) fail();"),
+              vm::INTERPRET_OK);
+    // a variable that is no longer a number is stepped like `i = i + 1`
+    EXPECT_EQ(run_source("for (var i = 0; i < 3; i = i + 1) { i = \"x\"; }"), vm::INTERPRET_RUNTIME_ERROR);
+    // a counter or bound that is not a number ends the script, the code after the loop doesn't run
+    EXPECT_EQ(compile_source("{ var n = 3; for (var i = \"a\"; i < n; i = i + 1) {} }")->get_code()[4], OpCode::OP_FOR_PREP);
+    EXPECT_EQ(run_source("var after = false; { for (var i = \"a\"; i < 3; i = i + 1) {} after = true; }"), vm::INTERPRET_RUNTIME_ERROR);
+    EXPECT_EQ(run_source("{ var n = \"x\"; for (var i = 0; i < n; i = i + 1) {} after = true; }"), vm::INTERPRET_RUNTIME_ERROR);
+    EXPECT_EQ(run_source("{ var n = 3; for (var i = 0; i < n; i = i + 1) n = nil; after = true; }"), vm::INTERPRET_RUNTIME_ERROR);
+    EXPECT_EQ(run_source("{ for (var i = 3; i > 0; i = i - 1) i = \"x\"; after = true; }"), vm::INTERPRET_RUNTIME_ERROR);
+    EXPECT_EQ(run_source("if (after) fail();"), vm::INTERPRET_OK);
+}
+
+TEST_F(VirtualMachineTest, test_small_integers) {
+    // shared integers and booleans behave like fresh ones, -0 stays negative
+    EXPECT_EQ(run_source("var a = 2 + 3; var b = 10 - 5; if (a != b) fail(); if (a * 2 != 10) fail();"
+                         "if (1 / (0 * -1) > 0) fail(); if (1 / (0 * 1) < 0) fail(); if (-0 != 0) fail();"
+                         "if (16383 + 1 != 16384) fail(); if (-1024 - 1 != -1025) fail(); if (0.5 + 0.5 != 1) fail();"
+                         "if (7 / 2 != 3.5) fail(); if ((1 < 2) != true) fail(); if (!(2 < 1) != true) fail();"),
+              vm::INTERPRET_OK);
+    // a loop counter passing through the shared range keeps counting
+    EXPECT_EQ(run_source("var c = 0; for (var i = 16000; i < 17000; i = i + 1) c = c + 1; if (c != 1000) fail();"
+                         "c = 0; for (var i = 17000; i > 16000; i = i - 1) c = c + 1; if (c != 1000) fail();"),
+              vm::INTERPRET_OK);
+}
+
+TEST_F(VirtualMachineTest, test_lists) {
+    EXPECT_EQ(run_source("var a = [1, 2, 3]; if (len(a) != 3) fail(); if (a[0] + a[2] != 4) fail();"
+                         "a[1] = 10; if (a[1] != 10) fail(); append(a, 0.5); if (len(a) != 4) fail(); if (a[3] != 0.5) fail();"
+                         "if (len([]) != 0) fail(); if (len(\"abc\") != 3) fail(); var b = a; b[0] = 7; if (a[0] != 7) fail();"
+                         "if ((a[2] = 5) != 5) fail(); if ([1] == [1]) fail(); if (a != b) fail();"),
+              vm::INTERPRET_OK);
+    // a list of numbers stays the same list once it holds other values
+    EXPECT_EQ(run_source("var a = [1, 2]; var b = a; a[0] = \"x\"; if (b[0] != \"x\") fail(); if (b[1] != 2) fail();"
+                         "append(b, nil); if (a[2] != nil) fail(); a[1] = 3; if (a[1] != 3) fail();"
+                         "var c = [[1], [true, \"y\"]]; c[0][0] = c[1][1]; if (c[0][0] != \"y\") fail();"),
+              vm::INTERPRET_OK);
+    EXPECT_EQ(run_source("var s = []; for (var i = 0; i < 100; i = i + 1) append(s, i * i);"
+                         "var t = 0; for (var i = 0; i < len(s); i = i + 1) t = t + s[i]; if (t != 328350) fail();"),
+              vm::INTERPRET_OK);
+
+    EXPECT_EQ(run_source("[1, 2][2];"), vm::INTERPRET_RUNTIME_ERROR);
+    EXPECT_EQ(run_source("[1, 2][-1];"), vm::INTERPRET_RUNTIME_ERROR);
+    EXPECT_EQ(run_source("[1, 2][0.5];"), vm::INTERPRET_RUNTIME_ERROR);
+    EXPECT_EQ(run_source("[1, 2][\"0\"] = 1;"), vm::INTERPRET_RUNTIME_ERROR);
+    EXPECT_EQ(run_source("var a = \"ab\"; a[0];"), vm::INTERPRET_RUNTIME_ERROR);
+    EXPECT_EQ(run_source("append(1, 2);"), vm::INTERPRET_RUNTIME_ERROR);
+}
+
+TEST_F(VirtualMachineTest, test_many_globals) {
+    std::string source;
+    for (int i = 0; i < 100; i++) {
+        source += "var g" + std::to_string(i) + " = " + std::to_string(i) + ";";
+    }
+    source += "if (g0 + g99 != 99) fail();";
+    EXPECT_EQ(run_source(std::move(source)), vm::INTERPRET_OK);
+}
+
 int main(int argc, char* argv[]) {
     ::testing::InitGoogleMock(&argc, argv);
     return RUN_ALL_TESTS();